@@ -0,0 +1,141 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Imports the ZopfliDB/xx/xx/xx/xx/MODE-SIZE.dat tree written by older versions
+of --statsdb into the single ZopfliDB.dat file. Run it in the directory that
+holds ZopfliDB, the tree itself is left as it is. Must be built with the same
+floating point precision as the zopfli binary that is going to use the result.
+*/
+
+#include "../zopfli/defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "../zopfli/statsdb.h"
+#include "../zopfli/util.h"
+
+static unsigned long imported = 0, skipped = 0;
+
+static size_t freadst(void* buffer, unsigned char sizetsize, FILE *stream) {
+  size_t a = 0, b;
+  unsigned char byte;
+  for(b = 0; b < sizetsize && b < sizeof(size_t); ++b) {
+    a += fread(&byte, 1, 1, stream);
+    ((unsigned char *)buffer)[b] = byte;
+  }
+  for(;b < sizeof(size_t); ++b) {
+    ((unsigned char *)buffer)[b] = 0;
+  }
+  return a;
+}
+
+/* Reads one old style .dat file, returns 1 if it was stored in ZopfliDB.dat. */
+static int ImportFile(const char* path, ZopfliBestStats* statsdb) {
+  FILE *file;
+  size_t i;
+  unsigned char check, sizetsize;
+  int ok = 1;
+  file = fopen(path, "rb");
+  if(!file) return 0;
+  if(fread(&check,sizeof(check),1,file) != 1 || check != BESTSTATSDBVER) ok = 0;
+  if(ok && (fread(&check,sizeof(check),1,file) != 1 || check != sizeof(zfloat))) ok = 0;
+  if(ok && fread(&sizetsize,sizeof(sizetsize),1,file) != 1) ok = 0;
+  if(ok && fread(&statsdb->startiteration,
+                 sizeof(statsdb->startiteration),1,file) != 1) ok = 0;
+  for(i = 0; ok && i < ZOPFLI_NUM_LL; ++i)
+    if(freadst(&statsdb->beststats->litlens[i], sizetsize, file) != sizetsize) ok = 0;
+  for(i = 0; ok && i < ZOPFLI_NUM_D; ++i)
+    if(freadst(&statsdb->beststats->dists[i], sizetsize, file) != sizetsize) ok = 0;
+  if(ok && fread(statsdb->beststats->ll_symbols, sizeof(zfloat),
+                 ZOPFLI_NUM_LL, file) != ZOPFLI_NUM_LL) ok = 0;
+  if(ok && fread(statsdb->beststats->d_symbols, sizeof(zfloat),
+                 ZOPFLI_NUM_D, file) != ZOPFLI_NUM_D) ok = 0;
+  fclose(file);
+  return ok && ZopfliStatsDBSave(statsdb);
+}
+
+/*
+Walks the 4 levels of CRC32 byte directories, collecting the CRC32 from their
+names, then imports the files found in the last level.
+*/
+static void Walk(const char* dir, int depth, unsigned long crc,
+                 ZopfliBestStats* statsdb) {
+  DIR* d = opendir(dir);
+  struct dirent* e;
+  if(!d) return;
+  while((e = readdir(d)) != NULL) {
+    char path[512];
+    if(e->d_name[0] == '.') continue;
+    if(strlen(dir) + strlen(e->d_name) + 2 > sizeof(path)) continue;
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, e->d_name);
+    if(depth < 4) {
+      unsigned long byte;
+      char* end;
+      byte = strtoul(e->d_name, &end, 16);
+      if(*end != '\0' || end - e->d_name != 2) continue;
+      Walk(path, depth + 1, (crc << 8) | byte, statsdb);
+    } else {
+      unsigned mode;
+      unsigned long blocksize;
+      char dummy;
+      if(sscanf(e->d_name, "%x-%lu.da%c", &mode, &blocksize, &dummy) != 3) continue;
+      statsdb->mode = (char)mode;
+      statsdb->blocksize = blocksize;
+      statsdb->blockcrc = crc;
+      /* Old files don't know the cost, any new result replaces them. */
+      statsdb->cost = ZOPFLI_LARGE_FLOAT;
+      if(ImportFile(path, statsdb)) {
+        ++imported;
+      } else {
+        ++skipped;
+        fprintf(stderr, "Skipped: %s\n", path);
+      }
+      if((imported + skipped) % 1000 == 0) {
+        fprintf(stderr, "Imported: %lu  \r", imported);
+      }
+    }
+  }
+  closedir(d);
+}
+
+int main(int argc, char* argv[]) {
+  size_t litlens[ZOPFLI_NUM_LL], dists[ZOPFLI_NUM_D];
+  zfloat ll_symbols[ZOPFLI_NUM_LL], d_symbols[ZOPFLI_NUM_D];
+  SymbolStats stats;
+  ZopfliBestStats statsdb;
+  const char* dir = argc > 1 ? argv[1] : "ZopfliDB";
+  fprintf(stderr,"ZopfliDB importer by Mr_KrzYch00\n\n");
+  if(argc > 2 || (argc > 1 && argv[1][0] == '-')) {
+    fprintf(stderr,"Imports the ZopfliDB directory tree of older --statsdb versions\n"
+    "into the " ZOPFLI_STATSDB_FILE " file in the current directory.\n\n"
+    "Usage: statsdbimport [DIRECTORY] (d: ZopfliDB)\n");
+    return EXIT_FAILURE;
+  }
+  stats.litlens = litlens;
+  stats.dists = dists;
+  stats.ll_symbols = ll_symbols;
+  stats.d_symbols = d_symbols;
+  statsdb.beststats = &stats;
+  Walk(dir, 0, 0, &statsdb);
+  fprintf(stderr, "Imported: %lu, skipped: %lu\n", imported, skipped);
+  return skipped == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
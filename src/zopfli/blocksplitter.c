@@ -22,7 +22,9 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "blocksplitter.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "deflate.h"
 #include "squeeze.h"
@@ -36,13 +38,161 @@ context: for your implementation
 */
 typedef zfloat FindMinimumFun(size_t i, void* context);
 
+/*
+Memo of block cost estimates, keyed by the LZ77 range. The same ranges are
+estimated again and again: the halves of the chosen split become the blocks
+of later rounds, and FindMinimum may revisit points. One memo is used per
+ZopfliBlockSplitLZ77 run, during which the mode, and so the cost of a
+range, doesn't change. Guarded by a mutex since FindMinimum may fill it from
+several threads.
+*/
+typedef struct CostMemo {
+  size_t* starts;
+  size_t* ends;  /* 0 marks an empty slot, a block never ends at 0. */
+  zfloat* costs;
+  size_t size;  /* Amount of slots, always a power of two. */
+  size_t used;
+  pthread_mutex_t mutex;
+} CostMemo;
+
+static void InitCostMemo(CostMemo* memo) {
+  memo->size = 1024;
+  memo->used = 0;
+  memo->starts = (size_t*)ZopfliMalloc(sizeof(*memo->starts) * memo->size);
+  memo->ends = (size_t*)ZopfliCalloc(memo->size, sizeof(*memo->ends));
+  memo->costs = (zfloat*)ZopfliMalloc(sizeof(*memo->costs) * memo->size);
+  if (!memo->starts || !memo->ends || !memo->costs) exit(-1);
+  pthread_mutex_init(&memo->mutex, NULL);
+}
+
+static void CleanCostMemo(CostMemo* memo) {
+  pthread_mutex_destroy(&memo->mutex);
+  ZopfliFree(memo->starts);
+  ZopfliFree(memo->ends);
+  ZopfliFree(memo->costs);
+}
+
+/* Returns the slot holding lstart-lend, or the empty slot where it belongs. */
+static size_t CostMemoSlot(const CostMemo* memo, size_t lstart, size_t lend) {
+  size_t i = (lstart * 2654435761u + lend * 40503u) & (memo->size - 1);
+  while (memo->ends[i] != 0 &&
+         (memo->starts[i] != lstart || memo->ends[i] != lend)) {
+    i = (i + 1) & (memo->size - 1);
+  }
+  return i;
+}
+
+static int CostMemoGet(CostMemo* memo, size_t lstart, size_t lend,
+                       zfloat* cost) {
+  size_t i;
+  int found;
+  pthread_mutex_lock(&memo->mutex);
+  i = CostMemoSlot(memo, lstart, lend);
+  found = memo->ends[i] != 0;
+  if (found) *cost = memo->costs[i];
+  pthread_mutex_unlock(&memo->mutex);
+  return found;
+}
+
+static void CostMemoPut(CostMemo* memo, size_t lstart, size_t lend,
+                        zfloat cost) {
+  size_t i;
+  pthread_mutex_lock(&memo->mutex);
+  if ((memo->used + 1) * 2 > memo->size) {
+    /* Keep at most half of the slots in use, rehash into twice the size. */
+    CostMemo old = *memo;
+    memo->size *= 2;
+    memo->used = 0;
+    memo->starts = (size_t*)ZopfliMalloc(sizeof(*memo->starts) * memo->size);
+    memo->ends = (size_t*)ZopfliCalloc(memo->size, sizeof(*memo->ends));
+    memo->costs = (zfloat*)ZopfliMalloc(sizeof(*memo->costs) * memo->size);
+    if (!memo->starts || !memo->ends || !memo->costs) exit(-1);
+    for (i = 0; i < old.size; ++i) {
+      if (old.ends[i] != 0) {
+        size_t j = CostMemoSlot(memo, old.starts[i], old.ends[i]);
+        memo->starts[j] = old.starts[i];
+        memo->ends[j] = old.ends[i];
+        memo->costs[j] = old.costs[i];
+        ++memo->used;
+      }
+    }
+    ZopfliFree(old.starts);
+    ZopfliFree(old.ends);
+    ZopfliFree(old.costs);
+  }
+  i = CostMemoSlot(memo, lstart, lend);
+  if (memo->ends[i] == 0) {
+    memo->starts[i] = lstart;
+    memo->ends[i] = lend;
+    memo->costs[i] = cost;
+    ++memo->used;
+  }
+  pthread_mutex_unlock(&memo->mutex);
+}
+
 typedef struct SplitCostContext {
   const ZopfliLZ77Store* lz77;
   const ZopfliOptions* options;
+  CostMemo* memo;
   size_t start;
   size_t end;
 } SplitCostContext;
 
+typedef struct FindMinimumWorker {
+  FindMinimumFun* f;
+  void* context;
+  const size_t* p;
+  zfloat* vp;
+  size_t n;
+  size_t first;
+  size_t step;
+  const ZopfliAllocator* allocator;
+} FindMinimumWorker;
+
+static void *FindMinimumThread(void *a) {
+  FindMinimumWorker* w = (FindMinimumWorker*)a;
+  size_t i;
+  ZopfliSetAllocator(w->allocator);
+  for (i = w->first; i < w->n; i += w->step) {
+    w->vp[i] = w->f(w->p[i], w->context);
+  }
+  return 0;
+}
+
+/*
+Sets vp[i] to f(p[i]) for all n points. With --t# above 1 the points are
+dealt out round robin to that many threads, since f is expensive and the
+points of one round don't depend on each other.
+*/
+static void EvaluatePoints(FindMinimumFun f, void* context,
+                           const size_t* p, zfloat* vp, size_t n,
+                           unsigned numthreads) {
+  size_t i;
+  if (numthreads > n) numthreads = n;
+  if (numthreads < 2) {
+    for (i = 0; i < n; i++) vp[i] = f(p[i], context);
+  } else {
+    pthread_t* thr = (pthread_t*)ZopfliMalloc(sizeof(*thr) * numthreads);
+    FindMinimumWorker* w =
+        (FindMinimumWorker*)ZopfliMalloc(sizeof(*w) * numthreads);
+    if (!thr || !w) exit(-1); /* Allocation failed. */
+    for (i = 0; i < numthreads; i++) {
+      w[i].f = f;
+      w[i].context = context;
+      w[i].p = p;
+      w[i].vp = vp;
+      w[i].n = n;
+      w[i].first = i;
+      w[i].step = numthreads;
+      w[i].allocator = ZopfliGetAllocator();
+      pthread_create(&thr[i], NULL, FindMinimumThread, (void *)&w[i]);
+    }
+    for (i = 0; i < numthreads; i++) pthread_join(thr[i], NULL);
+    ZopfliFree(w);
+    ZopfliFree(thr);
+  }
+}
+
 /*
 Finds minimum of function f(i) where i is of type size_t, f(i) is of type
 zfloat, i is in range start-end (excluding end).
@@ -62,21 +212,27 @@ static size_t FindMinimum(FindMinimumFun f, void* context,
     zfloat best = ZOPFLI_LARGE_FLOAT;
     size_t result = start;
     size_t i;
+    size_t *p = (size_t*)ZopfliMalloc(sizeof(*p) * (end - start));
+    zfloat *vp = (zfloat*)ZopfliMalloc(sizeof(*vp) * (end - start));
+    for (i = start; i < end; i++) p[i - start] = i;
+    EvaluatePoints(f, context, p, vp, end - start, c->options->numthreads);
     for (i = start; i < end; i++) {
-      zfloat v = f(i, context);
+      zfloat v = vp[i - start];
       if (v < best) {
         best = v;
         result = i;
       }
     }
+    ZopfliFree(p);
+    ZopfliFree(vp);
     if(c->options->verbose>5) fprintf(stderr," [%lu - %lu] Best: %.0f\n",(unsigned long)start,(unsigned long)end,(zpfloat)best);
     *smallest = best;
     return result;
   } else {
     /* Try to find minimum faster by recursively checking multiple points. */
     size_t i;
-    size_t *p = (size_t*)malloc(sizeof(*p) * c->options->findminimumrec);
-    zfloat *vp = (zfloat*)malloc(sizeof(*vp) * c->options->findminimumrec);
+    size_t *p = (size_t*)ZopfliMalloc(sizeof(*p) * c->options->findminimumrec);
+    zfloat *vp = (zfloat*)ZopfliMalloc(sizeof(*vp) * c->options->findminimumrec);
     size_t besti;
     zfloat best;
     zfloat lastbest = ZOPFLI_LARGE_FLOAT;
@@ -87,8 +243,9 @@ static size_t FindMinimum(FindMinimumFun f, void* context,
 
       for (i = 0; i < c->options->findminimumrec; i++) {
         p[i] = start + (i + 1) * ((end - start) / (c->options->findminimumrec + 1));
-        vp[i] = f(p[i], context);
       }
+      EvaluatePoints(f, context, p, vp, c->options->findminimumrec,
+                     c->options->numthreads);
       besti = 0;
       best = vp[0];
       for (i = 1; i < c->options->findminimumrec; i++) {
@@ -110,8 +267,8 @@ static size_t FindMinimum(FindMinimumFun f, void* context,
       if(c->options->verbose>5) fprintf(stderr," [%lu - %lu] Best: %.0f\n",(unsigned long)start,(unsigned long)end,(zpfloat)best);
     }
     *smallest = lastbest;
-    free(p);
-    free(vp);
+    ZopfliFree(p);
+    ZopfliFree(vp);
     return pos;
   }
 }
@@ -125,11 +282,16 @@ litlens: lz77 lit/lengths
 dists: ll77 distances
 lstart: start of block
 lend: end of block (not inclusive)
+memo: remembers earlier estimates, may be NULL
 */
 static zfloat EstimateCost(const ZopfliOptions* options,
                            const ZopfliLZ77Store* lz77,
-                           size_t lstart, size_t lend) {
-  return ZopfliCalculateBlockSizeAutoType(options, lz77, lstart, lend, 0);
+                           size_t lstart, size_t lend, CostMemo* memo) {
+  zfloat cost;
+  if (memo != NULL && CostMemoGet(memo, lstart, lend, &cost)) return cost;
+  cost = ZopfliCalculateBlockSizeAutoType(options, lz77, lstart, lend, 0);
+  if (memo != NULL) CostMemoPut(memo, lstart, lend, cost);
+  return cost;
 }
 
 /*
@@ -139,8 +301,8 @@ type: FindMinimumFun
 */
 static zfloat SplitCost(size_t i, void* context) {
   SplitCostContext* c = (SplitCostContext*)context;
-  return EstimateCost(c->options, c->lz77, c->start, i) +
-      EstimateCost(c->options, c->lz77, i, c->end);
+  return EstimateCost(c->options, c->lz77, c->start, i, c->memo) +
+      EstimateCost(c->options, c->lz77, i, c->end, c->memo);
 }
 
 static void AddSorted(size_t value, size_t** out, size_t* outsize) {
@@ -203,7 +365,7 @@ static void PrintBlockSplitPoints(const ZopfliLZ77Store* lz77,
   assert(npoints == nlz77points);
   PrintPoints(&splitpoints,&npoints,0);
 
-  free(splitpoints);
+  ZopfliFree(splitpoints);
 }
 
 /*
@@ -239,6 +401,246 @@ static int FindLargestSplittableBlock(
   return found;
 }
 
+typedef struct DPCostContext {
+  const ZopfliLZ77Store* lz77;
+  const ZopfliOptions* options;
+  size_t end;
+} DPCostContext;
+
+/* Cost of the block from i to the end given in context. */
+static zfloat DPCost(size_t i, void* context) {
+  DPCostContext* c = (DPCostContext*)context;
+  return EstimateCost(c->options, c->lz77, i, c->end, NULL);
+}
+
+/* Bits needed to code the counted symbols with their own entropy. */
+static zfloat HistogramEntropy(const size_t* counts, size_t n) {
+  size_t i;
+  size_t total = 0;
+  zfloat result = 0;
+  for (i = 0; i < n; i++) total += counts[i];
+  for (i = 0; i < n; i++) {
+    if (counts[i] != 0) {
+      result += counts[i] * ZLOG((zfloat)total / counts[i]) * ZOPFLI_INVLOG2;
+    }
+  }
+  return result;
+}
+
+typedef struct ChangePoint {
+  size_t pos;
+  zfloat gain;
+} ChangePoint;
+
+static int CompareChangePoints(const void* a, const void* b) {
+  zfloat ga = ((const ChangePoint*)a)->gain;
+  zfloat gb = ((const ChangePoint*)b)->gain;
+  return ga < gb ? 1 : ga > gb ? -1 : 0;
+}
+
+/*
+Adds up to maxpoints positions where the symbol statistics change the most
+to the sorted candidates. For every position the entropy of the window
+before and after it is compared with the entropy of both windows together,
+the bits that splitting there would save if trees were free. Local maxima
+above the average gain are taken, best first.
+*/
+static void AddChangePoints(const ZopfliLZ77Store* lz77, size_t window,
+                            size_t maxpoints,
+                            size_t** candidates, size_t* ncandidates) {
+  size_t ll_a[ZOPFLI_NUM_LL], d_a[ZOPFLI_NUM_D];
+  size_t ll_b[ZOPFLI_NUM_LL], d_b[ZOPFLI_NUM_D];
+  size_t fine = window / 4;
+  size_t n = 0, npeaks = 0;
+  size_t i, j;
+  zfloat* gains;
+  zfloat average = 0;
+  ChangePoint* peaks;
+
+  if (fine == 0) fine = 1;
+  if (lz77->size < 2 * window) return;
+  n = (lz77->size - 2 * window) / fine + 1;
+  gains = (zfloat*)ZopfliMalloc(sizeof(*gains) * n);
+  peaks = (ChangePoint*)ZopfliMalloc(sizeof(*peaks) * n);
+  if (!gains || !peaks) exit(-1); /* Allocation failed. */
+
+  for (i = 0; i < n; i++) {
+    size_t pos = window + i * fine;
+    zfloat split;
+    ZopfliLZ77GetHistogram(lz77, pos - window, pos, ll_a, d_a);
+    ZopfliLZ77GetHistogram(lz77, pos, pos + window, ll_b, d_b);
+    split = HistogramEntropy(ll_a, ZOPFLI_NUM_LL)
+          + HistogramEntropy(d_a, ZOPFLI_NUM_D)
+          + HistogramEntropy(ll_b, ZOPFLI_NUM_LL)
+          + HistogramEntropy(d_b, ZOPFLI_NUM_D);
+    for (j = 0; j < ZOPFLI_NUM_LL; j++) ll_a[j] += ll_b[j];
+    for (j = 0; j < ZOPFLI_NUM_D; j++) d_a[j] += d_b[j];
+    gains[i] = HistogramEntropy(ll_a, ZOPFLI_NUM_LL)
+             + HistogramEntropy(d_a, ZOPFLI_NUM_D) - split;
+    average += gains[i];
+  }
+  average /= n;
+
+  for (i = 0; i < n; i++) {
+    if (gains[i] <= average) continue;
+    if (i > 0 && gains[i - 1] >= gains[i]) continue;
+    if (i + 1 < n && gains[i + 1] > gains[i]) continue;
+    peaks[npeaks].pos = window + i * fine;
+    peaks[npeaks].gain = gains[i];
+    ++npeaks;
+  }
+  qsort(peaks, npeaks, sizeof(*peaks), CompareChangePoints);
+  if (npeaks > maxpoints) npeaks = maxpoints;
+  for (i = 0; i < npeaks; i++) {
+    AddSorted(peaks[i].pos, candidates, ncandidates);
+  }
+
+  ZopfliFree(gains);
+  ZopfliFree(peaks);
+}
+
+/*
+Block splitting by dynamic programming (--dpsplit). Instead of splitting
+blocks in two one at a time, it takes a set of candidate split points (evenly
+spaced ones and those where the statistics change the most), estimates the
+cost of every block between two candidates and finds the cheapest way to
+cover the whole store with at most maxblocks blocks. The cost estimates of
+one candidate are done on --t# threads. The expensive fixed block
+calculations of --slowsplit would have to run for every pair of candidates,
+so they are not used here.
+*/
+static void BlockSplitDP(const ZopfliOptions* options,
+                         const ZopfliLZ77Store* lz77, size_t maxblocks,
+                         size_t** splitpoints, size_t* npoints) {
+  ZopfliOptions o = *options;
+  DPCostContext c;
+  size_t* candidates = 0;  /* Includes 0 and lz77->size. */
+  size_t ncandidates = 0;
+  size_t step = lz77->size / ZOPFLI_DPSPLIT_GRID;
+  size_t numblocks = 1;
+  size_t i, j, k, b;
+  zfloat* costs;  /* Block i-j at j * (j - 1) / 2 + i. */
+  zfloat* best;  /* Cheapest cover up to candidate j with b blocks. */
+  size_t* from;  /* Candidate where the last block of that cover starts. */
+  size_t layers;
+  int limited = maxblocks > 0;
+  size_t* chosen = 0;  /* Chosen candidates, last first. */
+  size_t nchosen = 0;
+  CostMemo memo;
+
+  o.mode &= ~0x0080;
+  if (step < ZOPFLI_DPSPLIT_MINSTEP) step = ZOPFLI_DPSPLIT_MINSTEP;
+  for (i = 0; i < lz77->size; i += step) {
+    ZOPFLI_APPEND_DATA(i, &candidates, &ncandidates);
+  }
+  AddChangePoints(lz77, step, ZOPFLI_DPSPLIT_GRID / 2,
+                  &candidates, &ncandidates);
+  ZOPFLI_APPEND_DATA(lz77->size, &candidates, &ncandidates);
+  for (i = 1, j = 1; i < ncandidates; i++) {
+    if (candidates[i] != candidates[j - 1]) candidates[j++] = candidates[i];
+  }
+  ncandidates = j;
+
+  costs = (zfloat*)ZopfliMalloc(sizeof(*costs) * ncandidates * (ncandidates - 1) / 2);
+  if (!costs) exit(-1); /* Allocation failed. */
+  c.lz77 = lz77;
+  c.options = &o;
+  for (j = 1; j < ncandidates; j++) {
+    c.end = candidates[j];
+    EvaluatePoints(DPCost, &c, candidates, costs + j * (j - 1) / 2, j,
+                   options->numthreads);
+    if(options->verbose>0 && options->verbose<6)
+      fprintf(stderr,"Initializing blocks: %lu / %lu    \r",
+              (unsigned long)j, (unsigned long)(ncandidates - 1));
+  }
+
+  /*
+  Without a block limit one row is enough: the cheapest cover up to every
+  candidate. With a limit, row b holds covers made of exactly b + 1 blocks,
+  and there can't be more blocks than spaces between candidates.
+  */
+  layers = !limited ? 1
+      : maxblocks < ncandidates - 1 ? maxblocks : ncandidates - 1;
+  best = (zfloat*)ZopfliMalloc(sizeof(*best) * layers * ncandidates);
+  from = (size_t*)ZopfliMalloc(sizeof(*from) * layers * ncandidates);
+  if (!best || !from) exit(-1); /* Allocation failed. */
+  for (j = 0; j < ncandidates; j++) {
+    best[j] = j == 0 ? 0 : costs[j * (j - 1) / 2];
+    from[j] = 0;
+  }
+  for (b = 0; b < layers; b++) {
+    zfloat* prev = best + (limited ? b - 1 : 0) * ncandidates;
+    zfloat* cur = best + b * ncandidates;
+    if (limited) {
+      if (b == 0) continue;
+      for (j = 0; j < ncandidates; j++) cur[j] = ZOPFLI_LARGE_FLOAT;
+    }
+    for (j = 1; j < ncandidates; j++) {
+      for (i = limited ? b : 1; i < j; i++) {
+        zfloat cost = prev[i] + costs[j * (j - 1) / 2 + i];
+        if (cost < cur[j]) {
+          cur[j] = cost;
+          from[b * ncandidates + j] = i;
+        }
+      }
+    }
+  }
+
+  /* Walk the chosen blocks back from the end. */
+  j = ncandidates - 1;
+  b = 0;
+  for (k = 1; k < layers; k++) {
+    if (best[k * ncandidates + j] < best[b * ncandidates + j]) b = k;
+  }
+  for (;;) {
+    k = from[b * ncandidates + j];
+    if (k == 0) break;
+    ZOPFLI_APPEND_DATA(k, &chosen, &nchosen);
+    j = k;
+    if (limited) --b;
+  }
+  assert(!limited || nchosen < maxblocks);
+
+  /*
+  The best split point is rarely exactly on a candidate, look for it between
+  the neighbouring candidates the same way the default splitter does.
+  */
+  InitCostMemo(&memo);
+  j = 0;  /* The split point before the one being refined. */
+  for (i = nchosen; i-- > 0;) {
+    SplitCostContext sc;
+    size_t llpos;
+    zfloat splitcost;
+    k = chosen[i];
+    sc.lz77 = lz77;
+    sc.options = &o;
+    sc.memo = &memo;
+    sc.start = j;
+    sc.end = i > 0 ? candidates[chosen[i - 1]] : lz77->size;
+    llpos = FindMinimum(SplitCost, &sc,
+                        (candidates[k - 1] > j ? candidates[k - 1] : j) + 1,
+                        candidates[k + 1], &splitcost);
+    j = splitcost < SplitCost(candidates[k], &sc) ? llpos : candidates[k];
+    AddSorted(j, splitpoints, npoints);
+    ++numblocks;
+  }
+  CleanCostMemo(&memo);
+
+  if (options->verbose>3) {
+    PrintBlockSplitPoints(lz77, *splitpoints, *npoints);
+  }
+
+  if(options->verbose>2) {
+    fprintf(stderr, "Total blocks: %lu                 \n\n",(unsigned long)numblocks);
+  }
+
+  ZopfliFree(chosen);
+  ZopfliFree(from);
+  ZopfliFree(best);
+  ZopfliFree(costs);
+  ZopfliFree(candidates);
+}
+
 void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
                           const ZopfliLZ77Store* lz77, size_t maxblocks,
                           size_t** splitpoints, size_t* npoints) {
@@ -247,11 +649,18 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
   size_t numblocks = 1;
   unsigned char* done;
   zfloat splitcost, origcost;
+  CostMemo memo;
 
   if (lz77->size < 10) return;  /* This code fails on tiny files. */
 
-  done = (unsigned char*)calloc(lz77->size, sizeof(unsigned char));
+  if (options->mode & 0x0200) {
+    BlockSplitDP(options, lz77, maxblocks, splitpoints, npoints);
+    return;
+  }
+
+  done = (unsigned char*)ZopfliCalloc(lz77->size, sizeof(unsigned char));
   if (!done) exit(-1); /* Allocation failed. */
+  InitCostMemo(&memo);
 
   lstart = 0;
   lend = lz77->size;
@@ -261,9 +670,14 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     if (maxblocks > 0 && numblocks >= maxblocks) {
       break;
     }
+    /* The split points found so far are as good as any. */
+    if (ZopfliDeadlineReached(options->deadline)) {
+      break;
+    }
 
     c.lz77 = lz77;
     c.options = options;
+    c.memo = &memo;
     c.start = lstart;
     c.end = lend;
     assert(lstart < lend);
@@ -272,7 +686,7 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     assert(llpos > lstart);
     assert(llpos < lend);
 
-    origcost = EstimateCost(options, lz77, lstart, lend);
+    origcost = EstimateCost(options, lz77, lstart, lend, &memo);
 
     if (splitcost > origcost || llpos == lstart + 1 || llpos == lend) {
       done[lstart] = 1;
@@ -301,36 +715,105 @@ void ZopfliBlockSplitLZ77(const ZopfliOptions* options,
     fprintf(stderr, "Total blocks: %lu                 \n\n",(unsigned long)numblocks);
   }
 
+  CleanCostMemo(&memo);
+  ZopfliFree(done);
+}
+
+typedef struct GreedyChunk {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  size_t start;
+  size_t end;
+  ZopfliLZ77Store store;
+  const ZopfliAllocator* allocator;
+} GreedyChunk;
 
-  free(done);
+static void *GreedyChunkThread(void *a) {
+  GreedyChunk* c = (GreedyChunk*)a;
+  ZopfliBlockState s;
+  ZopfliHash hash;
+  ZopfliSetAllocator(c->allocator);
+  ZopfliMallocHash(ZOPFLI_WINDOW_SIZE, &hash);
+  ZopfliInitBlockState(c->options, c->start, c->end, 0, &s);
+  ZopfliLZ77Greedy(&s, c->in, c->start, c->end, &c->store, &hash);
+  ZopfliCleanBlockState(&s);
+  ZopfliCleanHash(&hash);
+  return 0;
+}
+
+/*
+Does ZopfliLZ77Greedy on instart-inend, cut into one chunk per thread that
+run at the same time. Each chunk still uses the 32K window before its start,
+so the joined store is valid LZ77 which only differs from a single run near
+the chunk boundaries. The chunks depend on the thread count only, so the
+split points stay the same for the same --t#.
+*/
+static void LZ77GreedyThreaded(const ZopfliOptions* options,
+                               const unsigned char* in,
+                               size_t instart, size_t inend,
+                               ZopfliLZ77Store* store) {
+  size_t nchunks = (inend - instart) / ZOPFLI_SPLIT_CHUNK_MIN;
+  size_t chunksize, i;
+  GreedyChunk* chunks;
+  pthread_t* thr;
+
+  if (nchunks > options->numthreads) nchunks = options->numthreads;
+  if (nchunks < 2) {
+    ZopfliBlockState s;
+    ZopfliHash hash;
+    ZopfliMallocHash(ZOPFLI_WINDOW_SIZE, &hash);
+    ZopfliInitBlockState(options, instart, inend, 0, &s);
+    ZopfliLZ77Greedy(&s, in, instart, inend, store, &hash);
+    ZopfliCleanBlockState(&s);
+    ZopfliCleanHash(&hash);
+    return;
+  }
+
+  chunks = (GreedyChunk*)ZopfliMalloc(sizeof(*chunks) * nchunks);
+  thr = (pthread_t*)ZopfliMalloc(sizeof(*thr) * nchunks);
+  if (!chunks || !thr) exit(-1); /* Allocation failed. */
+  chunksize = (inend - instart) / nchunks;
+  for (i = 0; i < nchunks; ++i) {
+    chunks[i].options = options;
+    chunks[i].in = in;
+    chunks[i].start = instart + i * chunksize;
+    chunks[i].end = i == nchunks - 1 ? inend : chunks[i].start + chunksize;
+    ZopfliInitLZ77Store(in, &chunks[i].store);
+    chunks[i].allocator = ZopfliGetAllocator();
+    pthread_create(&thr[i], NULL, GreedyChunkThread, (void *)&chunks[i]);
+  }
+  for (i = 0; i < nchunks; ++i) {
+    pthread_join(thr[i], NULL);
+    ZopfliAppendLZ77Store(&chunks[i].store, store);
+    ZopfliCleanLZ77Store(&chunks[i].store);
+  }
+  ZopfliFree(thr);
+  ZopfliFree(chunks);
 }
 
 void ZopfliBlockSplit(const ZopfliOptions* options,
                       const unsigned char* in, size_t instart, size_t inend,
-                      size_t maxblocks, size_t** splitpoints, size_t* npoints) {
+                      size_t maxblocks, size_t** splitpoints, size_t* npoints,
+                      ZopfliLZ77Store* greedy) {
   size_t pos = 0;
   size_t i;
-  ZopfliBlockState s;
   size_t* lz77splitpoints = 0;
   size_t nlz77points = 0;
   ZopfliLZ77Store store;
-  ZopfliHash hash;
-  ZopfliHash* h = &hash;
-
-  ZopfliMallocHash(ZOPFLI_WINDOW_SIZE, h);
 
   ZopfliInitLZ77Store(in, &store);
-  ZopfliInitBlockState(options, instart, inend, 0, &s);
 
   *npoints = 0;
   *splitpoints = 0;
 
   /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
   results in better blocks. */
-  ZopfliLZ77Greedy(&s, in, instart, inend, &store, h);
+  LZ77GreedyThreaded(options, in, instart, inend, &store);
+  ZopfliLZ77IndexHistograms(&store);
   ZopfliBlockSplitLZ77(options,
                        &store, maxblocks,
                        &lz77splitpoints, &nlz77points);
+  ZopfliLZ77DropHistogramIndex(&store);
   /* Convert LZ77 positions to positions in the uncompressed input. */
   pos = instart;
   if (nlz77points > 0) {
@@ -345,10 +828,12 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   }
   assert(*npoints == nlz77points);
 
-  free(lz77splitpoints);
-  ZopfliCleanHash(h);
-  ZopfliCleanBlockState(&s);
-  ZopfliCleanLZ77Store(&store);
+  ZopfliFree(lz77splitpoints);
+  if (greedy != NULL) {
+    *greedy = store;  /* The caller owns the store now. */
+  } else {
+    ZopfliCleanLZ77Store(&store);
+  }
 }
 
 void ZopfliBlockSplitSimple(size_t instart, size_t inend, size_t blocksize,
@@ -54,10 +54,13 @@ splitpoints: dynamic array to put the resulting split point coordinates into.
   The coordinates are indices in the input array.
 npoints: pointer to amount of splitpoints, for the dynamic array. The amount of
   blocks is the amount of splitpoitns + 1.
+greedy: if not NULL, receives the indexed greedy LZ77 store the split points
+  were found on, to be cleaned by the caller.
 */
 void ZopfliBlockSplit(const ZopfliOptions* options,
                       const unsigned char* in, size_t instart, size_t inend,
-                      size_t maxblocks, size_t** splitpoints, size_t* npoints);
+                      size_t maxblocks, size_t** splitpoints, size_t* npoints,
+                      ZopfliLZ77Store* greedy);
 
 /*
 Divides the input into equal blocks, does not even take LZ77 lengths into
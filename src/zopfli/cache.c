@@ -28,17 +28,18 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
   size_t i;
-  lmc->length = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
-  lmc->dist = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
+  lmc->length = (unsigned short*)ZopfliMalloc(sizeof(unsigned short) * blocksize);
+  lmc->dist = (unsigned short*)ZopfliMalloc(sizeof(unsigned short) * blocksize);
   /* Rather large amount of memory. */
   lmc->cache_length = ZOPFLI_CACHE_LENGTH;
+  lmc->shared = 0;
   while(lmc->cache_length*3*blocksize+blocksize*4>ZOPFLI_MAX_CACHE_MEMORY && lmc->cache_length > 1) {
     --lmc->cache_length;
   }
-  lmc->sublen = (unsigned char*)malloc(lmc->cache_length * 3 * blocksize);
+  lmc->sublen = (unsigned char*)ZopfliMalloc(lmc->cache_length * 3 * blocksize);
   if(lmc->sublen==NULL) {
     fprintf(stderr,"Warning: Unable to allocate %lu bytes of memory for cache.\nWill try again with %lu bytes.\n",(unsigned long)(lmc->cache_length * 3 * blocksize),(unsigned long)(3 * blocksize));
-    lmc->sublen = (unsigned char*)malloc(3 * blocksize);
+    lmc->sublen = (unsigned char*)ZopfliMalloc(3 * blocksize);
     if(lmc->sublen==NULL) {
       fprintf(stderr,"Error: Out of memory.\n");
       ZopfliCleanCache(lmc);
@@ -56,10 +57,20 @@ void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
   memset(lmc->sublen, 0, lmc->cache_length * blocksize * 3 * sizeof(lmc->sublen[0]));
 }
 
+void ZopfliSliceCache(ZopfliLongestMatchCache* master, size_t offset,
+                      ZopfliLongestMatchCache* lmc) {
+  lmc->length = master->length + offset;
+  lmc->dist = master->dist + offset;
+  lmc->cache_length = master->cache_length;
+  lmc->sublen = master->sublen + master->cache_length * offset * 3;
+  lmc->shared = 1;
+}
+
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc) {
-  free(lmc->sublen);
-  free(lmc->dist);
-  free(lmc->length);
+  if (lmc->shared) return;
+  ZopfliFree(lmc->sublen);
+  ZopfliFree(lmc->dist);
+  ZopfliFree(lmc->length);
 }
 
 void ZopfliSublenToCache(const unsigned short* sublen,
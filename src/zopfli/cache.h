@@ -26,8 +26,6 @@ The cache that speeds up ZopfliFindLongestMatch of lz77.c.
 
 #include "util.h"
 
-#ifdef ZOPFLI_LONGEST_MATCH_CACHE
-
 /*
 Cache used by ZopfliFindLongestMatch to remember previously found length/dist
 values.
@@ -41,11 +39,23 @@ typedef struct ZopfliLongestMatchCache {
   unsigned short* dist;
   unsigned long cache_length;
   unsigned char* sublen;
+  /* If 1, the arrays above belong to a larger cache and are not freed here. */
+  int shared;
 } ZopfliLongestMatchCache;
 
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+
 /* Initializes the ZopfliLongestMatchCache. */
 void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
 
+/*
+Makes lmc a view of the master cache starting at offset, so that a block can
+reuse the length/dist values already found for its bytes by earlier blocks
+or passes covering the same data. Cleaning the view leaves master intact.
+*/
+void ZopfliSliceCache(ZopfliLongestMatchCache* master, size_t offset,
+                      ZopfliLongestMatchCache* lmc);
+
 /* Frees up the memory of the ZopfliLongestMatchCache. */
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc);
 
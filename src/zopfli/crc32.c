@@ -21,11 +21,13 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "crc32.h"
 #include "util.h"
 
+#include <pthread.h>
+
 /* Table of CRCs of all 8-bit messages. */
 static unsigned long crc_table[256];
 
-/* Flag: has the table been computed? Initially false. */
-static int crc_table_computed = 0;
+/* Computes the table once, also when several threads need it at once. */
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
 
 /* Makes the table for a fast CRC. */
 static void MakeCRCTable(void) {
@@ -42,7 +44,6 @@ static void MakeCRCTable(void) {
     }
     crc_table[n] = c;
   }
-  crc_table_computed = 1;
 }
 
 
@@ -55,8 +56,7 @@ static unsigned long UpdateCRC(unsigned long crc,
   unsigned long c = crc ^ 0xffffffffL;
   size_t n;
 
-  if (!crc_table_computed)
-    MakeCRCTable();
+  pthread_once(&crc_table_once, MakeCRCTable);
   for (n = 0; n < len; n++) {
     c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
   }
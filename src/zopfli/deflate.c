@@ -23,21 +23,19 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "deflate.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
-#include <dirent.h>
-#if SC_PLATFORM == SC_PLATFORM_LINUX
-#include <sys/stat.h>
-#include <errno.h>
-#endif
 
-#include "inthandler.h"
 #include "blocksplitter.h"
 #include "squeeze.h"
 #include "symbols.h"
 #include "tree.h"
 #include "crc32.h"
+#include "statsdb.h"
 
 /*
 bp = bitpointer, always in range [0, 7].
@@ -109,6 +107,75 @@ static void PatchDistanceCodesForBuggyDecoders(unsigned* d_lengths) {
   }
 }
 
+/*
+Writes many bits to the same bp, out and outsize. They gather in a 64-bit
+accumulator and are appended 32 at a time, instead of one by one as AddBits
+does. Holds the partial last byte of out from BitWriterInit until
+BitWriterEnd, out must not be touched in between.
+*/
+typedef struct BitWriter {
+  uint64_t bits;  /* Pending bits, the first one lowest. */
+  unsigned count;  /* Amount of pending bits, below 32 between calls. */
+  int inplace;  /* The next byte replaces the partial last byte of out. */
+  unsigned char* bp;
+  unsigned char** out;
+  size_t* outsize;
+} BitWriter;
+
+static void BitWriterInit(BitWriter* w, unsigned char* bp,
+                          unsigned char** out, size_t* outsize) {
+  w->bp = bp;
+  w->out = out;
+  w->outsize = outsize;
+  w->count = *bp;
+  w->inplace = *bp != 0;
+  w->bits = w->inplace ? (*out)[*outsize - 1] & ((1u << *bp) - 1) : 0;
+}
+
+static void BitWriterByte(BitWriter* w, unsigned char byte) {
+  if (w->inplace) {
+    (*w->out)[*w->outsize - 1] = byte;
+    w->inplace = 0;
+  } else {
+    ZOPFLI_APPEND_DATA(byte, w->out, w->outsize);
+  }
+}
+
+/* Adds the lowest length bits of symbol, the lowest first, up to 32. */
+static void BitWriterAdd(BitWriter* w, unsigned symbol, unsigned length) {
+  w->bits |= ((uint64_t)symbol & (((uint64_t)1 << length) - 1)) << w->count;
+  w->count += length;
+  if (w->count >= 32) {
+    BitWriterByte(w, (unsigned char)w->bits);
+    BitWriterByte(w, (unsigned char)(w->bits >> 8));
+    BitWriterByte(w, (unsigned char)(w->bits >> 16));
+    BitWriterByte(w, (unsigned char)(w->bits >> 24));
+    w->bits >>= 32;
+    w->count -= 32;
+  }
+}
+
+/* Appends the pending bits and sets bp, out is free to use again. */
+static void BitWriterEnd(BitWriter* w) {
+  while (w->count >= 8) {
+    BitWriterByte(w, (unsigned char)w->bits);
+    w->bits >>= 8;
+    w->count -= 8;
+  }
+  if (w->count > 0) BitWriterByte(w, (unsigned char)w->bits);
+  *w->bp = (unsigned char)w->count;
+}
+
+/* Huffman code in the bit order of BitWriterAdd. */
+static unsigned ReverseBits(unsigned symbol, unsigned length) {
+  unsigned result = 0;
+  unsigned i;
+  for (i = 0; i < length; i++) {
+    result = (result << 1) | ((symbol >> i) & 1);
+  }
+  return result;
+}
+
 /*
 Encodes the Huffman tree and returns how many bits its encoding takes. If out
 is a null pointer, only returns the size and runs faster.
@@ -286,8 +353,8 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   result_size += clcounts[18] * 7;
 
   /* Note: in case of "size_only" these are null pointers so no effect. */
-  free(rle_bits);
-  free(rle);
+  ZopfliFree(rle_bits);
+  ZopfliFree(rle);
 
   return result_size;
 }
@@ -420,19 +487,30 @@ static void AddLZ77Data(const ZopfliLZ77Store* lz77,
                         const unsigned* d_symbols, const unsigned* d_lengths,
                         unsigned char* bp,
                         unsigned char** out, size_t* outsize) {
+  unsigned ll_codes[ZOPFLI_NUM_LL];
+  unsigned d_codes[ZOPFLI_NUM_D];
+  BitWriter w;
   size_t testlength = 0;
   size_t i;
 #ifdef NDEBUG
   (void)expected_data_size;
 #endif
 
+  for (i = 0; i < ZOPFLI_NUM_LL; i++) {
+    ll_codes[i] = ReverseBits(ll_symbols[i], ll_lengths[i]);
+  }
+  for (i = 0; i < ZOPFLI_NUM_D; i++) {
+    d_codes[i] = ReverseBits(d_symbols[i], d_lengths[i]);
+  }
+
+  BitWriterInit(&w, bp, out, outsize);
   for (i = lstart; i < lend; i++) {
     unsigned dist = lz77->dists[i];
     unsigned litlen = lz77->litlens[i];
     if (dist == 0) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
-      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
+      BitWriterAdd(&w, ll_codes[litlen], ll_lengths[litlen]);
       testlength++;
     } else {
       unsigned lls = ZopfliGetLengthSymbol(litlen);
@@ -440,17 +518,16 @@ static void AddLZ77Data(const ZopfliLZ77Store* lz77,
       assert(litlen >= 3 && litlen <= 288);
       assert(ll_lengths[lls] > 0);
       assert(d_lengths[ds] > 0);
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
-      AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
-              bp, out, outsize);
-      AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
-      AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
-              bp, out, outsize);
+      BitWriterAdd(&w, ll_codes[lls], ll_lengths[lls]);
+      BitWriterAdd(&w, ZopfliGetLengthExtraBitsValue(litlen),
+                   ZopfliGetLengthExtraBits(litlen));
+      BitWriterAdd(&w, d_codes[ds], d_lengths[ds]);
+      BitWriterAdd(&w, ZopfliGetDistExtraBitsValue(dist),
+                   ZopfliGetDistExtraBits(dist));
       testlength += litlen;
     }
   }
+  BitWriterEnd(&w);
   assert(expected_data_size == 0 || testlength == expected_data_size);
 }
 
@@ -571,7 +648,7 @@ static void OptimizeHuffmanForRle(unsigned int length, size_t* counts) {
   }
   /* 2) Let's mark all population counts that already can be encoded
   with an rle code.*/
-  good_for_rle = (unsigned char*)calloc(length, 1);
+  good_for_rle = (unsigned char*)ZopfliCalloc(length, 1);
 
   /* Let's not spoil any of the existing good rle codes.
   Mark any seq of 0's that is longer than 5 as a good_for_rle.
@@ -633,7 +710,7 @@ static void OptimizeHuffmanForRle(unsigned int length, size_t* counts) {
     }
   }
 
-  free(good_for_rle);
+  ZopfliFree(good_for_rle);
 }
 
 /*
@@ -697,7 +774,7 @@ static unsigned OptimizeHuffmanForRleBrotli(size_t length, size_t* counts) {
   }
     /* 2) Let's mark all population counts that already can be encoded
   with an rle code. */
-  good_for_rle = (unsigned char*)calloc(length, 1);
+  good_for_rle = (unsigned char*)ZopfliCalloc(length, 1);
   if (good_for_rle == NULL) {
     return 0;
   }
@@ -771,7 +848,7 @@ static unsigned OptimizeHuffmanForRleBrotli(size_t length, size_t* counts) {
       }
     }
   }
-  free(good_for_rle);
+  ZopfliFree(good_for_rle);
   return 1;
 }
 
@@ -988,6 +1065,92 @@ static void AddNonCompressedBlock(const ZopfliOptions* options, int final,
   }
 }
 
+/* Amount of bits in outsize bytes of output with bit pointer bp. */
+static size_t OutputBits(size_t outsize, unsigned char bp) {
+  return bp == 0 ? outsize * 8 : (outsize - 1) * 8 + bp;
+}
+
+/*
+Amount of bits AddNonCompressedBlock adds for size bytes, starting at bit
+pointer bp.
+*/
+static size_t NonCompressedBits(unsigned char bp, size_t size) {
+  size_t bits = bp;
+  for (;;) {
+    size_t blocksize = size > 65535 ? 65535 : size;
+    bits += 3;
+    bits = (bits + 7) & ~(size_t)7;
+    bits += 32 + blocksize * 8;
+    size -= blocksize;
+    if (size == 0) break;
+  }
+  return bits - bp;
+}
+
+/*
+Pre-scan of --prescan, cheap next to a single iteration. The fewest bits any
+deflate block of in[instart, inend) could need are estimated by the order-0
+entropy of every ZOPFLI_WINDOW_SIZE bytes, where the bytes that greedy 4 byte
+matches cover cost nothing. Returns 1 if that leaves less than
+1/ZOPFLI_PRESCAN_MARGIN of the stored size to gain, as with already
+compressed data.
+*/
+static int Incompressible(const unsigned char* in,
+                          size_t instart, size_t inend) {
+  size_t size = inend - instart;
+  size_t nwindows = size / ZOPFLI_WINDOW_SIZE;
+  size_t covered = 0;
+  zfloat bits = 0;
+  zfloat stored = (zfloat)size * 8 * (ZOPFLI_PRESCAN_MARGIN - 1)
+                / ZOPFLI_PRESCAN_MARGIN;
+  size_t* table;
+  size_t i, w;
+  if (size == 0) return 0;
+  if (nwindows == 0) nwindows = 1;
+  for (w = 0; w < nwindows; ++w) {
+    size_t counts[256];
+    size_t start = instart + size / nwindows * w;
+    size_t end = w + 1 == nwindows ? inend : start + size / nwindows;
+    for (i = 0; i < 256; ++i) counts[i] = 0;
+    for (i = start; i < end; ++i) ++counts[in[i]];
+    for (i = 0; i < 256; ++i) {
+      if (counts[i] != 0) {
+        bits += counts[i] * ZLOG((zfloat)(end - start) / counts[i]) * ZOPFLI_INVLOG2;
+      }
+    }
+  }
+  if (bits < stored) return 0;
+
+  /* Matches may reach into the window before the block. */
+  table = (size_t*)ZopfliCalloc(ZOPFLI_PRESCAN_HASH, sizeof(*table));
+  if (!table) exit(-1); /* Allocation failed. */
+  i = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  while (i + 4 <= inend) {
+    unsigned long word = in[i] | ((unsigned long)in[i + 1] << 8)
+                       | ((unsigned long)in[i + 2] << 16)
+                       | ((unsigned long)in[i + 3] << 24);
+    size_t h = (size_t)(((word * 2654435761UL) & 0xFFFFFFFFUL) >> 16)
+             & (ZOPFLI_PRESCAN_HASH - 1);
+    /* Positions are stored + 1, 0 is an empty entry. */
+    size_t match = table[h];
+    table[h] = i + 1;
+    if (i >= instart && match != 0 && i + 1 - match <= ZOPFLI_WINDOW_SIZE
+        && memcmp(in + match - 1, in + i, 4) == 0) {
+      size_t length = 4;
+      while (length < ZOPFLI_MAX_MATCH && i + length < inend
+             && in[match - 1 + length] == in[i + length]) {
+        ++length;
+      }
+      covered += length;
+      i += length;
+    } else {
+      ++i;
+    }
+  }
+  ZopfliFree(table);
+  return bits * (zfloat)(size - covered) / (zfloat)size >= stored;
+}
+
 /*
 Adds a deflate block with the given LZ77 data to the output.
 options: global program options
@@ -1083,9 +1246,10 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
   blocks which already are pretty good with fixed huffman tree.
 
   Expensive fixed calculation is hardcoded ON, because unlike block splitter,
-  it's rather fast here.
+  it's rather fast here, but not past the deadline and not for blocks the
+  pre-scan of --prescan finds incompressible.
   */
-  int expensivefixed = 1;
+  int expensivefixed = !ZopfliDeadlineReached(options->deadline);
 
   ZopfliLZ77Store fixedstore;
   if (lstart == lend) {
@@ -1095,6 +1259,11 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
     AddBits(0, 7, bp, out, outsize);  /* end symbol has code 0000000 */
     return;
   }
+  if (expensivefixed && (options->mode & 0x2000)) {
+    size_t instart = lz77->pos[lstart];
+    size_t inend = instart + ZopfliLZ77GetByteRange(lz77, lstart, lend);
+    expensivefixed = !Incompressible(lz77->data, instart, inend);
+  }
   ZopfliInitLZ77Store(lz77->data, &fixedstore);
   if (expensivefixed) {
     /* Recalculate the LZ77 with ZopfliLZ77OptimalFixed */
@@ -1130,147 +1299,6 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
   ZopfliCleanLZ77Store(&fixedstore);
 }
 
-static void Sl(size_t* a, size_t b) {
-  if(*a<b) *a=b;
-}
-
-static size_t freadst(void* buffer, unsigned char sizetsize, int dummy, FILE *stream) {
-  size_t a = 0, b;
-  unsigned char byte;
-  (void)dummy;
-  for(b = 0; b < sizetsize; ++b) {
-    a += fread(&byte, 1, 1, stream);
-    ((unsigned char *)buffer)[b] = byte;
-  }
-  for(;b < sizeof(size_t); ++b) {
-    ((unsigned char *)buffer)[b] = 0;
-  }
-  return a;
-}
-
-static void Verifysize_t(size_t verifysize, unsigned char* sizetsize) {
-  int j = sizeof(size_t) - 1;
-  for(;; --j) {
-    unsigned char *p = (unsigned char*)&verifysize;
-    if(p[j]==0) {
-      --(*sizetsize);
-    } else {
-      return;
-    }
-    if(j==0) return;
-  }
-}
-
-typedef struct ZopfliBestStats {
-
-  char mode;
-
-  size_t blocksize;
-
-  unsigned long blockcrc;
-
-  unsigned int startiteration;
-
-  SymbolStats* beststats;
-} ZopfliBestStats;
-
-static int StatsDBLoad(ZopfliBestStats* statsdb) {
-  FILE *file;
-  size_t b = 0, i = 0;
-  unsigned char check;
-  char crc32bits[16];
-  char DBfile[32];
-  char LocBuf[56];
-  unsigned char sizetsize = sizeof(size_t);
-  sprintf(crc32bits,"%08lx",statsdb->blockcrc);
-  sprintf(DBfile,"%x-%lu.dat",statsdb->mode,(unsigned long)statsdb->blocksize);
-  sprintf(LocBuf,"ZopfliDB");
-  while(i<8) {
-    sprintf(LocBuf,"%s/%c",LocBuf,crc32bits[i++]);
-    sprintf(LocBuf,"%s%c",LocBuf,crc32bits[i++]);
-  }
-  sprintf(LocBuf,"%s/%s",LocBuf,DBfile);
-  file = fopen(LocBuf, "rb");
-  if(!file) return 0;
-  b += fread(&check,sizeof(check),1,file);
-  if(check != BESTSTATSDBVER) return 0;
-  b += fread(&check,sizeof(check),1,file);
-  if(check != sizeof(zfloat)) return 0;
-  b += fread(&sizetsize, sizeof(sizetsize),1,file);
-  b += fread(&statsdb->startiteration, sizeof(statsdb->startiteration), 1, file);
-  for(i = 0; i < ZOPFLI_NUM_LL; ++i)
-    b += freadst(&statsdb->beststats->litlens[i], sizetsize, 1, file);
-  for(i = 0; i < ZOPFLI_NUM_D; ++i)
-    b += freadst(&statsdb->beststats->dists[i], sizetsize, 1, file);
-  for(i = 0; i < ZOPFLI_NUM_LL; ++i)
-    b += fread(&statsdb->beststats->ll_symbols[i], sizeof(zfloat), 1, file);
-  for(i = 0; i < ZOPFLI_NUM_D; ++i)
-    b += fread(&statsdb->beststats->d_symbols[i], sizeof(zfloat), 1, file);
-  fclose(file);
-  return 1;
-}
-
-static int DoDir(char* dir) {
-  DIR* testdir;
-  testdir = opendir(dir);
-  if(testdir) {
-    closedir(testdir);
-  } else if (ENOENT == errno) {
-#ifdef __WIN32__
-    mkdir(dir);
-#else
-    mkdir(dir, 0777);
-#endif
-  } else {
-    return 0;
-  }
-  return 1;
-}
-
-static int StatsDBSave(ZopfliBestStats* statsdb) {
-  FILE *file;
-  size_t b = 0, i = 0;
-  unsigned char check = BESTSTATSDBVER;
-  char crc32bits[16];
-  char DBfile[32];
-  char LocBuf[56];
-  unsigned char sizetsize = sizeof(size_t);
-  size_t verifysize = 0;
-  if(statsdb->beststats == NULL) return 0;
-  sprintf(crc32bits,"%08lx",statsdb->blockcrc);
-  sprintf(DBfile,"%x-%lu.dat",statsdb->mode,(unsigned long)statsdb->blocksize);
-  sprintf(LocBuf,"ZopfliDB");
-  if(!DoDir(LocBuf)) return 0;
-  while(i<8) {
-    sprintf(LocBuf,"%s/%c",LocBuf,crc32bits[i++]);
-    sprintf(LocBuf,"%s%c",LocBuf,crc32bits[i++]);
-    if(!DoDir(LocBuf)) return 0;
-  }
-  sprintf(LocBuf,"%s/%s",LocBuf,DBfile);
-  file = fopen(LocBuf, "wb");
-  if(!file) return 0;
-  for(i = 0; i < ZOPFLI_NUM_LL; ++i)
-    Sl(&verifysize,statsdb->beststats->litlens[i]);
-  for(i = 0; i < ZOPFLI_NUM_D; ++i)
-    Sl(&verifysize,statsdb->beststats->dists[i]);
-  Verifysize_t(verifysize, &sizetsize);
-  b += fwrite(&check, sizeof(check), 1, file);
-  check = sizeof(zfloat);
-  b += fwrite(&check, sizeof(check), 1, file);
-  b += fwrite(&sizetsize, sizeof(sizetsize), 1, file);
-  b += fwrite(&statsdb->startiteration, sizeof(statsdb->startiteration), 1, file);
-  for(i = 0; i < ZOPFLI_NUM_LL; ++i)
-    b += fwrite(&statsdb->beststats->litlens[i], sizetsize, 1, file);
-  for(i = 0; i < ZOPFLI_NUM_D; ++i)
-    b += fwrite(&statsdb->beststats->dists[i], sizetsize, 1, file);
-  for(i = 0; i < ZOPFLI_NUM_LL; ++i)
-    b += fwrite(&statsdb->beststats->ll_symbols[i], sizeof(zfloat), 1, file);
-  for(i = 0; i < ZOPFLI_NUM_D; ++i)
-    b += fwrite(&statsdb->beststats->d_symbols[i], sizeof(zfloat), 1, file);
-  fclose(file);
-  return 1;
-}
-
 static void PrintProgress(int v, size_t start, size_t inend, size_t i, size_t npoints) {
   if(v>0) fprintf(stderr, "Progress: %.1f%%",100.0 * (zpfloat) start / (zpfloat)inend);
   if(v>1) {
@@ -1303,8 +1331,6 @@ typedef struct ZopfliThread {
 
   int bestperblock;
 
-  int allstatscontrol;
-
   unsigned int startiteration;
 
   ZopfliIterations iterations;
@@ -1312,65 +1338,399 @@ typedef struct ZopfliThread {
   ZopfliLZ77Store store;
 
   SymbolStats* beststats;
+
+  /* Master block-wide longest match cache starting at lmcstart, or NULL to
+  give every block its own. */
+  ZopfliLongestMatchCache* lmc;
+
+  size_t lmcstart;
+
+  /*
+  Stats to start from instead of a greedy run when the databases have none,
+  or NULL (--warmstart). Owned by the MASTER thread.
+  */
+  SymbolStats* seedstats;
+
+  /*
+  Stats of the block splitter's greedy run over this block, blended from the
+  blocks it was split into, used instead of a greedy run of its own, or NULL.
+  Owned by the MASTER thread.
+  */
+  SymbolStats* greedystats;
+
+  /* Copy of the stats of the best try, kept for the next pass (--warmstart). */
+  SymbolStats* passstats;
+
+  /* Allocator of the MASTER thread. */
+  const ZopfliAllocator* allocator;
+
+  /*
+  Signalled under donelock once is_running is set to 2, or NULL when nothing
+  waits for the thread.
+  */
+  pthread_mutex_t* donelock;
+  pthread_cond_t* done;
 } ZopfliThread;
 
+/* Marks the thread finished and wakes the MASTER thread waiting for it. */
+static void ThreadDone(ZopfliThread* b) {
+  if(b->done == NULL) {
+    b->is_running = 2;
+    return;
+  }
+  pthread_mutex_lock(b->donelock);
+  b->is_running = 2;
+  pthread_cond_signal(b->done);
+  pthread_mutex_unlock(b->donelock);
+}
+
+/*
+Best stats of every block of one compression pass over a master block,
+used to start the blocks of the next pass from (--warmstart).
+*/
+typedef struct ZopfliPassStats {
+  /* npoints + 1 stats, NULL where a block has none. */
+  SymbolStats** stats;
+
+  /* Byte positions between the blocks, not owned. */
+  const size_t* splitpoints;
+
+  size_t npoints;
+} ZopfliPassStats;
+
+static void InitPassStats(size_t npoints, ZopfliPassStats* ps) {
+  ps->stats = (SymbolStats**)ZopfliCalloc(npoints + 1, sizeof(*ps->stats));
+  if (!ps->stats) exit(-1); /* Allocation failed. */
+  ps->splitpoints = 0;
+  ps->npoints = npoints;
+}
+
+static void CleanPassStats(ZopfliPassStats* ps) {
+  size_t i;
+  if (!ps->stats) return;
+  for (i = 0; i <= ps->npoints; ++i) {
+    if (ps->stats[i]) {
+      FreeStats(ps->stats[i]);
+      ZopfliFree(ps->stats[i]);
+    }
+  }
+  ZopfliFree(ps->stats);
+  ps->stats = 0;
+}
+
+/*
+Returns stats for the bytes in[start, end) blended from the blocks of the
+previous pass that overlap them, each weighted by the part of it that
+overlaps, or NULL if less than half of the range is covered by blocks with
+stats. The caller frees the result.
+*/
+static SymbolStats* BlendPassStats(const ZopfliPassStats* prev,
+                                   size_t instart, size_t inend,
+                                   size_t start, size_t end) {
+  SymbolStats** sources;
+  zfloat* weights;
+  SymbolStats* result = 0;
+  size_t i, n = 0, covered = 0;
+  if (prev == NULL || prev->stats == NULL || end <= start) return 0;
+  sources = (SymbolStats**)ZopfliMalloc(sizeof(*sources) * (prev->npoints + 1));
+  weights = (zfloat*)ZopfliMalloc(sizeof(*weights) * (prev->npoints + 1));
+  if (!sources || !weights) exit(-1); /* Allocation failed. */
+  for (i = 0; i <= prev->npoints; ++i) {
+    size_t bstart = i == 0 ? instart : prev->splitpoints[i - 1];
+    size_t bend = i == prev->npoints ? inend : prev->splitpoints[i];
+    size_t ostart = bstart > start ? bstart : start;
+    size_t oend = bend < end ? bend : end;
+    if (oend <= ostart || bend <= bstart || prev->stats[i] == NULL) continue;
+    sources[n] = prev->stats[i];
+    weights[n] = (zfloat)(oend - ostart) / (zfloat)(bend - bstart);
+    covered += oend - ostart;
+    ++n;
+  }
+  if (n > 0 && covered * 2 >= end - start) {
+    result = (SymbolStats*)ZopfliMalloc(sizeof(*result));
+    if (!result) exit(-1); /* Allocation failed. */
+    InitStats(result);
+    BlendStats(sources, weights, n, result);
+  }
+  ZopfliFree(sources);
+  ZopfliFree(weights);
+  return result;
+}
+
+/* Returns the index of the first symbol of store that begins at or after pos. */
+static size_t SymbolAt(const ZopfliLZ77Store* store, size_t pos) {
+  size_t lo = 0, hi = store->size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (store->pos[mid] < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+Returns the stats of the symbols of greedy that begin in in[start, end), or
+NULL if there is no greedy store or none of its symbols begins there. The
+caller frees the result.
+*/
+static SymbolStats* GreedyStats(const ZopfliLZ77Store* greedy,
+                                size_t start, size_t end) {
+  SymbolStats* result;
+  size_t lstart, lend;
+  if (greedy == NULL || greedy->size == 0) return 0;
+  lstart = SymbolAt(greedy, start);
+  lend = SymbolAt(greedy, end);
+  if (lend <= lstart) return 0;
+  result = (SymbolStats*)ZopfliMalloc(sizeof(*result));
+  if (!result) exit(-1); /* Allocation failed. */
+  InitStats(result);
+  RangeStats(greedy, lstart, lend, result);
+  return result;
+}
+
+/*
+Fills ps with the stats of greedy for each of the npoints + 1 blocks that
+splitpoints cut in[instart, inend) into, so the greedy store can be freed
+right after block splitting. splitpoints must outlive ps.
+*/
+static void GreedyPassStats(const ZopfliLZ77Store* greedy,
+                            size_t instart, size_t inend,
+                            const size_t* splitpoints, size_t npoints,
+                            ZopfliPassStats* ps) {
+  size_t i;
+  InitPassStats(npoints, ps);
+  ps->splitpoints = splitpoints;
+  for (i = 0; i <= npoints; ++i) {
+    ps->stats[i] = GreedyStats(greedy,
+                               i == 0 ? instart : splitpoints[i - 1],
+                               i == npoints ? inend : splitpoints[i]);
+  }
+}
+
+/*
+Saves the best stats found so far for a block that is still being iterated,
+context is the ZopfliBestStats of the block.
+*/
+static void SaveCheckpoint(void* context, SymbolStats* beststats,
+                           unsigned int iteration, zfloat bestcost) {
+  ZopfliBestStats* statsdb = (ZopfliBestStats*)context;
+  statsdb->beststats = beststats;
+  statsdb->startiteration = iteration;
+  statsdb->cost = bestcost;
+  ZopfliStatsDBSave(statsdb);
+}
+
+/*
+Fills the empty store with literals only for the incompressible block
+in[start, end), which the output then stores unless a tree happens to be
+smaller, reports it to the progress callback and returns its size in bits.
+*/
+static zfloat StoreIncompressible(const ZopfliOptions* options,
+                                  const unsigned char* in,
+                                  size_t start, size_t end, size_t block,
+                                  ZopfliLZ77Store* store) {
+  size_t i;
+  zfloat cost;
+  for(i = start; i < end; ++i) ZopfliStoreLitLenDist(in[i], 0, i, store);
+  cost = ZopfliCalculateBlockSizeAutoType(options, store, 0, store->size, 0);
+  if(options->verbose>2) {
+    fprintf(stderr,"Block %d is incompressible, not iterating it . . .\n",
+            (int)(block + 1));
+  }
+  ZopfliReportProgress(options, ZOPFLI_PROGRESS_STORED, start, end,
+                       block, 0, 0, 0, (double)cost);
+  return cost;
+}
+
 static void *threading(void *a) {
 
   int tries = 1;
   size_t blocksize = 0;
   unsigned long blockcrc = 0;
+  unsigned long windowcrc = 0;
   ZopfliThread *b = (ZopfliThread *)a;
   ZopfliLZ77Store store;
+  ZopfliBestStats checkpoint;
+  unsigned signature[ZOPFLI_SIGNATURE_SIZE];
+  int hassignature = 0;
+  ZopfliSetAllocator(b->allocator);
   ZopfliInitLZ77Store(b->in, &b->store);
 
+  /* An incompressible block isn't iterated. Nothing goes to the databases. */
+  if((b->options->mode & 0x2000) && Incompressible(b->in, b->start, b->end)) {
+    if(b->beststats != 0) {
+      FreeStats(b->beststats);
+      ZopfliFree(b->beststats);
+      b->beststats = 0;
+    }
+    b->cost = StoreIncompressible(b->options, b->in, b->start, b->end,
+                                  b->iterations.block, &b->store);
+    b->bestperblock = b->options->mode;
+    ThreadDone(b);
+    return 0;
+  }
+
   if(b->options->mode & 0x0010) {
     tries=16;
-    if(b->options->numthreads == 0 && (b->options->mode & 0x0100)) {
-      blocksize = b->end - b->start;
-      blockcrc = CRC(b->in + b->start, blocksize);
-    }
+  }
+  /* With --all every try has its own stats database entry, looked up and
+  stored by this thread itself. Parses, checkpoints and similar blocks are
+  always handled here. */
+  if(b->options->mode & 0x0D00) {
+    blocksize = b->end - b->start;
+    blockcrc = CRC(b->in + b->start, blocksize);
+  }
+  if(b->options->mode & 0x0400) {
+    size_t windowstart = b->start > ZOPFLI_WINDOW_SIZE ? b->start - ZOPFLI_WINDOW_SIZE : 0;
+    windowcrc = CRC(b->in + windowstart, b->start - windowstart);
   }
   do {
     zfloat tempcost;
+    int parsefound = 0;
+    int newblock = 0;
+    ZopfliBestParse parse;
     ZopfliBlockState s;
     ZopfliOptions o = *(b->options);
     ZopfliInitLZ77Store(b->in, &store);
     --tries;
     if(b->options->mode & 0x0010) {
-      free(b->beststats);
+      if(b->beststats != 0) {
+        FreeStats(b->beststats);
+        ZopfliFree(b->beststats);
+      }
       b->beststats = 0;
       o.mode = tries + (o.mode & 0xFFF0);
       b->startiteration = 0;
       if(b->options->mode & 0x0100) {
-        if(b->options->numthreads > 0) {
-          /* Racing condition prevention */
-          b->allstatscontrol = tries + 0x0100;
-          do {
-            usleep(100000);
-          } while(b->allstatscontrol & 0x0100);
+        ZopfliBestStats statsdb;
+        statsdb.blocksize = blocksize;
+        statsdb.blockcrc = blockcrc;
+        statsdb.mode = tries;
+        statsdb.beststats = ZopfliMalloc(sizeof(SymbolStats));
+        InitStats(statsdb.beststats);
+        if(ZopfliStatsDBLoad(&statsdb)) {
+          b->beststats = statsdb.beststats;
+          b->startiteration = statsdb.startiteration;
         } else {
-          /* No SLAVE threads, work done by MASTER thread */
-          ZopfliBestStats statsdb;
-          statsdb.blocksize = blocksize;
-          statsdb.blockcrc = blockcrc;
-          statsdb.mode = tries;
-          statsdb.beststats = malloc(sizeof(SymbolStats));
-          InitStats(statsdb.beststats);
-          if(StatsDBLoad(&statsdb)) {
-            b->beststats = statsdb.beststats;
-            b->startiteration = statsdb.startiteration;
-          }
+          FreeStats(statsdb.beststats);
+          ZopfliFree(statsdb.beststats);
         }
       }
     }
 
-    ZopfliInitBlockState(&o, b->start, b->end, 1, &s);
+    if(b->options->mode & 0x0400) {
+      parse.mode = o.mode & 0xF;
+      parse.blocksize = blocksize;
+      parse.blockcrc = blockcrc;
+      parse.windowcrc = windowcrc;
+      parse.iterations = o.numiterations > 0 ? (unsigned)o.numiterations : (unsigned)-1;
+      parsefound = ZopfliParseDBLoad(&parse, b->in, b->start, b->end, &store);
+    }
+
+    if(!parsefound && b->beststats == 0 && b->seedstats != 0) {
+      b->beststats = ZopfliMalloc(sizeof(SymbolStats));
+      InitStats(b->beststats);
+      CopyStats(b->seedstats, b->beststats);
+      b->startiteration = 0;
+    }
+
+    /* A block not in the stats database gets its signature stored and, with
+    --similar, starts from the stats of the most similar block that is
+    instead of from a greedy run. */
+    if(!parsefound && (b->options->mode & 0x0100) && b->beststats == 0) {
+      if(!hassignature) {
+        ZopfliStatsDBSignature(b->in + b->start, blocksize, signature);
+        hassignature = 1;
+      }
+      newblock = 1;
+    }
+    if(newblock && (b->options->mode & 0x4000)) {
+      ZopfliBestStats similar;
+      similar.blocksize = blocksize;
+      similar.blockcrc = blockcrc;
+      similar.mode = o.mode & 0xF;
+      similar.beststats = ZopfliMalloc(sizeof(SymbolStats));
+      InitStats(similar.beststats);
+      if(ZopfliStatsDBLoadSimilar(&similar, signature)) {
+        b->beststats = similar.beststats;
+        b->startiteration = 0;
+        if(b->options->numthreads == 0 && b->options->verbose>2)
+          fprintf(stderr,"Similar block found, starting from its stats . . .\n");
+      } else {
+        FreeStats(similar.beststats);
+        ZopfliFree(similar.beststats);
+      }
+    }
 
-    ZopfliLZ77Optimal(&s, b->in, b->start, b->end, &store, &b->iterations,
-                      &b->beststats, &b->startiteration);
+    /* Otherwise the greedy run the block splitter did already gives the
+    initial stats, as long as it matched lazily or not the same way. */
+    if(!parsefound && b->beststats == 0 && b->greedystats != 0
+       && (o.mode & 0x0001) == (b->options->mode & 0x0001)) {
+      b->beststats = ZopfliMalloc(sizeof(SymbolStats));
+      InitStats(b->beststats);
+      CopyStats(b->greedystats, b->beststats);
+      b->startiteration = 0;
+    }
+
+    if(b->options->mode & 0x0800) {
+      checkpoint.blocksize = blocksize;
+      checkpoint.blockcrc = blockcrc;
+      checkpoint.mode = o.mode & 0xF;
+      b->iterations.checkpoint = SaveCheckpoint;
+      b->iterations.checkpointcontext = &checkpoint;
+    }
+
+    if(parsefound) {
+      /* Nothing gets iterated, so there are no new stats to store. */
+      if(b->beststats != 0) {
+        FreeStats(b->beststats);
+        ZopfliFree(b->beststats);
+        b->beststats = 0;
+      }
+    } else if(ZopfliDeadlineReached(o.deadline)) {
+      /* Out of time, so no iterations at all and no new stats either. */
+      ZopfliHash hash;
+      if(b->beststats != 0) {
+        FreeStats(b->beststats);
+        ZopfliFree(b->beststats);
+        b->beststats = 0;
+      }
+      b->startiteration = 0;
+      ZopfliInitBlockState(&o, b->start, b->end, 0, &s);
+      ZopfliMallocHash(ZOPFLI_WINDOW_SIZE, &hash);
+      ZopfliLZ77Greedy(&s, b->in, b->start, b->end, &store, &hash);
+      ZopfliCleanHash(&hash);
+      ZopfliCleanBlockState(&s);
+    } else {
+      if(b->lmc != NULL) {
+        ZopfliInitBlockStateSlice(&o, b->start, b->end, b->lmc, b->lmcstart, &s);
+      } else {
+        ZopfliInitBlockState(&o, b->start, b->end, 1, &s);
+      }
+
+      ZopfliLZ77Optimal(&s, b->in, b->start, b->end, &store, &b->iterations,
+                        &b->beststats, &b->startiteration);
+
+      ZopfliCleanBlockState(&s);
+
+      if(newblock) {
+        ZopfliBestStats similar;
+        similar.blocksize = blocksize;
+        similar.blockcrc = blockcrc;
+        similar.mode = o.mode & 0xF;
+        ZopfliStatsDBSaveSignature(&similar, signature);
+      }
+    }
     tempcost = ZopfliCalculateBlockSizeAutoType(&o, &store, 0, store.size, 2);
 
-    ZopfliCleanBlockState(&s);
+    if((b->options->mode & 0x0400) && !parsefound) {
+      /* Cut short by the deadline, the parse only counts for the iterations
+      it really got. */
+      if(b->startiteration > parse.iterations
+         || ZopfliDeadlineReached(o.deadline)) parse.iterations = b->startiteration;
+      parse.cost = tempcost;
+      ZopfliParseDBSave(&parse, &store);
+    }
 
     if(b->cost==0 || tempcost<b->cost) {
       ZopfliCleanLZ77Store(&b->store);
@@ -1378,34 +1738,39 @@ static void *threading(void *a) {
       ZopfliCopyLZ77Store(&store,&b->store);
       b->bestperblock = o.mode;
       b->cost = tempcost;
+      if(b->options->mode & 0x1000) {
+        if(b->beststats != 0) {
+          if(b->passstats == 0) {
+            b->passstats = ZopfliMalloc(sizeof(SymbolStats));
+            InitStats(b->passstats);
+          }
+          CopyStats(b->beststats, b->passstats);
+        } else if(b->passstats != 0) {
+          FreeStats(b->passstats);
+          ZopfliFree(b->passstats);
+          b->passstats = 0;
+        }
+      }
     }
     ZopfliCleanLZ77Store(&store);
 
-    if((b->options->mode & 0x0110) == 0x0110) {
-      if(b->options->numthreads > 0) {
-        /* Racing condition prevention */
-        b->allstatscontrol = tries + 0x0200;
-        do {
-          usleep(100000);
-        } while(b->allstatscontrol & 0x0200);
-      } else {
-        /* No SLAVE threads, work done by MASTER thread */
-        ZopfliBestStats statsdb;
-        statsdb.blocksize = blocksize;
-        statsdb.blockcrc = blockcrc;
-        statsdb.mode = tries;
-        statsdb.beststats = b->beststats;
-        statsdb.startiteration = b->startiteration;
-        StatsDBSave(&statsdb);
-        FreeStats(statsdb.beststats);
-        free(statsdb.beststats);
-        b->beststats = 0;
-      }
+    if((b->options->mode & 0x0110) == 0x0110 && b->beststats != 0) {
+      ZopfliBestStats statsdb;
+      statsdb.blocksize = blocksize;
+      statsdb.blockcrc = blockcrc;
+      statsdb.mode = tries;
+      statsdb.beststats = b->beststats;
+      statsdb.startiteration = b->startiteration;
+      statsdb.cost = tempcost;
+      ZopfliStatsDBSave(&statsdb);
+      FreeStats(statsdb.beststats);
+      ZopfliFree(statsdb.beststats);
+      b->beststats = 0;
     }
 
-  } while(tries>0);
+  } while(tries>0 && !ZopfliDeadlineReached(b->options->deadline));
 
-  b->is_running = 2;
+  ThreadDone(b);
 
   return 0;
 
@@ -1419,39 +1784,47 @@ static void ZopfliUseThreads(const ZopfliOptions* options,
                                size_t** splitpoints,
                                size_t** splitpoints_uncompressed,
                                int** bestperblock,
+                               ZopfliLongestMatchCache* lmc,
+                               const ZopfliPassStats* greedy,
+                               const ZopfliPassStats* prevstats,
+                               ZopfliPassStats* passstats,
                                zfloat *totalcost, int v) {
   unsigned showcntr = 4;
   unsigned showthread = 0;
+  double nextshow = 0;
   unsigned threadsrunning = 0;
   unsigned threnum = 0;
   unsigned numthreads = options->numthreads>0?options->numthreads>bkend+1?bkend+1:options->numthreads:1;
   int neednext = 0;
   size_t nextblock = bkstart;
   size_t n, i;
-  zfloat *tempcost = malloc(sizeof(*tempcost) * (bkend+1));
+  zfloat *tempcost = ZopfliMalloc(sizeof(*tempcost) * (bkend+1));
   unsigned char lastthread = 0;
-  unsigned char* blockdone = calloc(bkend+1,sizeof(unsigned char));
-  pthread_t *thr = malloc(sizeof(pthread_t) * (options->numthreads>bkend+1?bkend+1:options->numthreads));
+  unsigned char* blockdone = ZopfliCalloc(bkend+1,sizeof(unsigned char));
+  pthread_t *thr = ZopfliMalloc(sizeof(pthread_t) * (options->numthreads>bkend+1?bkend+1:options->numthreads));
   pthread_attr_t thr_attr;
-  ZopfliThread *t = malloc(sizeof(ZopfliThread) * numthreads);
-  ZopfliLZ77Store *tempstore = malloc(sizeof(ZopfliLZ77Store) * (bkend+1));
-  ZopfliBestStats* statsdb = malloc(sizeof(ZopfliBestStats) * numthreads);
+  pthread_mutex_t donelock;
+  pthread_cond_t done;
+  ZopfliThread *t = ZopfliMalloc(sizeof(ZopfliThread) * numthreads);
+  ZopfliLZ77Store *tempstore = ZopfliMalloc(sizeof(ZopfliLZ77Store) * (bkend+1));
+  ZopfliBestStats* statsdb = ZopfliMalloc(sizeof(ZopfliBestStats) * numthreads);
 
   for(i=0;i<numthreads;++i) {
    t[i].is_running = 0;
-   t[i].allstatscontrol = 0;
    statsdb[i].beststats = 0;
   }
 
   pthread_attr_init(&thr_attr);
   pthread_attr_setdetachstate(&thr_attr, PTHREAD_CREATE_DETACHED);
+  pthread_mutex_init(&donelock, NULL);
+  pthread_cond_init(&done, NULL);
 
   for (i = bkstart; i <= bkend; ++i) {
     size_t start = i == 0 ? instart : (*splitpoints_uncompressed)[i - 1];
     size_t end = i == bkend ? inend : (*splitpoints_uncompressed)[i];
     size_t blocksize = 0;
     unsigned long blockcrc = 0;
-    if((options->mode & 0x0100) && !(options->numthreads == 0 && (options->mode & 0x0010))) {
+    if((options->mode & 0x0110) == 0x0100) {
       blocksize = end - start;
       blockcrc = CRC(in + start, blocksize);
     }
@@ -1459,89 +1832,108 @@ static void ZopfliUseThreads(const ZopfliOptions* options,
       neednext=0;
       for(;threnum<numthreads;) {
         if(t[threnum].is_running==1) {
-          if(t[threnum].allstatscontrol & 0x0100) {
-            statsdb[threnum].mode = t[threnum].allstatscontrol & 0xF;
-            statsdb[threnum].beststats = malloc(sizeof(SymbolStats));
-            InitStats(statsdb[threnum].beststats);
-            if(StatsDBLoad(&statsdb[threnum])) {
-              t[threnum].beststats = statsdb[threnum].beststats;
-              t[threnum].startiteration = statsdb[threnum].startiteration;
-            }
-            t[threnum].allstatscontrol = 0;
-          } else if(t[threnum].allstatscontrol & 0x0200) {
-            statsdb[threnum].beststats = t[threnum].beststats;
-            statsdb[threnum].startiteration = t[threnum].startiteration;
-            StatsDBSave(&statsdb[threnum]);
-            FreeStats(statsdb[threnum].beststats);
-            free(statsdb[threnum].beststats);
-            t[threnum].beststats = 0;
-            t[threnum].allstatscontrol = 0;
-          } else if(options->verbose>2) {
-            if(t[showthread].is_running==1) {
-              unsigned calci, thrprogress;
-              if(mui==0) {
-                calci = options->numiterations;
+          if(options->verbose>2) {
+            /* The status line is only redrawn 3 times a second, without
+            holding up the threads waiting for their next block. */
+            double now = ZopfliGetTime();
+            if(now >= nextshow) {
+              nextshow = now + 1.0 / 3.0;
+              if(t[showthread].is_running==1) {
+                unsigned calci, thrprogress;
+                unsigned maxfail = ZopfliMaxFailIterations(options);
+                if(maxfail==0) {
+                  calci = options->numiterations;
+                } else {
+                  calci = (unsigned)(t[showthread].iterations.bestiteration+maxfail);
+                  if(calci>options->numiterations) calci=options->numiterations;
+                }
+                thrprogress = (int)(((zfloat)t[showthread].iterations.iteration / (zfloat)calci) * 100);
+                fprintf(stderr,"%3d%% THR %d | BLK %d | BST %d: %d b | ITR %d: %d b      \r",
+                        thrprogress, showthread, ((int)t[showthread].iterations.block+1),
+                        t[showthread].iterations.bestiteration, t[showthread].iterations.bestcost,
+                        t[showthread].iterations.iteration, t[showthread].iterations.cost);
               } else {
-                calci = (unsigned)(t[showthread].iterations.bestiteration+mui);
-                if(calci>options->numiterations) calci=options->numiterations;
-              }
-              thrprogress = (int)(((zfloat)t[showthread].iterations.iteration / (zfloat)calci) * 100);
-              usleep(333333);
-              fprintf(stderr,"%3d%% THR %d | BLK %d | BST %d: %d b | ITR %d: %d b      \r",
-                      thrprogress, showthread, ((int)t[showthread].iterations.block+1),
-                      t[showthread].iterations.bestiteration, t[showthread].iterations.bestcost,
-                      t[showthread].iterations.iteration, t[showthread].iterations.cost);
-            } else {
-              ++showthread;
-              if(showthread>=numthreads)
-                showthread=0;
-              showcntr=0;
-            }
-            if(showcntr>3) {
-              if(threadsrunning>1) {
                 ++showthread;
                 if(showthread>=numthreads)
                   showthread=0;
+                showcntr=0;
+              }
+              if(showcntr>3) {
+                if(threadsrunning>1) {
+                  ++showthread;
+                  if(showthread>=numthreads)
+                    showthread=0;
+                }
+                showcntr=1;
+              } else {
+                ++showcntr;
               }
-              showcntr=1;
-            } else {
-              ++showcntr;
             }
             ++threnum;
-            if(threnum>=numthreads)
+            if(threnum>=numthreads) {
+              /* Every thread was looked at, sleep until one of them is done
+              or the status line is due. */
+              struct timespec until;
+              unsigned k;
+              until.tv_sec = (time_t)nextshow;
+              until.tv_nsec = (long)((nextshow - (double)until.tv_sec) * 1000000000.0);
+              pthread_mutex_lock(&donelock);
+              for(k = 0; k < numthreads && t[k].is_running != 2; ++k) {}
+              if(k == numthreads) pthread_cond_timedwait(&done, &donelock, &until);
+              pthread_mutex_unlock(&donelock);
               threnum=0;
+            }
+          } else {
+            pthread_mutex_lock(&donelock);
+            while(t[threnum].is_running==1) pthread_cond_wait(&done, &donelock);
+            pthread_mutex_unlock(&donelock);
           }
         }
         if(t[threnum].is_running==0) {
           if(lastthread == 0) {
             t[threnum].beststats = 0;
             t[threnum].startiteration = 0;
-            if(options->mode & 0x0100) {
+            if((options->mode & 0x0110) == 0x0100) {
               statsdb[threnum].blocksize = blocksize;
               statsdb[threnum].blockcrc = blockcrc;
-              if(!(options->mode & 0x0010)) {
-                statsdb[threnum].mode = options->mode & 0xF;
-                statsdb[threnum].beststats = malloc(sizeof(SymbolStats));
-                InitStats(statsdb[threnum].beststats);
-                if(StatsDBLoad(&statsdb[threnum])) {
-                  t[threnum].beststats = statsdb[threnum].beststats;
-                  t[threnum].startiteration = statsdb[threnum].startiteration;
-                }
+              statsdb[threnum].mode = options->mode & 0xF;
+              statsdb[threnum].beststats = ZopfliMalloc(sizeof(SymbolStats));
+              InitStats(statsdb[threnum].beststats);
+              if(ZopfliStatsDBLoad(&statsdb[threnum])) {
+                t[threnum].beststats = statsdb[threnum].beststats;
+                t[threnum].startiteration = statsdb[threnum].startiteration;
+              } else {
+                FreeStats(statsdb[threnum].beststats);
+                ZopfliFree(statsdb[threnum].beststats);
               }
-            }            
+            }
             t[threnum].options = options;
             t[threnum].start = start;
             t[threnum].end = end;
             t[threnum].in = in;
+            t[threnum].lmc = lmc;
+            t[threnum].lmcstart = instart;
+            t[threnum].seedstats = 0;
+            t[threnum].greedystats = BlendPassStats(greedy, instart, inend,
+                                                    start, end);
+            t[threnum].passstats = 0;
+            if(options->mode & 0x1000) {
+              t[threnum].seedstats = BlendPassStats(prevstats, instart, inend, start, end);
+            }
             t[threnum].cost = 0;
-            t[threnum].allstatscontrol = 0;
             t[threnum].iterations.block = i;
             t[threnum].iterations.bestcost = 0;
             t[threnum].iterations.cost = 0;
             t[threnum].iterations.iteration = 0;
             t[threnum].iterations.bestiteration = 0;
+            t[threnum].iterations.checkpoint = 0;
+            t[threnum].allocator = ZopfliGetAllocator();
+            t[threnum].donelock = &donelock;
+            t[threnum].done = &done;
             t[threnum].is_running = 1;
             PrintProgress(v, start, inend, i, bkend);
+            ZopfliReportProgress(options, ZOPFLI_PROGRESS_BLOCK_START,
+                                 start, end, i, bkend + 1, 0, 0, 0);
             if(options->numthreads) {
               pthread_create(&thr[threnum], &thr_attr, threading, (void *)&t[threnum]);
             } else {
@@ -1558,19 +1950,43 @@ static void ZopfliUseThreads(const ZopfliOptions* options,
             threnum=0;
         }
         if(t[threnum].is_running==2) {
+          ZopfliReportProgress(options, ZOPFLI_PROGRESS_BLOCK_END,
+                               t[threnum].start, t[threnum].end,
+                               t[threnum].iterations.block, bkend + 1, 0, 0,
+                               (double)t[threnum].cost);
           if(options->mode & 0x0010) {
             (*bestperblock)[t[threnum].iterations.block] = t[threnum].bestperblock;
           }
-          if(options->mode & 0x0100 && t[threnum].beststats != 0) {
-            if(!(options->mode & 0x0010)) {
-              statsdb[threnum].beststats = t[threnum].beststats;
-              statsdb[threnum].startiteration = t[threnum].startiteration;
-              StatsDBSave(&statsdb[threnum]);
-            }
-            FreeStats(statsdb[threnum].beststats);
-            free(statsdb[threnum].beststats);
+          if((options->mode & 0x0110) == 0x0100 && t[threnum].beststats != 0) {
+            statsdb[threnum].beststats = t[threnum].beststats;
+            statsdb[threnum].startiteration = t[threnum].startiteration;
+            statsdb[threnum].cost = t[threnum].cost;
+            ZopfliStatsDBSave(&statsdb[threnum]);
+          }
+          if(t[threnum].beststats != 0) {
+            FreeStats(t[threnum].beststats);
+            ZopfliFree(t[threnum].beststats);
           }
           t[threnum].beststats = 0;
+          if(t[threnum].seedstats != 0) {
+            FreeStats(t[threnum].seedstats);
+            ZopfliFree(t[threnum].seedstats);
+            t[threnum].seedstats = 0;
+          }
+          if(t[threnum].greedystats != 0) {
+            FreeStats(t[threnum].greedystats);
+            ZopfliFree(t[threnum].greedystats);
+            t[threnum].greedystats = 0;
+          }
+          if(t[threnum].passstats != 0) {
+            if(passstats != NULL) {
+              passstats->stats[t[threnum].iterations.block] = t[threnum].passstats;
+            } else {
+              FreeStats(t[threnum].passstats);
+              ZopfliFree(t[threnum].passstats);
+            }
+            t[threnum].passstats = 0;
+          }
           if(nextblock==t[threnum].iterations.block) {
             *totalcost += t[threnum].cost;
             ZopfliAppendLZ77Store(&t[threnum].store, lz77);
@@ -1605,12 +2021,405 @@ static void ZopfliUseThreads(const ZopfliOptions* options,
     } while(threadsrunning>0 && neednext==0);
   }
 
-  free(statsdb);
-  free(blockdone);
-  free(tempstore);
-  free(t);
-  free(thr);
-  free(tempcost);
+  pthread_cond_destroy(&done);
+  pthread_mutex_destroy(&donelock);
+  ZopfliFree(statsdb);
+  ZopfliFree(blockdone);
+  ZopfliFree(tempstore);
+  ZopfliFree(t);
+  ZopfliFree(thr);
+  ZopfliFree(tempcost);
+}
+
+/* State of a block while the blocks share an iteration budget (--budget#). */
+typedef struct ZopfliBudgetBlock {
+  size_t start;
+  size_t end;
+
+  /* Smallest LZ77 symbols found so far and their size in bits. */
+  ZopfliLZ77Store store;
+  zfloat cost;
+
+  /* Stats and iteration the next slice continues from. */
+  SymbolStats* beststats;
+  unsigned int startiteration;
+
+  /* Stats that lead to store, kept for the next pass (--warmstart). */
+  SymbolStats* passstats;
+
+  /* Bits saved per iteration and byte by the last slice, 0 once it stopped
+  improving. */
+  zfloat gain;
+} ZopfliBudgetBlock;
+
+/* Slices of one round, taken one by one by the threads of the round. */
+typedef struct ZopfliBudgetRound {
+  pthread_mutex_t mutex;
+
+  const size_t* jobs;
+  size_t njobs;
+  size_t next;
+
+  /* Iterations every slice of the round gets. */
+  unsigned int slice;
+
+  /* 0 for the round that gives every block its first slice. */
+  int round;
+
+  ZopfliBudgetBlock* blocks;
+  size_t nblocks;
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  size_t instart;
+  size_t inend;
+  ZopfliLongestMatchCache* lmc;
+  const ZopfliPassStats* greedy;
+  const ZopfliPassStats* prevstats;
+  int v;
+
+  /* Iterations times bytes the slices of the round did. */
+  zfloat spent;
+
+  /* Allocator of the MASTER thread. */
+  const ZopfliAllocator* allocator;
+} ZopfliBudgetRound;
+
+/*
+Gives the block the next slice of iterations, continuing from where its last
+slice stopped, and keeps the result if it's not bigger than what the block
+has already.
+*/
+static void BudgetSlice(ZopfliBudgetRound* r, size_t k) {
+  ZopfliBudgetBlock* block = &r->blocks[k];
+  size_t blocksize = block->end - block->start;
+  unsigned int done;
+  ZopfliOptions o = *r->options;
+  ZopfliThread t;
+  ZopfliBestStats statsdb;
+
+  o.numiterations = (int)(block->startiteration + r->slice);
+  /* ZopfliBudgetThreads stored the incompressible blocks already. */
+  o.mode &= ~0x2000;
+  t.options = &o;
+  t.start = block->start;
+  t.end = block->end;
+  t.in = r->in;
+  t.lmc = r->lmc;
+  t.lmcstart = r->instart;
+  t.beststats = block->beststats;
+  t.startiteration = block->startiteration;
+  t.seedstats = 0;
+  t.greedystats = 0;
+  t.passstats = 0;
+  block->beststats = 0;
+  if(t.beststats == 0) {
+    if((o.mode & 0x0110) == 0x0100) {
+      statsdb.blocksize = blocksize;
+      statsdb.blockcrc = CRC(r->in + block->start, blocksize);
+      statsdb.mode = o.mode & 0xF;
+      statsdb.beststats = ZopfliMalloc(sizeof(SymbolStats));
+      InitStats(statsdb.beststats);
+      if(ZopfliStatsDBLoad(&statsdb)) {
+        t.beststats = statsdb.beststats;
+        t.startiteration = statsdb.startiteration;
+        o.numiterations = (int)(t.startiteration + r->slice);
+      } else {
+        FreeStats(statsdb.beststats);
+        ZopfliFree(statsdb.beststats);
+      }
+    }
+    if(o.mode & 0x1000) {
+      t.seedstats = BlendPassStats(r->prevstats, r->instart, r->inend,
+                                   block->start, block->end);
+    }
+    t.greedystats = BlendPassStats(r->greedy, r->instart, r->inend,
+                                   block->start, block->end);
+  }
+  t.cost = 0;
+  t.iterations.block = k;
+  t.iterations.bestcost = 0;
+  t.iterations.cost = 0;
+  t.iterations.firstcost = 0;
+  t.iterations.iteration = 0;
+  t.iterations.bestiteration = 0;
+  t.iterations.checkpoint = 0;
+  t.allocator = r->allocator;
+  t.donelock = 0;
+  t.done = 0;
+  t.is_running = 1;
+
+  threading(&t);
+
+  done = t.startiteration > block->startiteration ?
+         t.startiteration - block->startiteration : 0;
+  if(done < r->slice) {
+    /* Stopped by --mui# or found in the parse database. */
+    block->gain = 0;
+  } else {
+    /* Improvements come in bursts, so a slice without one only halves the
+    gain of the slices before. */
+    zfloat gain = 0;
+    if(t.iterations.firstcost > t.iterations.bestcost) {
+      gain = (zfloat)(t.iterations.firstcost - t.iterations.bestcost)
+           / ((zfloat)done * (zfloat)blocksize);
+    }
+    block->gain = r->round == 0 ? gain : (block->gain + gain) / 2;
+  }
+  block->beststats = t.beststats;
+  block->startiteration = t.startiteration;
+  if(t.cost <= block->cost) {
+    ZopfliCleanLZ77Store(&block->store);
+    block->store = t.store;
+    block->cost = t.cost;
+    if(block->passstats != 0) {
+      FreeStats(block->passstats);
+      ZopfliFree(block->passstats);
+    }
+    block->passstats = t.passstats;
+  } else {
+    ZopfliCleanLZ77Store(&t.store);
+    if(t.passstats != 0) {
+      FreeStats(t.passstats);
+      ZopfliFree(t.passstats);
+    }
+  }
+  if(t.seedstats != 0) {
+    FreeStats(t.seedstats);
+    ZopfliFree(t.seedstats);
+  }
+  if(t.greedystats != 0) {
+    FreeStats(t.greedystats);
+    ZopfliFree(t.greedystats);
+  }
+
+  pthread_mutex_lock(&r->mutex);
+  r->spent += (zfloat)done * (zfloat)blocksize;
+  pthread_mutex_unlock(&r->mutex);
+}
+
+static void* BudgetThread(void* a) {
+  ZopfliBudgetRound* r = (ZopfliBudgetRound*)a;
+  ZopfliSetAllocator(r->allocator);
+  for(;;) {
+    size_t k;
+    pthread_mutex_lock(&r->mutex);
+    if(r->next >= r->njobs) {
+      pthread_mutex_unlock(&r->mutex);
+      break;
+    }
+    k = r->jobs[r->next++];
+    if(r->round == 0) {
+      PrintProgress(r->v, r->blocks[k].start, r->inend, k, r->nblocks - 1);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    if(r->round == 0) {
+      ZopfliReportProgress(r->options, ZOPFLI_PROGRESS_BLOCK_START,
+                           r->blocks[k].start, r->blocks[k].end,
+                           k, r->nblocks, 0, 0, 0);
+    }
+    BudgetSlice(r, k);
+  }
+  return 0;
+}
+
+/* Runs the slices of the round, with as many threads as --t# allows. */
+static void BudgetRun(ZopfliBudgetRound* r) {
+  unsigned numthreads = r->options->numthreads;
+  unsigned i;
+  r->next = 0;
+  if(numthreads == 0) {
+    BudgetThread(r);
+  } else {
+    pthread_t* thr;
+    if(numthreads > r->njobs) numthreads = (unsigned)r->njobs;
+    thr = (pthread_t*)ZopfliMalloc(sizeof(*thr) * numthreads);
+    if (!thr) exit(-1); /* Allocation failed. */
+    for(i = 0; i < numthreads; ++i) {
+      pthread_create(&thr[i], NULL, BudgetThread, (void*)r);
+    }
+    for(i = 0; i < numthreads; ++i) {
+      pthread_join(thr[i], NULL);
+    }
+    ZopfliFree(thr);
+  }
+}
+
+/*
+Does what ZopfliUseThreads does, except that the blocks share
+options->budget iterations per block on average (--budget#). Every block gets
+a first slice of iterations. Then, round after round, the blocks that saved
+the most bits per iteration and byte in their last slice get another, as
+many at once as there are threads, until the budget is spent or no block
+improves anymore. Which blocks get a slice only depends on the results of
+the rounds before, so the output doesn't depend on thread timing. With
+--prescan, incompressible blocks are stored first and get neither slices nor
+a share of the budget.
+*/
+static void ZopfliBudgetThreads(const ZopfliOptions* options,
+                                ZopfliLZ77Store* lz77,
+                                const unsigned char* in,
+                                size_t instart, size_t inend,
+                                size_t npoints, size_t* splitpoints,
+                                const size_t* splitpoints_uncompressed,
+                                ZopfliLongestMatchCache* lmc,
+                                const ZopfliPassStats* greedy,
+                                const ZopfliPassStats* prevstats,
+                                ZopfliPassStats* passstats,
+                                zfloat *totalcost, int v) {
+  size_t nblocks = npoints + 1;
+  size_t maxjobs = options->numthreads > 1 ? options->numthreads : 1;
+  size_t budgetbytes = inend - instart;
+  zfloat budget;
+  size_t i, j;
+  size_t* jobs = (size_t*)ZopfliMalloc(sizeof(*jobs) * nblocks);
+  ZopfliBudgetRound r;
+
+  r.blocks = (ZopfliBudgetBlock*)ZopfliMalloc(sizeof(*r.blocks) * nblocks);
+  if (!jobs || !r.blocks) exit(-1); /* Allocation failed. */
+  for(i = 0; i < nblocks; ++i) {
+    r.blocks[i].start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
+    r.blocks[i].end = i == npoints ? inend : splitpoints_uncompressed[i];
+    ZopfliInitLZ77Store(in, &r.blocks[i].store);
+    r.blocks[i].cost = ZOPFLI_LARGE_FLOAT;
+    r.blocks[i].beststats = 0;
+    r.blocks[i].startiteration = 0;
+    r.blocks[i].passstats = 0;
+    r.blocks[i].gain = 0;
+  }
+  pthread_mutex_init(&r.mutex, NULL);
+  r.nblocks = nblocks;
+  r.options = options;
+  r.allocator = ZopfliGetAllocator();
+  r.in = in;
+  r.instart = instart;
+  r.inend = inend;
+  r.lmc = lmc;
+  r.greedy = greedy;
+  r.prevstats = prevstats;
+  r.v = v;
+  r.spent = 0;
+  r.round = 0;
+
+  /* Every block gets its first slice, but an incompressible one. */
+  r.jobs = jobs;
+  r.njobs = 0;
+  for(i = 0; i < nblocks; ++i) {
+    ZopfliBudgetBlock* block = &r.blocks[i];
+    if((options->mode & 0x2000)
+       && Incompressible(in, block->start, block->end)) {
+      block->cost = StoreIncompressible(options, in, block->start, block->end,
+                                        i, &block->store);
+      budgetbytes -= block->end - block->start;
+    } else {
+      jobs[r.njobs++] = i;
+    }
+  }
+  budget = (zfloat)options->budget * (zfloat)budgetbytes;
+  r.slice = options->budget < ZOPFLI_BUDGET_SLICE ?
+            options->budget : ZOPFLI_BUDGET_SLICE;
+  if(r.njobs > 0) BudgetRun(&r);
+
+  /* The rest goes to the blocks that gained the most from their last one. */
+  r.slice = ZOPFLI_BUDGET_SLICE;
+  while(r.spent < budget && !ZopfliDeadlineReached(options->deadline)) {
+    r.njobs = 0;
+    /* jobs keeps the maxjobs blocks with the highest gain, highest first. */
+    for(i = 0; i < nblocks; ++i) {
+      zfloat gain = r.blocks[i].gain;
+      if(gain <= 0) continue;
+      if(r.njobs < maxjobs) {
+        j = r.njobs++;
+      } else if(gain > r.blocks[jobs[maxjobs - 1]].gain) {
+        j = maxjobs - 1;
+      } else {
+        continue;
+      }
+      for(; j > 0 && r.blocks[jobs[j - 1]].gain < gain; --j) {
+        jobs[j] = jobs[j - 1];
+      }
+      jobs[j] = i;
+    }
+    if(r.njobs == 0) break;
+    ++r.round;
+    if(v>2) fprintf(stderr,"Budget round %d: %d block(s), %.1f%% spent      \r",
+                    r.round, (int)r.njobs, 100.0 * (zpfloat)r.spent / (zpfloat)budget);
+    BudgetRun(&r);
+  }
+  if(v>2 && r.round > 0) fprintf(stderr,"\n");
+
+  for(i = 0; i < nblocks; ++i) {
+    ZopfliBudgetBlock* block = &r.blocks[i];
+    if((options->mode & 0x0110) == 0x0100 && block->beststats != 0) {
+      ZopfliBestStats statsdb;
+      statsdb.blocksize = block->end - block->start;
+      statsdb.blockcrc = CRC(in + block->start, statsdb.blocksize);
+      statsdb.mode = options->mode & 0xF;
+      statsdb.beststats = block->beststats;
+      statsdb.startiteration = block->startiteration;
+      statsdb.cost = block->cost;
+      ZopfliStatsDBSave(&statsdb);
+    }
+    if(block->beststats != 0) {
+      FreeStats(block->beststats);
+      ZopfliFree(block->beststats);
+    }
+    if(passstats != NULL) {
+      passstats->stats[i] = block->passstats;
+    } else if(block->passstats != 0) {
+      FreeStats(block->passstats);
+      ZopfliFree(block->passstats);
+    }
+    ZopfliReportProgress(options, ZOPFLI_PROGRESS_BLOCK_END,
+                         block->start, block->end, i, nblocks, 0, 0,
+                         (double)block->cost);
+    *totalcost += block->cost;
+    ZopfliAppendLZ77Store(&block->store, lz77);
+    ZopfliCleanLZ77Store(&block->store);
+    if(i < npoints) splitpoints[i] = lz77->size;
+  }
+
+  pthread_mutex_destroy(&r.mutex);
+  ZopfliFree(r.blocks);
+  ZopfliFree(jobs);
+}
+
+/*
+CRC32 of the options the final split points of a master block depend on,
+for the split database of --statsdb. The database switches themselves and
+the amount of threads don't change them.
+*/
+static unsigned long SplitOptionsCRC(const ZopfliOptions* options) {
+  unsigned long values[12];
+  values[0] = options->numiterations;
+  values[1] = (unsigned long)options->blocksplittingmax;
+  values[2] = (unsigned long)options->lengthscoremax;
+  values[3] = options->maxfailiterations;
+  values[4] = options->findminimumrec;
+  values[5] = options->ranstatewz;
+  values[6] = (unsigned long)options->ranstatemod;
+  values[7] = (unsigned long)options->pass;
+  values[8] = options->mode & ~0x0D00UL;
+  values[9] = (unsigned long)options->rui;
+  values[10] = (unsigned long)options->statimportance;
+  values[11] = sizeof(zfloat);
+  return CRC((const unsigned char*)values, sizeof(values));
+}
+
+/*
+Stores the split points of the master block starting at instart in the split
+database, with the pass, done and cost already set in splitsdb.
+*/
+static void SaveSplitPoints(ZopfliBestSplits* splitsdb, const size_t* points,
+                            size_t npoints, size_t instart) {
+  size_t i;
+  splitsdb->splitpoints = 0;
+  splitsdb->npoints = 0;
+  for (i = 0; i < npoints; ++i) {
+    ZOPFLI_APPEND_DATA(points[i] - instart,
+                       &splitsdb->splitpoints, &splitsdb->npoints);
+  }
+  ZopfliSplitDBSave(splitsdb);
+  ZopfliFree(splitsdb->splitpoints);
 }
 
 /*
@@ -1630,10 +2439,10 @@ structure (sp) with the best ones that Zopfli found.
 ZopfliPredefinedSplits can be safely passed as NULL pointer to disable
 this functionality.
 */
-DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
-                          const unsigned char* in, size_t instart, size_t inend,
-                          unsigned char* bp, unsigned char** out,
-                          size_t* outsize, int v, ZopfliPredefinedSplits *sp) {
+static void DeflatePart(const ZopfliOptions* options, int btype, int final,
+                        const unsigned char* in, size_t instart, size_t inend,
+                        unsigned char* bp, unsigned char** out,
+                        size_t* outsize, int v, ZopfliPredefinedSplits *sp) {
   size_t i;
   /* byte coordinates rather than lz77 index */
   size_t* splitpoints_uncompressed = 0;
@@ -1644,7 +2453,20 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
   zfloat alltimebest = 0;
   int* bestperblock = 0;
   int* bestperblock2 = 0;
+  int usesplitsdb = 0;
+  int splitsfound = 0;
+  int splitsdone = 0;
+  int stored = 0;
+  ZopfliBestSplits splitsdb;
+  ZopfliPassStats passstats;
+  /* Stats of the greedy LZ77 of the block splitter for every block it found,
+  give blocks their initial stats, and the split points they belong to. */
+  ZopfliPassStats greedy;
+  size_t* greedypoints = 0;
+  ZopfliLongestMatchCache* lmc = 0;
   ZopfliLZ77Store lz77;
+  size_t startsize = *outsize;
+  unsigned char startbp = *bp;
 
   /* If btype=2 is specified, it tries all block types. If a lesser btype is
   given, then however it forces that one. Neither of the lesser types needs
@@ -1667,13 +2489,74 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
     return;
   }
 
+  ZopfliReportProgress(options, ZOPFLI_PROGRESS_MASTER_BLOCK, instart, inend,
+                       0, 0, 0, 0, 0);
+
+  /* Already compressed data skips block splitting as well. Predefined split
+  points are always used, and a stored master block adds none to sp. */
+  if ((options->mode & 0x2000) && (sp == NULL || sp->splitpoints == NULL)
+      && Incompressible(in, instart, inend)) {
+    if (v>2) fprintf(stderr," Master block is incompressible, storing it.\n");
+    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
+    ZopfliReportProgress(options, ZOPFLI_PROGRESS_STORED, instart, inend,
+                         0, 1, 0, 0,
+                         (double)(OutputBits(*outsize, *bp)
+                                  - OutputBits(startsize, startbp)));
+    return;
+  }
+
   ZopfliInitLZ77Store(in, &lz77);
+  greedy.stats = 0;
+  greedy.npoints = 0;
+
+  /* Split points of a master block seen before with the same options replace
+  all block splitting, also the passes after compression. A checkpoint of
+  --resume replaces the passes done before it. */
+  usesplitsdb = options->blocksplitting && (options->mode & 0x0100)
+                && (sp==NULL || sp->splitpoints==NULL);
+  if (usesplitsdb) {
+    splitsdb.blocksize = inend - instart;
+    splitsdb.blockcrc = CRC(in + instart, inend - instart);
+    splitsdb.optionscrc = SplitOptionsCRC(options);
+    splitsfound = ZopfliSplitDBLoad(&splitsdb);
+    if(splitsfound) {
+      for(i = 0; i < splitsdb.npoints; ++i) {
+        ZOPFLI_APPEND_DATA(instart + splitsdb.splitpoints[i],
+                           &splitpoints_uncompressed, &npoints);
+      }
+      ZopfliFree(splitsdb.splitpoints);
+      splitsdone = splitsdb.done;
+      pass = (int)splitsdb.pass;
+      if (v>2) fprintf(stderr," Using %d split points from database, pass #%d.\n",(int)npoints,pass);
+    }
+  }
 
   if (options->blocksplitting) {
     if(sp==NULL || sp->splitpoints==NULL) {
-      ZopfliBlockSplit(options, in, instart, inend,
-                       options->blocksplittingmax,
-                       &splitpoints_uncompressed, &npoints);
+      if(!splitsfound && !ZopfliDeadlineReached(options->deadline)) {
+        ZopfliLZ77Store greedystore;
+        ZopfliInitLZ77Store(in, &greedystore);
+        ZopfliBlockSplit(options, in, instart, inend,
+                         options->blocksplittingmax,
+                         &splitpoints_uncompressed, &npoints, &greedystore);
+        /* Only the stats of its blocks are needed from the greedy store, so
+        it doesn't stay around while the blocks are compressed. */
+        if(greedystore.size > 0) {
+          greedypoints = (size_t*)ZopfliMalloc(sizeof(*greedypoints) * (npoints + 1));
+          if(!greedypoints) exit(-1); /* Allocation failed. */
+          for(i = 0; i < npoints; ++i) greedypoints[i] = splitpoints_uncompressed[i];
+          GreedyPassStats(&greedystore, instart, inend, greedypoints, npoints,
+                          &greedy);
+        }
+        ZopfliCleanLZ77Store(&greedystore);
+        if(usesplitsdb && (options->mode & 0x0800)
+           && !ZopfliDeadlineReached(options->deadline)) {
+          splitsdb.pass = 0;
+          splitsdb.done = 0;
+          splitsdb.cost = ZOPFLI_LARGE_FLOAT;
+          SaveSplitPoints(&splitsdb, splitpoints_uncompressed, npoints, instart);
+        }
+      }
     } else {
       size_t lastknownsplit = 0;
       size_t* splitunctemp = 0;
@@ -1686,14 +2569,14 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
             lastknownsplit = i;
             ZopfliBlockSplit(options, in, start, sp->splitpoints[i], 
                              options->blocksplittingmax,
-                             &splitunctemp, &npointstemp);
+                             &splitunctemp, &npointstemp, NULL);
             if(npointstemp > 0) {
               size_t j = 0;
               for(;j < npointstemp; ++j) {
                 ZOPFLI_APPEND_DATA(splitunctemp[j], &splitpoints_uncompressed, &npoints);
               }
             }
-            free(splitunctemp);
+            ZopfliFree(splitunctemp);
             splitunctemp = 0;
           }
           ZOPFLI_APPEND_DATA(sp->splitpoints[i], &splitpoints_uncompressed, &npoints);
@@ -1701,43 +2584,77 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
       }
       if(sp->moresplitting == 1) {
         ZopfliBlockSplit(options, in, sp->splitpoints[lastknownsplit] , inend,
-                         options->blocksplittingmax, &splitunctemp, &npointstemp);
+                         options->blocksplittingmax, &splitunctemp, &npointstemp,
+                         NULL);
         if(npointstemp > 0) {
           for(i = 0; i < npointstemp; ++i) {
             ZOPFLI_APPEND_DATA(splitunctemp[i], &splitpoints_uncompressed, &npoints);
           }
         }
-        free(splitunctemp);
+        ZopfliFree(splitunctemp);
         splitunctemp = 0;
       }
     }
-    splitpoints = (size_t*)calloc(npoints, sizeof(*splitpoints));
+    splitpoints = (size_t*)ZopfliCalloc(npoints, sizeof(*splitpoints));
   }
 
   if(options->mode & 0x0010) {
-    bestperblock = malloc(sizeof(*bestperblock) * (npoints + 1));
+    bestperblock = ZopfliMalloc(sizeof(*bestperblock) * (npoints + 1));
+  }
+
+  /* Recompression passes and --all tries go over the same bytes again, only
+  with other block boundaries or modes. Find the matches once for the whole
+  master block and let every block slice into that cache. */
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if(options->pass > 0 || (options->mode & 0x0010)) {
+    lmc = (ZopfliLongestMatchCache*)ZopfliMalloc(sizeof(*lmc));
+    ZopfliInitCache(inend - instart, lmc);
+  }
+#endif
+
+  /* With --warmstart the stats every block ends up with are kept, so the
+  blocks of the next pass can start from those of the blocks they overlap. */
+  passstats.stats = 0;
+  passstats.npoints = 0;
+  if(options->mode & 0x1000) {
+    InitPassStats(npoints, &passstats);
+    passstats.splitpoints = splitpoints_uncompressed;
   }
 
   i = 0;
-  ZopfliUseThreads(options, &lz77, in, instart, inend, i, npoints,
-                   &splitpoints, &splitpoints_uncompressed, &bestperblock,
-                   &totalcost,v);
+  ZopfliReportProgress(options, ZOPFLI_PROGRESS_PASS, instart, inend,
+                       0, npoints + 1, pass, 0, 0);
+  if(options->budget > 0 && (options->mode & 0x0010) == 0) {
+    ZopfliBudgetThreads(options, &lz77, in, instart, inend, npoints,
+                        splitpoints, splitpoints_uncompressed, lmc, &greedy,
+                        NULL, passstats.stats ? &passstats : NULL,
+                        &totalcost, v);
+  } else {
+    ZopfliUseThreads(options, &lz77, in, instart, inend, i, npoints,
+                     &splitpoints, &splitpoints_uncompressed, &bestperblock,
+                     lmc, &greedy, NULL, passstats.stats ? &passstats : NULL,
+                     &totalcost,v);
+  }
 
   alltimebest = totalcost;
 
   /* Second/nth block splitting attempt and optional recompression */
-  if (options->blocksplitting && npoints > 0 && (options->mode & 0x0040) == 0) {
+  if (options->blocksplitting && npoints > 0 && (options->mode & 0x0040) == 0
+      && !splitsdone && (pass < options->pass || options->pass == 0)) {
     size_t* splitpoints2;
     size_t npoints2;
     zfloat totalcost2;
     do {
+      if(ZopfliDeadlineReached(options->deadline)) break;
       splitpoints2 = 0;
       npoints2 = 0;
       totalcost2 = 0;
 
+      ZopfliLZ77IndexHistograms(&lz77);
       ZopfliBlockSplitLZ77(options, &lz77,
                            options->blocksplittingmax, &splitpoints2,
                            &npoints2);
+      ZopfliLZ77DropHistogramIndex(&lz77);
 
       for (i = 0; i <= npoints2; i++) {
         size_t start = i == 0 ? 0 : splitpoints2[i - 1];
@@ -1750,12 +2667,13 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
         size_t* splitpoints_uncompressed2 = 0;
         size_t j = 0;
         ZopfliLZ77Store lz77temp;
+        ZopfliPassStats passstats2;
         totalcost = 0;
         ZopfliInitLZ77Store(in, &lz77temp);
 
         if(npoints2 > 0 && splitpoints_uncompressed2==0) {
           size_t npointstemp = 0;
-          size_t postemp = 0;
+          size_t postemp = instart;
           for (i = 0; i < lz77.size; ++i) {
             size_t length = lz77.dists[i] == 0 ? 1 : lz77.litlens[i];
             if (splitpoints2[npointstemp] == i) {
@@ -1768,14 +2686,32 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
         }
 
         if (v>2) fprintf(stderr," Recompressing, pass #%d.\n",pass);
+        ZopfliReportProgress(options, ZOPFLI_PROGRESS_PASS, instart, inend,
+                             0, npoints2 + 1, pass, 0, 0);
 
         if(options->mode & 0x0010) {
-          bestperblock2 = malloc(sizeof(*bestperblock2) * (npoints2+1));
+          bestperblock2 = ZopfliMalloc(sizeof(*bestperblock2) * (npoints2+1));
         }
 
-        ZopfliUseThreads(options, &lz77temp, in, instart, inend, j, npoints2,
-                         &splitpoints2, &splitpoints_uncompressed2, &bestperblock2,
-                         &totalcost,v);
+        passstats2.stats = 0;
+        passstats2.npoints = 0;
+        if(options->mode & 0x1000) {
+          InitPassStats(npoints2, &passstats2);
+          passstats2.splitpoints = splitpoints_uncompressed2;
+        }
+
+        if(options->budget > 0 && (options->mode & 0x0010) == 0) {
+          ZopfliBudgetThreads(options, &lz77temp, in, instart, inend, npoints2,
+                              splitpoints2, splitpoints_uncompressed2, lmc,
+                              &greedy, passstats.stats ? &passstats : NULL,
+                              passstats2.stats ? &passstats2 : NULL,
+                              &totalcost, v);
+        } else {
+          ZopfliUseThreads(options, &lz77temp, in, instart, inend, j, npoints2,
+                           &splitpoints2, &splitpoints_uncompressed2, &bestperblock2,
+                           lmc, &greedy, passstats.stats ? &passstats : NULL,
+                           passstats2.stats ? &passstats2 : NULL, &totalcost,v);
+        }
 
         if (v>2) fprintf(stderr,"!! RECOMPRESS: ");
         if(totalcost < alltimebest) {
@@ -1783,39 +2719,50 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
           alltimebest = totalcost;
           ZopfliCopyLZ77Store(&lz77temp,&lz77);
           ZopfliCleanLZ77Store(&lz77temp);
-          free(splitpoints);
-          free(splitpoints_uncompressed);
+          ZopfliFree(splitpoints);
+          ZopfliFree(splitpoints_uncompressed);
           splitpoints = splitpoints2;
           splitpoints_uncompressed = splitpoints_uncompressed2;
-          free(bestperblock);
+          ZopfliFree(bestperblock);
           npoints = npoints2;
+          CleanPassStats(&passstats);
+          passstats = passstats2;
           if(options->mode & 0x0010) {
-            bestperblock = malloc(sizeof(*bestperblock) * (npoints+1));
+            bestperblock = ZopfliMalloc(sizeof(*bestperblock) * (npoints+1));
             for(i = 0; i<= npoints; ++i) {
               bestperblock[i] = bestperblock2[i];
             }
-            free(bestperblock2);
+            ZopfliFree(bestperblock2);
+          }
+          if(usesplitsdb && (options->mode & 0x0800)) {
+            splitsdb.pass = (unsigned)pass;
+            splitsdb.done = 0;
+            splitsdb.cost = alltimebest;
+            SaveSplitPoints(&splitsdb, splitpoints_uncompressed, npoints, instart);
           }
         } else {
-          free(splitpoints2);
+          ZopfliFree(splitpoints2);
           splitpoints2=0;
-          free(splitpoints_uncompressed2);
+          ZopfliFree(splitpoints_uncompressed2);
           splitpoints_uncompressed2=0;
           ZopfliCleanLZ77Store(&lz77temp);
-          free(bestperblock2);
+          ZopfliFree(bestperblock2);
+          CleanPassStats(&passstats2);
           if (v>2) fprintf(stderr,"Bigger, using last (%lu bit > %lu bit) !\n",(unsigned long)totalcost,(unsigned long)alltimebest);
           break;
         }
       } else {
         if(totalcost2 < alltimebest) {
-          free(splitpoints);
-          free(bestperblock);
+          alltimebest = totalcost2;
+          ZopfliFree(splitpoints);
+          ZopfliFree(bestperblock);
+          bestperblock = 0;
           splitpoints = splitpoints2;
           npoints = npoints2;
           if(npoints2 > 0) {
-            size_t postemp = 0;
+            size_t postemp = instart;
             size_t npointstemp = 0;
-            free(splitpoints_uncompressed);
+            ZopfliFree(splitpoints_uncompressed);
             splitpoints_uncompressed = 0;
             for (i = 0; i < lz77.size; ++i) {
               size_t length = lz77.dists[i] == 0 ? 1 : lz77.litlens[i];
@@ -1828,7 +2775,7 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
             assert(npointstemp == npoints);
           }
         } else {
-          free(splitpoints2);
+          ZopfliFree(splitpoints2);
           splitpoints2=0;
         }
       }
@@ -1850,17 +2797,43 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
       }
     }
     if(bestperblock!=NULL) {
-      o.mode = bestperblock[i] + (o.mode & 0xFFF0);
+      o.mode = (bestperblock[i] & 0xF) + (o.mode & 0xFFF0);
     }
     AddLZ77BlockAutoType(&o, i == npoints && final,
                          &lz77, start, end, 0,
                          bp, out, outsize);
   }
 
-  if(npoints>0) {
+  /*
+  Block costs are estimates and every block pads to its own byte boundary
+  when stored, so the blocks can end up bigger than storing all at once. The
+  output is never bigger than that, ZopfliCompressBound relies on it. Its
+  split points then weren't used, so they're neither stored nor returned.
+  */
+  if (inend > instart && OutputBits(*outsize, *bp) - OutputBits(startsize, startbp)
+                         > NonCompressedBits(startbp, inend - instart)) {
+    if (v>2) fprintf(stderr,"!! STORED IS SMALLER, USING IT\n");
+    if (startsize == 0) {
+      ZopfliFree(*out);
+      *out = 0;
+    } else if (startbp != 0) {
+      (*out)[startsize - 1] &= (1 << startbp) - 1;
+    }
+    *outsize = startsize;
+    *bp = startbp;
+    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
+    stored = 1;
+    if(sp!=NULL) {
+      ZopfliFree(sp->splitpoints);
+      sp->splitpoints = 0;
+      sp->npoints = 0;
+    }
+  }
+
+  if(npoints>0 && !stored) {
     int hadsplits = 0;
     if(sp!=NULL) {
-      free(sp->splitpoints);
+      ZopfliFree(sp->splitpoints);
       sp->splitpoints = 0;
       sp->npoints = 0;
       hadsplits = 1;
@@ -1883,10 +2856,28 @@ DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int f
     }
   }
 
+  /* Split points cut short by the deadline aren't final. */
+  if (usesplitsdb && !splitsdone && !stored
+      && !ZopfliDeadlineReached(options->deadline)) {
+    splitsdb.pass = (unsigned)pass;
+    splitsdb.done = 1;
+    splitsdb.cost = alltimebest;
+    SaveSplitPoints(&splitsdb, splitpoints_uncompressed, npoints, instart);
+  }
+
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if(lmc != NULL) {
+    ZopfliCleanCache(lmc);
+    ZopfliFree(lmc);
+  }
+#endif
+  CleanPassStats(&passstats);
+  CleanPassStats(&greedy);
+  ZopfliFree(greedypoints);
   ZopfliCleanLZ77Store(&lz77);
-  free(splitpoints);
-  free(splitpoints_uncompressed);
-  free(bestperblock);
+  ZopfliFree(splitpoints);
+  ZopfliFree(splitpoints_uncompressed);
+  ZopfliFree(bestperblock);
 }
 
 /*
@@ -1894,28 +2885,38 @@ Pretty much as the original but ensures that ZopfliPredefinedSplits
 structure passes/returns proper split points when input requires
 splitting to ZOPFLI_MASTER_BLOCK_SIZE chunks.
 */
-DLL_PUBLIC void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
-                   const unsigned char* in, size_t insize,
-                   unsigned char* bp, unsigned char** out, size_t* outsize,
-                   ZopfliPredefinedSplits *sp) {
+DLL_PUBLIC void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
+                          const unsigned char* in, size_t instart, size_t inend,
+                          unsigned char* bp, unsigned char** out,
+                          size_t* outsize, int v, ZopfliPredefinedSplits *sp) {
+  const ZopfliAllocator* previous = ZopfliBindAllocator(options);
+  DeflatePart(options, btype, final, in, instart, inend, bp, out, outsize, v, sp);
+  ZopfliSetAllocator(previous);
+}
+
+/* Compresses in[instart, insize), in[0, instart) is the window before it. */
+static void Deflate(const ZopfliOptions* options, int btype, int final,
+                    const unsigned char* in, size_t instart, size_t insize,
+                    unsigned char* bp, unsigned char** out, size_t* outsize,
+                    ZopfliPredefinedSplits *sp) {
  size_t offset = *outsize;
 #if ZOPFLI_MASTER_BLOCK_SIZE == 0
-  ZopfliDeflatePart(options, btype, final, in, 0, insize, bp, out, outsize, options->verbose, sp);
+  ZopfliDeflatePart(options, btype, final, in, instart, insize, bp, out, outsize, options->verbose, sp);
 #else
-  size_t i = 0;
-  ZopfliPredefinedSplits* originalsp = (ZopfliPredefinedSplits*)malloc(sizeof(ZopfliPredefinedSplits));
-  ZopfliPredefinedSplits* finalsp = (ZopfliPredefinedSplits*)malloc(sizeof(ZopfliPredefinedSplits));
+  size_t i = instart;
+  ZopfliPredefinedSplits* originalsp = (ZopfliPredefinedSplits*)ZopfliMalloc(sizeof(ZopfliPredefinedSplits));
+  ZopfliPredefinedSplits* finalsp = (ZopfliPredefinedSplits*)ZopfliMalloc(sizeof(ZopfliPredefinedSplits));
   if(sp != NULL) {
+    size_t j = 0;
     originalsp->splitpoints = 0;
     originalsp->npoints = 0;
     finalsp->splitpoints = 0;
     finalsp->npoints = 0;
     originalsp->moresplitting = sp->moresplitting;
     finalsp->moresplitting = sp->moresplitting;
-    for(; i < sp->npoints; ++i) {
-      ZOPFLI_APPEND_DATA(sp->splitpoints[i], &originalsp->splitpoints, &originalsp->npoints);
+    for(; j < sp->npoints; ++j) {
+      ZOPFLI_APPEND_DATA(sp->splitpoints[j], &originalsp->splitpoints, &originalsp->npoints);
     }
-    i = 0;
   }
   while (i < insize) {
     int masterfinal = (i + ZOPFLI_MASTER_BLOCK_SIZE >= insize);
@@ -1926,9 +2927,9 @@ DLL_PUBLIC void ZopfliDeflate(const ZopfliOptions* options, int btype, int final
     if(sp != NULL) {
       size_t j = 0;
       for(; j < sp->npoints; ++j) {
-        ZOPFLI_APPEND_DATA(i + sp->splitpoints[j], &finalsp->splitpoints, &finalsp->npoints);
+        ZOPFLI_APPEND_DATA(sp->splitpoints[j], &finalsp->splitpoints, &finalsp->npoints);
       }
-      free(sp->splitpoints);
+      ZopfliFree(sp->splitpoints);
       sp->splitpoints = 0;
       sp->npoints = 0;
       for(j = 0; j < originalsp->npoints; ++j) {
@@ -1939,17 +2940,61 @@ DLL_PUBLIC void ZopfliDeflate(const ZopfliOptions* options, int btype, int final
   }
   if(sp != NULL) {
     size_t j = 0;
-    free(originalsp->splitpoints);
-    free(sp->splitpoints);
+    ZopfliFree(originalsp->splitpoints);
+    ZopfliFree(sp->splitpoints);
     sp->splitpoints = 0;
     sp->npoints = 0;
     for(; j < finalsp->npoints; ++j) {
       ZOPFLI_APPEND_DATA(finalsp->splitpoints[j], &sp->splitpoints, &sp->npoints);
     }
-    free(finalsp->splitpoints);
+    ZopfliFree(finalsp->splitpoints);
   }
-  free(finalsp);
-  free(originalsp);
+  ZopfliFree(finalsp);
+  ZopfliFree(originalsp);
 #endif
-  if(options->verbose>1) PrintSummary(insize,0,*outsize-offset);
+  if(options->verbose>1) PrintSummary(insize - instart,0,*outsize-offset);
+}
+
+/*
+Compresses in with the last ZOPFLI_WINDOW_SIZE bytes of the dictionary of
+options as the window before it. Split points of sp are those of in.
+*/
+static void DeflateDictionary(const ZopfliOptions* options, int btype,
+                              int final, const unsigned char* in,
+                              size_t insize, unsigned char* bp,
+                              unsigned char** out, size_t* outsize,
+                              ZopfliPredefinedSplits *sp) {
+  size_t window = options->dictionarysize < ZOPFLI_WINDOW_SIZE ?
+                  options->dictionarysize : ZOPFLI_WINDOW_SIZE;
+  unsigned char* buffer = (unsigned char*)ZopfliMalloc(window + insize);
+  size_t i;
+  if (!buffer) exit(-1); /* Allocation failed. */
+  memcpy(buffer, options->dictionary + options->dictionarysize - window,
+         window);
+  memcpy(buffer + window, in, insize);
+  if(sp != NULL) {
+    for(i = 0; i < sp->npoints; ++i) sp->splitpoints[i] += window;
+  }
+  Deflate(options, btype, final, buffer, window, window + insize,
+          bp, out, outsize, sp);
+  if(sp != NULL) {
+    for(i = 0; i < sp->npoints; ++i) {
+      sp->splitpoints[i] = sp->splitpoints[i] > window ?
+                           sp->splitpoints[i] - window : 0;
+    }
+  }
+  ZopfliFree(buffer);
+}
+
+DLL_PUBLIC void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
+                   const unsigned char* in, size_t insize,
+                   unsigned char* bp, unsigned char** out, size_t* outsize,
+                   ZopfliPredefinedSplits *sp) {
+  const ZopfliAllocator* previous = ZopfliBindAllocator(options);
+  if(options->dictionary != NULL && options->dictionarysize > 0) {
+    DeflateDictionary(options, btype, final, in, insize, bp, out, outsize, sp);
+  } else {
+    Deflate(options, btype, final, in, 0, insize, bp, out, outsize, sp);
+  }
+  ZopfliSetAllocator(previous);
 }
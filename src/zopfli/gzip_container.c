@@ -44,6 +44,7 @@ void ZopfliGzipCompress(const ZopfliOptions* options,
   unsigned int i;
   const char* infilename = NULL;
   unsigned char bp=0;
+  ZopfliOptions nodictionary;
   if(moredata!=NULL) infilename = moredata->filename;
 
   for(i=0;i<sizeof(headerstart);++i) ZOPFLI_APPEND_DATA(headerstart[i], out, outsize);
@@ -55,7 +56,7 @@ void ZopfliGzipCompress(const ZopfliOptions* options,
   }
   /* MTIME */
   if(moredata == NULL) {
-    for(i=0;i<sizeof(defTimestamp);++i) ZOPFLI_APPEND_DATA((defTimestamp >> (i*8)) % 256, out, outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((defTimestamp >> (i*8)) % 256, out, outsize);
   } else {
     for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((moredata->timestamp >> (i*8)) % 256, out, outsize);
   }
@@ -69,7 +70,10 @@ void ZopfliGzipCompress(const ZopfliOptions* options,
     ZOPFLI_APPEND_DATA(0, out, outsize);
   }
 
-  ZopfliDeflate(options, 2 /* Dynamic block */, 1,
+  /* Gzip can't name a preset dictionary for the decoder. */
+  nodictionary = *options;
+  nodictionary.dictionary = NULL;
+  ZopfliDeflate(&nodictionary, 2 /* Dynamic block */, 1,
                 in, insize, &bp, out, outsize, sp);
 
   /* CRC */
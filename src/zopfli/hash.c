@@ -61,18 +61,18 @@ void ZopfliMallocHash(size_t window_size, ZopfliHash* h) {
    Memory fragmentation is usually fixed by rebooting.
 */
   do {
-    h->head = (int*)malloc(sizeof(*h->head) * 65536);
-    h->prev = (unsigned short*)malloc(sizeof(*h->prev) * window_size);
-    h->hashval = (int*)malloc(sizeof(*h->hashval) * window_size);
+    h->head = (int*)ZopfliMalloc(sizeof(*h->head) * 65536);
+    h->prev = (unsigned short*)ZopfliMalloc(sizeof(*h->prev) * window_size);
+    h->hashval = (int*)ZopfliMalloc(sizeof(*h->hashval) * window_size);
 
 #ifdef ZOPFLI_HASH_SAME
-    h->same = (unsigned short*)malloc(sizeof(*h->same) * window_size);
+    h->same = (unsigned short*)ZopfliMalloc(sizeof(*h->same) * window_size);
 #endif
 
 #ifdef ZOPFLI_HASH_SAME_HASH
-    h->head2 = (int*)malloc(sizeof(*h->head2) * 65536);
-    h->prev2 = (unsigned short*)malloc(sizeof(*h->prev2) * window_size);
-    h->hashval2 = (int*)malloc(sizeof(*h->hashval2) * window_size);
+    h->head2 = (int*)ZopfliMalloc(sizeof(*h->head2) * 65536);
+    h->prev2 = (unsigned short*)ZopfliMalloc(sizeof(*h->prev2) * window_size);
+    h->hashval2 = (int*)ZopfliMalloc(sizeof(*h->hashval2) * window_size);
 #endif
 
     if(h->head == NULL || h->prev == NULL || h->hashval == NULL
@@ -101,18 +101,18 @@ void ZopfliMallocHash(size_t window_size, ZopfliHash* h) {
 
 void ZopfliCleanHash(ZopfliHash* h) {
 #ifdef ZOPFLI_HASH_SAME_HASH
-  free(h->hashval2);
-  free(h->prev2);
-  free(h->head2);
+  ZopfliFree(h->hashval2);
+  ZopfliFree(h->prev2);
+  ZopfliFree(h->head2);
 #endif
 
 #ifdef ZOPFLI_HASH_SAME
-  free(h->same);
+  ZopfliFree(h->same);
 #endif
 
-  free(h->hashval);
-  free(h->prev);
-  free(h->head);
+  ZopfliFree(h->hashval);
+  ZopfliFree(h->prev);
+  ZopfliFree(h->head);
 }
 
 /*
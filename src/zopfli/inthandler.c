@@ -2,7 +2,7 @@
 #include <stdio.h>
 #include "inthandler.h"
 
-unsigned int mui;
+volatile sig_atomic_t finishwork = 0;
 
 void intHandler(int exit_code) {
   if(exit_code==2) {
@@ -10,6 +10,6 @@ void intHandler(int exit_code) {
                    " (!!) CTRL+C detected! Setting --mui to 1 to finish work ASAP!\n"
                    " (!!) Restore points won't be saved from now on!              \n"
                    " (!!) Press it again to abort work.\n");
-    mui=1;
+    finishwork=1;
   }
 }
@@ -1,7 +1,10 @@
 #ifndef INTHANDLER_H_
 #define INTHANDLER_H_
 
-extern unsigned int mui;
+#include <signal.h>
+
+/* Set by intHandler, ZopfliOptions.finish of zopfli points to it. */
+extern volatile sig_atomic_t finishwork;
 
 extern void intHandler(int exit_code);
 
@@ -25,6 +25,7 @@ Jyrki Katajainen, Alistair Moffat, Andrew Turpin".
 
 #include "defines.h"
 #include "katajainen.h"
+#include "util.h"
 #include <stdlib.h>
 #include <limits.h>
 
@@ -201,7 +202,7 @@ int ZopfliLengthLimitedCodeLengths(
   Node* (*lists)[2];
 
   /* One leaf per symbol. Only numsymbols leaves will be used. */
-  Node* leaves = (Node*)malloc(n * sizeof(*leaves));
+  Node* leaves = (Node*)ZopfliMalloc(n * sizeof(*leaves));
 
   /* Initialize all bitlengths at 0. */
   memset(bitlengths, 0, n * sizeof(bitlengths[0]));
@@ -217,22 +218,22 @@ int ZopfliLengthLimitedCodeLengths(
 
   /* Check special cases and error conditions. */
   if ((1 << maxbits) < numsymbols) {
-    free(leaves);
+    ZopfliFree(leaves);
     return 1;  /* Error, too few maxbits to represent symbols. */
   }
   if (numsymbols == 0) {
-    free(leaves);
+    ZopfliFree(leaves);
     return 0;  /* No symbols at all. OK. */
   }
   if (numsymbols == 1) {
     bitlengths[leaves[0].count] = 1;
-    free(leaves);
+    ZopfliFree(leaves);
     return 0;  /* Only one symbol, give it bitlength 1, not 0. OK. */
   }
   if (numsymbols == 2) {
     bitlengths[leaves[0].count]++;
     bitlengths[leaves[1].count]++;
-    free(leaves);
+    ZopfliFree(leaves);
     return 0;
   }
 
@@ -242,7 +243,7 @@ int ZopfliLengthLimitedCodeLengths(
    for (i = 0; i < numsymbols; i++) {
      if (leaves[i].weight >=
          ((size_t)1 << (sizeof(leaves[0].weight) * CHAR_BIT - 9))) {
-       free(leaves);
+       ZopfliFree(leaves);
        return 1;  /* Error, we need 9 bits for the count. */
      }
      leaves[i].weight = (leaves[i].weight << 9) | leaves[i].count;
@@ -260,10 +261,10 @@ int ZopfliLengthLimitedCodeLengths(
   }
 
   /* Initialize node memory pool. */
-  nodes = (Node*)malloc(maxbits * 2 * numsymbols * sizeof(Node));
+  nodes = (Node*)ZopfliMalloc(maxbits * 2 * numsymbols * sizeof(Node));
   pool.next = nodes;
 
-  lists = (Node* (*)[2])malloc(maxbits * sizeof(*lists));
+  lists = (Node* (*)[2])ZopfliMalloc(maxbits * sizeof(*lists));
   InitLists(&pool, leaves, maxbits, lists);
 
   /* In the last list, 2 * numsymbols - 2 active chains need to be created. Two
@@ -276,8 +277,8 @@ int ZopfliLengthLimitedCodeLengths(
 
   ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
 
-  free(lists);
-  free(leaves);
-  free(nodes);
+  ZopfliFree(lists);
+  ZopfliFree(leaves);
+  ZopfliFree(nodes);
   return 0;  /* OK. */
 }
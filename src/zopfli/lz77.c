@@ -36,16 +36,20 @@ void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
   store->d_symbol = 0;
   store->ll_counts = 0;
   store->d_counts = 0;
+  store->hist_index1 = 0;
+  store->hist_index2 = 0;
 }
 
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
-  free(store->d_counts);
-  free(store->ll_counts);
-  free(store->d_symbol);
-  free(store->ll_symbol);
-  free(store->pos);
-  free(store->dists);
-  free(store->litlens);
+  ZopfliFree(store->hist_index2);
+  ZopfliFree(store->hist_index1);
+  ZopfliFree(store->d_counts);
+  ZopfliFree(store->ll_counts);
+  ZopfliFree(store->d_symbol);
+  ZopfliFree(store->ll_symbol);
+  ZopfliFree(store->pos);
+  ZopfliFree(store->dists);
+  ZopfliFree(store->litlens);
 }
 
 static size_t CeilDiv(size_t a, size_t b) {
@@ -59,15 +63,15 @@ void ZopfliCopyLZ77Store(
   ZopfliCleanLZ77Store(dest);
   ZopfliInitLZ77Store(source->data, dest);
   dest->litlens =
-      (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
-  dest->pos = (size_t*)malloc(sizeof(*dest->pos) * source->size);
+      (unsigned short*)ZopfliMalloc(sizeof(*dest->litlens) * source->size);
+  dest->dists = (unsigned short*)ZopfliMalloc(sizeof(*dest->dists) * source->size);
+  dest->pos = (size_t*)ZopfliMalloc(sizeof(*dest->pos) * source->size);
   dest->ll_symbol =
-      (unsigned short*)malloc(sizeof(*dest->ll_symbol) * source->size);
+      (unsigned short*)ZopfliMalloc(sizeof(*dest->ll_symbol) * source->size);
   dest->d_symbol =
-      (unsigned short*)malloc(sizeof(*dest->d_symbol) * source->size);
-  dest->ll_counts = (size_t*)malloc(sizeof(*dest->ll_counts) * llsize);
-  dest->d_counts = (size_t*)malloc(sizeof(*dest->d_counts) * dsize);
+      (unsigned short*)ZopfliMalloc(sizeof(*dest->d_symbol) * source->size);
+  dest->ll_counts = (size_t*)ZopfliMalloc(sizeof(*dest->ll_counts) * llsize);
+  dest->d_counts = (size_t*)ZopfliMalloc(sizeof(*dest->d_counts) * dsize);
 
   /* Allocation failed. */
   if (!dest->litlens || !dest->dists) exit(-1);
@@ -104,6 +108,9 @@ void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
   size_t llstart = ZOPFLI_NUM_LL * (origsize / ZOPFLI_NUM_LL);
   size_t dstart = ZOPFLI_NUM_D * (origsize / ZOPFLI_NUM_D);
 
+  /* The index only covers the symbols it was built for. */
+  if (store->hist_index1) ZopfliLZ77DropHistogramIndex(store);
+
   /* Everytime the index wraps around, a new cumulative histogram is made: we're
   keeping one histogram value per LZ77 symbol rather than a full histogram for
   each to save memory. */
@@ -183,11 +190,92 @@ static void ZopfliLZ77GetHistogramAt(const ZopfliLZ77Store* lz77, size_t lpos,
   }
 }
 
+#define ZOPFLI_HISTOGRAM_SIZE (ZOPFLI_NUM_LL + ZOPFLI_NUM_D)
+
+void ZopfliLZ77IndexHistograms(ZopfliLZ77Store* lz77) {
+  size_t n1 = lz77->size / ZOPFLI_HISTOGRAM_INDEX_STEP1 + 1;
+  size_t n2 = lz77->size / ZOPFLI_HISTOGRAM_INDEX_STEP2 + 1;
+  unsigned counts[ZOPFLI_HISTOGRAM_SIZE];
+  unsigned* base = counts;
+  size_t i, j;
+
+  if (lz77->hist_index1) return;
+  lz77->hist_index1 = (unsigned*)ZopfliMalloc(
+      sizeof(*lz77->hist_index1) * ZOPFLI_HISTOGRAM_SIZE * n1);
+  lz77->hist_index2 = (unsigned short*)ZopfliMalloc(
+      sizeof(*lz77->hist_index2) * ZOPFLI_HISTOGRAM_SIZE * n2);
+  if (!lz77->hist_index1 || !lz77->hist_index2) exit(-1);
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i <= lz77->size; i++) {
+    if (i % ZOPFLI_HISTOGRAM_INDEX_STEP1 == 0) {
+      base = lz77->hist_index1
+           + ZOPFLI_HISTOGRAM_SIZE * (i / ZOPFLI_HISTOGRAM_INDEX_STEP1);
+      memcpy(base, counts, sizeof(counts));
+    }
+    if (i % ZOPFLI_HISTOGRAM_INDEX_STEP2 == 0) {
+      unsigned short* rel = lz77->hist_index2
+           + ZOPFLI_HISTOGRAM_SIZE * (i / ZOPFLI_HISTOGRAM_INDEX_STEP2);
+      for (j = 0; j < ZOPFLI_HISTOGRAM_SIZE; j++) {
+        rel[j] = (unsigned short)(counts[j] - base[j]);
+      }
+    }
+    if (i == lz77->size) break;
+    counts[lz77->ll_symbol[i]]++;
+    if (lz77->dists[i] != 0) counts[ZOPFLI_NUM_LL + lz77->d_symbol[i]]++;
+  }
+}
+
+void ZopfliLZ77DropHistogramIndex(ZopfliLZ77Store* lz77) {
+  ZopfliFree(lz77->hist_index1);
+  ZopfliFree(lz77->hist_index2);
+  lz77->hist_index1 = 0;
+  lz77->hist_index2 = 0;
+}
+
+/*
+Adds (sign 1) or subtracts (sign -1) the histogram of all symbols before lpos
+using the histogram index.
+*/
+static void AddIndexedHistogram(const ZopfliLZ77Store* lz77, size_t lpos,
+                                int sign, size_t* ll_counts, size_t* d_counts) {
+  const unsigned* h1 = lz77->hist_index1
+      + ZOPFLI_HISTOGRAM_SIZE * (lpos / ZOPFLI_HISTOGRAM_INDEX_STEP1);
+  const unsigned short* h2 = lz77->hist_index2
+      + ZOPFLI_HISTOGRAM_SIZE * (lpos / ZOPFLI_HISTOGRAM_INDEX_STEP2);
+  size_t i;
+  /* Plain loops over both arrays, so the compiler can vectorize them. */
+  if (sign > 0) {
+    for (i = 0; i < ZOPFLI_NUM_LL; i++) ll_counts[i] += h1[i] + h2[i];
+    for (i = 0; i < ZOPFLI_NUM_D; i++) {
+      d_counts[i] += h1[ZOPFLI_NUM_LL + i] + h2[ZOPFLI_NUM_LL + i];
+    }
+    for (i = lpos - lpos % ZOPFLI_HISTOGRAM_INDEX_STEP2; i < lpos; i++) {
+      ll_counts[lz77->ll_symbol[i]]++;
+      if (lz77->dists[i] != 0) d_counts[lz77->d_symbol[i]]++;
+    }
+  } else {
+    for (i = 0; i < ZOPFLI_NUM_LL; i++) ll_counts[i] -= h1[i] + h2[i];
+    for (i = 0; i < ZOPFLI_NUM_D; i++) {
+      d_counts[i] -= h1[ZOPFLI_NUM_LL + i] + h2[ZOPFLI_NUM_LL + i];
+    }
+    for (i = lpos - lpos % ZOPFLI_HISTOGRAM_INDEX_STEP2; i < lpos; i++) {
+      ll_counts[lz77->ll_symbol[i]]--;
+      if (lz77->dists[i] != 0) d_counts[lz77->d_symbol[i]]--;
+    }
+  }
+}
+
 void ZopfliLZ77GetHistogram(const ZopfliLZ77Store* lz77,
                            size_t lstart, size_t lend,
                            size_t* ll_counts, size_t* d_counts) {
   size_t i;
-  if (lstart + ZOPFLI_NUM_LL * 3 > lend) {
+  if (lz77->hist_index1 && lstart + ZOPFLI_HISTOGRAM_INDEX_STEP2 * 2 <= lend) {
+    memset(ll_counts, 0, sizeof(*ll_counts) * ZOPFLI_NUM_LL);
+    memset(d_counts, 0, sizeof(*d_counts) * ZOPFLI_NUM_D);
+    AddIndexedHistogram(lz77, lend, 1, ll_counts, d_counts);
+    AddIndexedHistogram(lz77, lstart, -1, ll_counts, d_counts);
+  } else if (lstart + ZOPFLI_NUM_LL * 3 > lend) {
     memset(ll_counts, 0, sizeof(*ll_counts) * ZOPFLI_NUM_LL);
     memset(d_counts, 0, sizeof(*d_counts) * ZOPFLI_NUM_D);
     for (i = lstart; i < lend; i++) {
@@ -221,7 +309,7 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
   s->blockend = blockend;
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (add_lmc) {
-    s->lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
+    s->lmc = (ZopfliLongestMatchCache*)ZopfliMalloc(sizeof(ZopfliLongestMatchCache));
     ZopfliInitCache(blockend - blockstart, s->lmc);
   } else {
     s->lmc = 0;
@@ -229,11 +317,27 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
 #endif
 }
 
+void ZopfliInitBlockStateSlice(const ZopfliOptions* options,
+                               size_t blockstart, size_t blockend,
+                               ZopfliLongestMatchCache* lmc, size_t lmcstart,
+                               ZopfliBlockState* s) {
+  assert(blockstart >= lmcstart);
+  s->options = options;
+  s->blockstart = blockstart;
+  s->blockend = blockend;
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  s->lmc = (ZopfliLongestMatchCache*)ZopfliMalloc(sizeof(ZopfliLongestMatchCache));
+  ZopfliSliceCache(lmc, blockstart - lmcstart, s->lmc);
+#else
+  (void)lmc;
+#endif
+}
+
 void ZopfliCleanBlockState(ZopfliBlockState* s) {
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (s->lmc) {
     ZopfliCleanCache(s->lmc);
-    free(s->lmc);
+    ZopfliFree(s->lmc);
     s->lmc = 0;
   }
 #endif
@@ -429,17 +533,12 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
 #endif
   int hval = h->val;
 
-#ifdef ZOPFLI_LONGEST_MATCH_CACHE
-  if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
-    assert(pos + *length <= size);
-    return;
-  }
-#endif
-
   assert(limit <= ZOPFLI_MAX_MATCH);
   assert(limit >= ZOPFLI_MIN_MATCH);
   assert(pos < size);
 
+  /* Clamp before consulting the cache: a cache shared with other blocks may
+  hold lengths that run past the end of this one. */
   if (pos + limit > size) {
     limit = size - pos;
   }
@@ -452,6 +551,17 @@ void ZopfliFindLongestMatch(ZopfliBlockState* s, const ZopfliHash* h,
     return;
   }
 
+#ifdef ZOPFLI_LONGEST_MATCH_CACHE
+  if (TryGetFromLongestMatchCache(s, pos, &limit, sublen, distance, length)) {
+    assert(pos + *length <= size);
+    return;
+  }
+  /* The cache may have raised the limit to its stored length. */
+  if (pos + limit > size) {
+    limit = size - pos;
+  }
+#endif
+
   arrayend = &array[pos] + limit;
   arrayend_safe = arrayend - 8;
 
@@ -58,6 +58,14 @@ typedef struct ZopfliLZ77Store {
   looping through the actual symbols of this chunk. */
   size_t* ll_counts;
   size_t* d_counts;
+
+  /* Optional index of full lit/len and dist histograms of all symbols before
+  every ZOPFLI_HISTOGRAM_INDEX_STEP1 symbols, and relative to those before
+  every ZOPFLI_HISTOGRAM_INDEX_STEP2 symbols. Built by
+  ZopfliLZ77IndexHistograms only around the block splitter, which queries it,
+  dropped by ZopfliLZ77DropHistogramIndex or when a symbol is added. */
+  unsigned* hist_index1;
+  unsigned short* hist_index2;
 } ZopfliLZ77Store;
 
 void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store);
@@ -76,6 +84,14 @@ not add the one end symbol of value 256. */
 void ZopfliLZ77GetHistogram(const ZopfliLZ77Store* lz77,
                             size_t lstart, size_t lend,
                             size_t* ll_counts, size_t* d_counts);
+/* Builds the histogram index of a finished store, after which
+ZopfliLZ77GetHistogram needs to look at no more than a few dozen symbols for
+any range. Worth it for stores whose ranges are measured many times, like by the
+block splitter. Uses about 20 bytes per LZ77 symbol, so drop it as soon as
+those measurements are done. */
+void ZopfliLZ77IndexHistograms(ZopfliLZ77Store* lz77);
+/* Frees the histogram index, ZopfliLZ77GetHistogram works without it. */
+void ZopfliLZ77DropHistogramIndex(ZopfliLZ77Store* lz77);
 
 /*
 Some state information for compressing a block.
@@ -98,6 +114,16 @@ typedef struct ZopfliBlockState {
 void ZopfliInitBlockState(const ZopfliOptions* options,
                           size_t blockstart, size_t blockend, int add_lmc,
                           ZopfliBlockState* s);
+/*
+Like ZopfliInitBlockState with add_lmc, but instead of allocating a new cache
+the block uses a slice of lmc, a cache that begins at input position lmcstart
+and covers at least the whole block. Without ZOPFLI_LONGEST_MATCH_CACHE the
+block gets no cache.
+*/
+void ZopfliInitBlockStateSlice(const ZopfliOptions* options,
+                               size_t blockstart, size_t blockend,
+                               ZopfliLongestMatchCache* lmc, size_t lmcstart,
+                               ZopfliBlockState* s);
 void ZopfliCleanBlockState(ZopfliBlockState* s);
 
 /*
@@ -0,0 +1,502 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "defines.h"
+#include "serve.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+
+int ZopfliServe(const char* path, unsigned numworkers,
+                const volatile sig_atomic_t* finish,
+                ZopfliServeJob* job, void* context, int verbose) {
+  (void)path; (void)numworkers; (void)finish;
+  (void)job; (void)context; (void)verbose;
+  fprintf(stderr, "Error: --serve# needs Unix domain sockets.\n");
+  return 0;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "zopfli.h"
+#include "util.h"
+
+/*
+Size classes of the arena, powers of two from 64 bytes to 128MB. Bigger
+blocks come from the C library every time.
+*/
+#define ARENA_CLASSES 22
+#define ARENA_MIN 64
+#define ARENA_HEADER 16
+
+/*
+Memory of one worker and the threads its jobs start. Freed blocks go to a
+list of their size class instead of back to the C library, so the next job
+gets them without a system call. Every block starts with a header holding
+its size class and, above the largest class, its size.
+*/
+typedef struct ServeArena {
+  ZopfliAllocator allocator;
+  pthread_mutex_t lock;
+  void* freelist[ARENA_CLASSES];
+  size_t cached;
+} ServeArena;
+
+static size_t ArenaClassSize(size_t sizeclass) {
+  return (size_t)ARENA_MIN << sizeclass;
+}
+
+static void* ArenaAlloc(void* context, size_t size) {
+  ServeArena* arena = (ServeArena*)context;
+  size_t sizeclass = 0;
+  size_t* block;
+  while(sizeclass < ARENA_CLASSES && ArenaClassSize(sizeclass) < size) {
+    ++sizeclass;
+  }
+  if(sizeclass < ARENA_CLASSES) {
+    pthread_mutex_lock(&arena->lock);
+    block = (size_t*)arena->freelist[sizeclass];
+    if(block) {
+      arena->freelist[sizeclass] = *(void**)((unsigned char*)block + ARENA_HEADER);
+      arena->cached -= ArenaClassSize(sizeclass);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if(!block) block = (size_t*)malloc(ARENA_HEADER + ArenaClassSize(sizeclass));
+  } else {
+    block = (size_t*)malloc(ARENA_HEADER + size);
+  }
+  if(!block) return NULL;
+  block[0] = sizeclass;
+  block[1] = size;  /* The capacity of a block above the largest class. */
+  return (unsigned char*)block + ARENA_HEADER;
+}
+
+static void ArenaFree(void* context, void* ptr) {
+  ServeArena* arena = (ServeArena*)context;
+  size_t* block;
+  size_t sizeclass;
+  if(!ptr) return;
+  block = (size_t*)((unsigned char*)ptr - ARENA_HEADER);
+  sizeclass = block[0];
+  if(sizeclass < ARENA_CLASSES) {
+    pthread_mutex_lock(&arena->lock);
+    if(arena->cached + ArenaClassSize(sizeclass) <= ZOPFLI_SERVE_ARENA_CACHE) {
+      *(void**)ptr = arena->freelist[sizeclass];
+      arena->freelist[sizeclass] = block;
+      arena->cached += ArenaClassSize(sizeclass);
+      block = NULL;
+    }
+    pthread_mutex_unlock(&arena->lock);
+  }
+  free(block);
+}
+
+static void* ArenaRealloc(void* context, void* ptr, size_t size) {
+  size_t* block;
+  size_t capacity;
+  void* result;
+  if(!ptr) return ArenaAlloc(context, size);
+  block = (size_t*)((unsigned char*)ptr - ARENA_HEADER);
+  capacity = block[0] < ARENA_CLASSES ? ArenaClassSize(block[0]) : block[1];
+  /* Shrinking or growing within the capacity keeps the block. */
+  if(size <= capacity) return ptr;
+  result = ArenaAlloc(context, size);
+  if(!result) return NULL;
+  memcpy(result, ptr, capacity < size ? capacity : size);
+  ArenaFree(context, ptr);
+  return result;
+}
+
+static void ArenaInit(ServeArena* arena) {
+  size_t i;
+  arena->allocator.alloc = ArenaAlloc;
+  arena->allocator.realloc = ArenaRealloc;
+  arena->allocator.free = ArenaFree;
+  arena->allocator.context = arena;
+  pthread_mutex_init(&arena->lock, NULL);
+  for(i = 0; i < ARENA_CLASSES; ++i) arena->freelist[i] = NULL;
+  arena->cached = 0;
+}
+
+static void ArenaCleanup(ServeArena* arena) {
+  size_t i;
+  for(i = 0; i < ARENA_CLASSES; ++i) {
+    while(arena->freelist[i]) {
+      void* block = arena->freelist[i];
+      arena->freelist[i] = *(void**)((unsigned char*)block + ARENA_HEADER);
+      free(block);
+    }
+  }
+  pthread_mutex_destroy(&arena->lock);
+}
+
+/*
+A job waiting for a worker, or a connection whose job line is still coming
+in, with the connection its reply goes to.
+*/
+typedef struct ServeQueued {
+  int fd;
+  unsigned long number;
+  long priority;
+  int argc;
+  char** argv;
+  char* line;
+  size_t size;  /* Bytes of the line read so far. */
+  time_t accepted;
+  struct ServeQueued* next;
+} ServeQueued;
+
+typedef struct ServeState {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  /* Jobs by descending priority, those of the same one in arrival order. */
+  ServeQueued* queue;
+
+  int stop;
+
+  ZopfliServeJob* job;
+  void* context;
+  int verbose;
+} ServeState;
+
+/* Sends the reply line and closes the connection. */
+static void ServeReply(int fd, const char* reply) {
+  size_t size = strlen(reply), sent = 0;
+  while(sent < size) {
+    ssize_t n = write(fd, reply + sent, size - sent);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) break;
+    sent += (size_t)n;
+  }
+  if(sent == size) {
+    while(write(fd, "\n", 1) < 0 && errno == EINTR) continue;
+  }
+  close(fd);
+}
+
+static void FreeQueued(ServeQueued* queued) {
+  free(queued->argv);
+  free(queued->line);
+  free(queued);
+}
+
+static void* ServeWorker(void* arg) {
+  ServeState* state = (ServeState*)arg;
+  ServeArena arena;
+  char reply[ZOPFLI_SERVE_LINE];
+  ArenaInit(&arena);
+  ZopfliSetAllocator(&arena.allocator);
+  for(;;) {
+    ServeQueued* queued;
+    int ok;
+    pthread_mutex_lock(&state->lock);
+    while(!state->stop && state->queue == NULL) {
+      pthread_cond_wait(&state->wake, &state->lock);
+    }
+    if(state->stop) {
+      pthread_mutex_unlock(&state->lock);
+      break;
+    }
+    queued = state->queue;
+    state->queue = queued->next;
+    pthread_mutex_unlock(&state->lock);
+
+    strcpy(reply, "ERROR");
+    ok = state->job(state->context, queued->argc, queued->argv,
+                    reply, sizeof(reply));
+    if(state->verbose) {
+      fprintf(stderr, "Job %lu %s: %s\n", queued->number,
+              ok ? "done" : "failed", reply);
+    }
+    ServeReply(queued->fd, reply);
+    FreeQueued(queued);
+  }
+  ZopfliSetAllocator(NULL);
+  ArenaCleanup(&arena);
+  return NULL;
+}
+
+/*
+Reads what has arrived of the job line of a connection, without waiting for
+more. Returns 1 once the line is complete, 0 if more has to come, -1 if it's
+too long or the connection failed.
+*/
+static int ReadJobLine(ServeQueued* queued) {
+  for(;;) {
+    ssize_t n;
+    char* newline;
+    if(queued->size == ZOPFLI_SERVE_LINE) return -1;
+    n = read(queued->fd, queued->line + queued->size,
+             ZOPFLI_SERVE_LINE - queued->size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if(n == 0) break;
+    newline = (char*)memchr(queued->line + queued->size, '\n', (size_t)n);
+    queued->size += (size_t)n;
+    if(newline) {
+      queued->size = (size_t)(newline - queued->line);
+      break;
+    }
+  }
+  queued->line[queued->size] = '\0';
+  return 1;
+}
+
+/*
+Splits the line into args at blanks and takes --pri# out of them. Returns 0
+if there's nothing left to run.
+*/
+static int ParseJobLine(ServeQueued* queued) {
+  char* token;
+  size_t count = 0;
+  char* p;
+  for(p = queued->line; *p; ++p) if(strchr(" \t\r", *p)) ++count;
+  queued->argv = (char**)malloc((count + 2) * sizeof(char*));
+  if(!queued->argv) exit(-1); /* Allocation failed. */
+  queued->argc = 0;
+  queued->priority = 0;
+  for(token = strtok(queued->line, " \t\r"); token;
+      token = strtok(NULL, " \t\r")) {
+    if(strncmp(token, "--pri", 5) == 0) {
+      queued->priority = strtol(token + 5, NULL, 10);
+    } else {
+      queued->argv[queued->argc++] = token;
+    }
+  }
+  queued->argv[queued->argc] = NULL;
+  return queued->argc > 0;
+}
+
+static void Enqueue(ServeState* state, ServeQueued* queued) {
+  ServeQueued** at;
+  pthread_mutex_lock(&state->lock);
+  at = &state->queue;
+  while(*at && (*at)->priority >= queued->priority) at = &(*at)->next;
+  queued->next = *at;
+  *at = queued;
+  pthread_cond_signal(&state->wake);
+  pthread_mutex_unlock(&state->lock);
+}
+
+/*
+Accepts a connection and adds it to those whose job lines are being read. Its
+socket doesn't block, so a client that is slow to send can't hold up others.
+*/
+static void Accept(int listener, unsigned long number, ServeQueued** reading) {
+  ServeQueued* queued;
+  int fd = accept(listener, NULL, NULL);
+  if(fd < 0) return;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  queued = (ServeQueued*)malloc(sizeof(*queued));
+  if(!queued) exit(-1); /* Allocation failed. */
+  queued->line = (char*)malloc(ZOPFLI_SERVE_LINE + 1);
+  if(!queued->line) exit(-1); /* Allocation failed. */
+  queued->argv = NULL;
+  queued->fd = fd;
+  queued->number = number;
+  queued->size = 0;
+  queued->accepted = time(NULL);
+  queued->next = *reading;
+  *reading = queued;
+}
+
+/*
+Queues the job of a connection that is done sending, result is what
+ReadJobLine returned last, or refuses it.
+*/
+static void Received(ServeState* state, ServeQueued* queued, int result) {
+  /* The reply is written in one go by a worker. */
+  fcntl(queued->fd, F_SETFL, fcntl(queued->fd, F_GETFL) & ~O_NONBLOCK);
+  if(result < 0) {
+    ServeReply(queued->fd, "ERROR job line too long or incomplete");
+    FreeQueued(queued);
+    return;
+  }
+  if(state->verbose) {
+    fprintf(stderr, "Job %lu queued: %s\n", queued->number, queued->line);
+  }
+  if(!ParseJobLine(queued)) {
+    ServeReply(queued->fd, "ERROR empty job");
+    FreeQueued(queued);
+    return;
+  }
+  Enqueue(state, queued);
+}
+
+/*
+Binds the socket, unless a daemon listens on it already. A socket left behind
+by one that was killed is replaced. Jobs read and write files as the user of
+the daemon, so only that user may connect.
+*/
+static int Listen(const char* path) {
+  struct sockaddr_un address;
+  struct stat st;
+  mode_t mask;
+  int fd;
+  if(strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: socket path %s is too long.\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) {
+    fprintf(stderr, "Error: can't create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+    fprintf(stderr, "Error: another daemon listens on %s.\n", path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if(lstat(path, &st) == 0) {
+    if(!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Error: %s exists and is no socket.\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mask = umask(0077);
+  if(fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+     || listen(fd, 64) != 0) {
+    umask(mask);
+    fprintf(stderr, "Error: can't listen on %s: %s\n", path, strerror(errno));
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  umask(mask);
+  return fd;
+}
+
+int ZopfliServe(const char* path, unsigned numworkers,
+                const volatile sig_atomic_t* finish,
+                ZopfliServeJob* job, void* context, int verbose) {
+  ServeState state;
+  pthread_t* workers;
+  /* Connections whose job lines are still coming in, newest first. */
+  ServeQueued* reading = NULL;
+  struct pollfd* ready = NULL;
+  size_t readysize = 0;
+  unsigned long number = 0;
+  unsigned i;
+  int listener = Listen(path);
+  if(listener < 0) return 0;
+  if(numworkers < 1) numworkers = 1;
+
+  /* A client that leaves before its reply must not end the daemon. */
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.wake, NULL);
+  state.queue = NULL;
+  state.stop = 0;
+  state.job = job;
+  state.context = context;
+  state.verbose = verbose;
+  workers = (pthread_t*)malloc(numworkers * sizeof(*workers));
+  if(!workers) exit(-1); /* Allocation failed. */
+  for(i = 0; i < numworkers; ++i) {
+    pthread_create(&workers[i], NULL, ServeWorker, (void*)&state);
+  }
+  if(verbose) {
+    fprintf(stderr, "Serving on %s with %u worker(s).\n", path, numworkers);
+  }
+
+  while(!*finish) {
+    ServeQueued** at;
+    ServeQueued* queued;
+    size_t count = 1, k;
+    time_t now;
+    for(queued = reading; queued; queued = queued->next) ++count;
+    if(count > readysize) {
+      readysize = count * 2;
+      ready = (struct pollfd*)realloc(ready, readysize * sizeof(*ready));
+      if(!ready) exit(-1); /* Allocation failed. */
+    }
+    ready[0].fd = listener;
+    for(queued = reading, k = 1; queued; queued = queued->next, ++k) {
+      ready[k].fd = queued->fd;
+    }
+    for(k = 0; k < count; ++k) {
+      ready[k].events = POLLIN;
+      ready[k].revents = 0;
+    }
+    /* Wakes up every second to see if it's time to stop. */
+    if(poll(ready, count, 1000) < 0 || *finish) continue;
+
+    /* Those that are done sending or took too long leave the list. */
+    now = time(NULL);
+    for(at = &reading, k = 1; *at; ++k) {
+      int result = 0;
+      queued = *at;
+      if(ready[k].revents) result = ReadJobLine(queued);
+      if(result == 0 && now - queued->accepted >= ZOPFLI_SERVE_TIMEOUT) {
+        result = -1;
+      }
+      if(result != 0) {
+        *at = queued->next;
+        Received(&state, queued, result);
+      } else {
+        at = &queued->next;
+      }
+    }
+    if(ready[0].revents & POLLIN) Accept(listener, ++number, &reading);
+  }
+
+  close(listener);
+  unlink(path);
+  pthread_mutex_lock(&state.lock);
+  state.stop = 1;
+  pthread_cond_broadcast(&state.wake);
+  pthread_mutex_unlock(&state.lock);
+  for(i = 0; i < numworkers; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+  while(state.queue) {
+    ServeQueued* queued = state.queue;
+    state.queue = queued->next;
+    ServeReply(queued->fd, "ERROR daemon stopped");
+    FreeQueued(queued);
+  }
+  while(reading) {
+    ServeQueued* queued = reading;
+    reading = queued->next;
+    ServeReply(queued->fd, "ERROR daemon stopped");
+    FreeQueued(queued);
+  }
+  free(ready);
+  pthread_cond_destroy(&state.wake);
+  pthread_mutex_destroy(&state.lock);
+  return 1;
+}
+
+#endif
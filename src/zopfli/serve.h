@@ -0,0 +1,60 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Compression daemon of the zopfli binary (--serve#). It listens on a Unix
+domain socket for jobs, one line per connection made of the same switches and
+file names as the command line, and runs them by priority on threads that
+stay alive between jobs. Every thread keeps the memory its jobs freed for the
+next one, the databases of --statsdb and --parsedb stay mapped.
+*/
+
+#ifndef ZOPFLI_SERVE_H_
+#define ZOPFLI_SERVE_H_
+
+#include <signal.h>
+#include <stddef.h>
+
+/* Socket of --serve without a name, in the current directory. */
+#define ZOPFLI_SERVE_SOCKET "ZopfliServe.sock"
+
+/* Longest job line, in bytes. */
+#define ZOPFLI_SERVE_LINE 4096
+
+/* Seconds a client may take to send its job line. */
+#define ZOPFLI_SERVE_TIMEOUT 10
+
+/* Bytes of freed memory every thread keeps for the next job at most. */
+#define ZOPFLI_SERVE_ARENA_CACHE 268435456
+
+/*
+Runs the job given by the args of its line, without --pri#, and writes the
+line the client gets back, without the newline, to reply. Returns 1 on
+success, 0 on failure.
+*/
+typedef int ZopfliServeJob(void* context, int argc, char** argv,
+                           char* reply, size_t replysize);
+
+/*
+Listens on the socket at path and runs jobs, numworkers at once, until finish
+is set. Jobs still queued then are refused. Returns 1 after a clean stop, 0 if
+the socket couldn't be set up or another daemon listens on it.
+*/
+int ZopfliServe(const char* path, unsigned numworkers,
+                const volatile sig_atomic_t* finish,
+                ZopfliServeJob* job, void* context, int verbose);
+
+#endif  /* ZOPFLI_SERVE_H_ */
@@ -24,8 +24,8 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
-#include "inthandler.h"
 #include "blocksplitter.h"
 #include "deflate.h"
 #include "symbols.h"
@@ -34,11 +34,11 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 /* Sets everything to 0. */
 void InitStats(SymbolStats* stats) {
-  stats->litlens = calloc(ZOPFLI_NUM_LL, sizeof(*stats->litlens));
-  stats->dists = calloc(ZOPFLI_NUM_D, sizeof(*stats->dists));
+  stats->litlens = ZopfliCalloc(ZOPFLI_NUM_LL, sizeof(*stats->litlens));
+  stats->dists = ZopfliCalloc(ZOPFLI_NUM_D, sizeof(*stats->dists));
 
-  stats->ll_symbols = calloc(ZOPFLI_NUM_LL, sizeof(*stats->ll_symbols));
-  stats->d_symbols = calloc(ZOPFLI_NUM_D, sizeof(*stats->d_symbols));
+  stats->ll_symbols = ZopfliCalloc(ZOPFLI_NUM_LL, sizeof(*stats->ll_symbols));
+  stats->d_symbols = ZopfliCalloc(ZOPFLI_NUM_D, sizeof(*stats->d_symbols));
 }
 
 void CopyStats(SymbolStats* source, SymbolStats* dest) {
@@ -54,10 +54,10 @@ void CopyStats(SymbolStats* source, SymbolStats* dest) {
 }
 
 void FreeStats(SymbolStats* stats) {
-  free(stats->litlens);
-  free(stats->dists);
-  free(stats->ll_symbols);
-  free(stats->d_symbols);
+  ZopfliFree(stats->litlens);
+  ZopfliFree(stats->dists);
+  ZopfliFree(stats->ll_symbols);
+  ZopfliFree(stats->d_symbols);
 }
 
 /* Adds the bit lengths. */
@@ -78,7 +78,7 @@ static void AddWeighedStatFreqs(const SymbolStats* stats1, zfloat w1,
 
 typedef struct RanState {
   unsigned int m_w, m_z;
-  uint32_t Q[4096], c;
+  uint32_t Q[4096], c, i;
   int cmwc;
   int ranmod;
 } RanState;
@@ -97,6 +97,7 @@ static void InitRanState(RanState* state, unsigned long m_wz, int cmwc, int ranm
       state->Q[i] = state->Q[i - 3] ^ state->Q[i - 2] ^ phi ^ i;
 
     state->c = 362436;
+    state->i = 4095;
   }
   state->m_w = (m_wz >> 16);
   state->m_z = (m_wz & 65535);
@@ -114,9 +115,8 @@ with --rw and --rz switches.
 static unsigned int Ran(RanState* state) {
   if(state->cmwc) {
     uint64_t t, a=(uint64_t)18782;
-    static uint32_t i=4095;
     uint32_t x,r=0xfffffffe;
-    i=(i+1)&4095;
+    uint32_t i=state->i=(state->i+1)&4095;
     t=a*state->Q[i]+state->c;
     state->c=(t>>32);
     x=t+state->c;
@@ -468,6 +468,32 @@ static void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats) {
   CalculateStatistics(stats);
 }
 
+void BlendStats(SymbolStats** sources, const zfloat* weights, size_t n,
+                SymbolStats* result) {
+  size_t i, j;
+  for (i = 0; i < ZOPFLI_NUM_LL; i++) {
+    zfloat sum = 0;
+    for (j = 0; j < n; j++) sum += sources[j]->litlens[i] * weights[j];
+    result->litlens[i] = (size_t)(sum + 0.5);
+  }
+  for (i = 0; i < ZOPFLI_NUM_D; i++) {
+    zfloat sum = 0;
+    for (j = 0; j < n; j++) sum += sources[j]->dists[i] * weights[j];
+    result->dists[i] = (size_t)(sum + 0.5);
+  }
+  result->litlens[256] = 1;  /* End symbol. */
+
+  CalculateStatistics(result);
+}
+
+void RangeStats(const ZopfliLZ77Store* store, size_t lstart, size_t lend,
+                SymbolStats* stats) {
+  ZopfliLZ77GetHistogram(store, lstart, lend, stats->litlens, stats->dists);
+  stats->litlens[256] = 1;  /* End symbol. */
+
+  CalculateStatistics(stats);
+}
+
 /*
 Does a single run for ZopfliLZ77Optimal. For good compression, repeated runs
 with updated statistics should be performed.
@@ -495,7 +521,7 @@ static void LZ77OptimalRun(ZopfliBlockState* s,
 #endif
   GetBestLengths(
       s, in, instart, inend, costmodel, costcontext, length_array, h, costs);
-  free(*path);
+  ZopfliFree(*path);
   *path = 0;
   *pathsize = 0;
   TraceBackwards(inend - instart, length_array, path, pathsize);
@@ -515,7 +541,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
   unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+      (unsigned short*)ZopfliMalloc(sizeof(unsigned short) * (blocksize + 1));
   unsigned short* path = 0;
   size_t pathsize = 0;
   ZopfliLZ77Store currentstore;
@@ -524,7 +550,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   unsigned int fails = 0, lastrandomstep = 0;
   int rui = 0;
   zfloat cost;
-  zfloat *costs = (zfloat*)malloc(sizeof(zfloat) * (blocksize + 1));
+  zfloat *costs = (zfloat*)ZopfliMalloc(sizeof(zfloat) * (blocksize + 1));
   zfloat bestcost = ZOPFLI_LARGE_FLOAT;
   zfloat lastcost = 0;
   zfloat statsimp = (zfloat)s->options->statimportance/(zfloat)100;
@@ -533,6 +559,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   RanState ran_state;
   ZopfliHash hash;
   ZopfliHash* h = &hash;
+  time_t lastcheckpoint = time(NULL);
 
   if (!length_array) exit(-1); /* Allocation failed. */
   if (!costs) exit(-1); /* Allocation failed. */
@@ -566,7 +593,9 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
 
   if(foundbest!=NULL && *foundbest!=NULL) {
     CopyStats(*foundbest, &stats);
-    if(s->options->numthreads == 0 && s->options->verbose>2)
+    /* Seeds like the greedy run of the block splitter start at iteration 0,
+    only stats of an earlier run of the same block come with iterations. */
+    if(i > 0 && s->options->numthreads == 0 && s->options->verbose>2)
       fprintf(stderr,"Already processed, reusing best . . .\n");
   } else {
     /* Initial run. */
@@ -583,6 +612,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
                    length_array, GetCostStat, (void*)&stats,
                    &currentstore, h, costs);
     cost = ZopfliCalculateBlockSize(s->options, &currentstore, 0, currentstore.size, 2);
+    if(i == *startiteration) iterations->firstcost = (int)cost;
     if(s->options->numthreads) {
       iterations->iteration = i;
       iterations->cost = (int)cost;
@@ -590,10 +620,12 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
       fprintf(stderr, "Iteration %d: %d bit      \r", i, (int) cost);
     }
     if (cost < bestcost) {
-      if(s->options->numthreads) {
-        iterations->bestiteration = i;
-        iterations->bestcost = (int)cost;
-      } else if(!s->options->numthreads && s->options->verbose>3) {
+      iterations->bestiteration = i;
+      iterations->bestcost = (int)cost;
+      ZopfliReportProgress(s->options, ZOPFLI_PROGRESS_ITERATION,
+                           instart, inend, iterations->block, 0, 0, (int)i,
+                           (double)cost);
+      if(!s->options->numthreads && s->options->verbose>3) {
         fprintf(stderr, "\n");
       }
       /* Start: Copy to the output store. */
@@ -606,7 +638,8 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     } else {
       ++fails;
     }
-    if(mui && fails > mui) break;
+    if(ZopfliMaxFailIterations(s->options)
+       && fails > ZopfliMaxFailIterations(s->options)) break;
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
     GetStatistics(&currentstore, &stats);
@@ -625,6 +658,15 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     }
     lastcost = cost;
     ++i;
+    if(iterations->checkpoint != NULL
+       && time(NULL) - lastcheckpoint >= ZOPFLI_CHECKPOINT_SECONDS) {
+      /* Measured like the cost stored once the block is done, so the two
+      compare. */
+      (*iterations->checkpoint)(iterations->checkpointcontext, &beststats, i,
+          ZopfliCalculateBlockSizeAutoType(s->options, store, 0, store->size, 0));
+      lastcheckpoint = time(NULL);
+    }
+    if(ZopfliDeadlineReached(s->options->deadline)) break;
   }
 
   *startiteration = i;
@@ -637,16 +679,16 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
      stats found. */
   if(foundbest!=NULL) {
     if(*foundbest==NULL) {
-      *foundbest = malloc(sizeof(**foundbest));
+      *foundbest = ZopfliMalloc(sizeof(**foundbest));
       InitStats(*foundbest);
     }
     CopyStats(&beststats, *foundbest);
   }
 
 
-  free(path);
-  free(costs);
-  free(length_array);
+  ZopfliFree(path);
+  ZopfliFree(costs);
+  ZopfliFree(length_array);
   ZopfliCleanHash(h);
   ZopfliCleanLZ77Store(&currentstore);
   FreeStats(&stats);
@@ -662,10 +704,10 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
   unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+      (unsigned short*)ZopfliMalloc(sizeof(unsigned short) * (blocksize + 1));
   unsigned short* path = 0;
   size_t pathsize = 0;
-  zfloat *costs = (zfloat*)malloc(sizeof(zfloat) * (blocksize + 1));
+  zfloat *costs = (zfloat*)ZopfliMalloc(sizeof(zfloat) * (blocksize + 1));
   ZopfliHash hash;
   ZopfliHash* h = &hash;
   ZopfliMallocHash(ZOPFLI_WINDOW_SIZE, h);
@@ -682,7 +724,7 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
                  length_array, GetCostFixed, 0, store, h, costs);
 
   ZopfliCleanHash(h);
-  free(path);
-  free(costs);
-  free(length_array);
+  ZopfliFree(path);
+  ZopfliFree(costs);
+  ZopfliFree(length_array);
 }
@@ -58,6 +58,20 @@ typedef struct ZopfliIterations {
 
   int bestcost;
 
+  /* Cost of the first iteration of the last ZopfliLZ77Optimal call. */
+  int firstcost;
+
+  /*
+  If not NULL, ZopfliLZ77Optimal calls this every ZOPFLI_CHECKPOINT_SECONDS
+  with the best stats so far, the amount of iterations done and the cost of
+  the best one by ZopfliCalculateBlockSizeAutoType, so an interrupted block
+  can resume from there (--resume).
+  */
+  void (*checkpoint)(void* context, SymbolStats* beststats,
+                     unsigned int iteration, zfloat bestcost);
+
+  void* checkpointcontext;
+
 } ZopfliIterations;
 
 void InitStats(SymbolStats* stats);
@@ -66,6 +80,20 @@ void CopyStats(SymbolStats* source, SymbolStats* dest);
 
 void FreeStats(SymbolStats* stats);
 
+/*
+Sets the symbol counts of result to the sum of those of the n sources, each
+multiplied by its weight, and calculates the symbol lengths from them.
+*/
+void BlendStats(SymbolStats** sources, const zfloat* weights, size_t n,
+                SymbolStats* result);
+
+/*
+Sets stats to the statistics of the LZ77 symbols store[lstart, lend), as if
+the initial greedy run of ZopfliLZ77Optimal had produced them.
+*/
+void RangeStats(const ZopfliLZ77Store* store, size_t lstart, size_t lend,
+                SymbolStats* stats);
+
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
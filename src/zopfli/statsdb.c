@@ -0,0 +1,941 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "defines.h"
+#include "statsdb.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "util.h"
+
+/*
+Amount of hash index buckets of a newly created database. Each takes a
+size_t in the file, so a few MB that stay sparse on most file systems until
+used, and chains stay short up to millions of records.
+*/
+#define ZOPFLI_STATSDB_BUCKETS 1048576
+
+/* Version of the file layout below. */
+#define ZOPFLI_STATSDB_FORMAT 2
+
+/*
+The file starts with this header, followed by the buckets: offsets of the
+last added record of each hash chain, 0 if empty. Records start at the next
+multiple of 64 bytes and are only appended, at the offset end. An update of a
+block is a new record put in front of the old one in its chain, the offset in
+the bucket is what makes it visible, like a rename over the old file would.
+*/
+typedef struct StatsDBHeader {
+  char magic[8];
+  unsigned char format;
+  unsigned char statsver;  /* BESTSTATSDBVER of the stored stats. */
+  unsigned char zfloatsize;
+  unsigned char sizetsize;
+  size_t nbuckets;
+  size_t end;
+  size_t count;
+} StatsDBHeader;
+
+/*
+Symbol counts are stored as unsigned, they never get near 4G within one
+master block.
+*/
+typedef struct StatsDBRecord {
+  size_t next;  /* Previous record in the same hash chain, 0 if none. */
+  size_t blocksize;
+  unsigned blockcrc;
+  unsigned mode;
+  unsigned startiteration;
+  unsigned litlens[ZOPFLI_NUM_LL];
+  unsigned dists[ZOPFLI_NUM_D];
+  zfloat cost;
+  zfloat ll_symbols[ZOPFLI_NUM_LL];
+  zfloat d_symbols[ZOPFLI_NUM_D];
+} StatsDBRecord;
+
+/*
+Record of the parse database, followed by nbytes of encoded LZ77 symbols and
+padding up to a multiple of sizeof(ParseDBRecord). Every symbol is its length,
+1 for a literal, as a varint (7 bits per byte, low bits first) and for
+lengths above 1 the distance the same way. Literals are taken from the input.
+*/
+typedef struct ParseDBRecord {
+  size_t next;
+  size_t blocksize;
+  size_t nbytes;
+  unsigned blockcrc;
+  unsigned windowcrc;
+  unsigned mode;
+  unsigned iterations;
+  zfloat cost;
+} ParseDBRecord;
+
+/*
+Record of the split database, followed by npoints split points relative to
+the start of the master block and padding up to a multiple of
+sizeof(SplitDBRecord).
+*/
+typedef struct SplitDBRecord {
+  size_t next;
+  size_t blocksize;
+  size_t npoints;
+  unsigned blockcrc;
+  unsigned optionscrc;
+  unsigned pass;
+  unsigned done;
+  zfloat cost;
+} SplitDBRecord;
+
+/*
+Bands of the signature, every band is two values and has its own part of
+the buckets. Blocks that share all values of at least one band are found.
+*/
+#define ZOPFLI_SIMDB_BANDS (ZOPFLI_SIGNATURE_SIZE / 2)
+
+/* Longest part of a hash chain looked at for similar blocks. */
+#define ZOPFLI_SIMDB_MAXCHAIN 256
+
+/*
+Record of the similarity index, linked into one chain per band. It only
+points to the block in the stats database.
+*/
+typedef struct SimDBRecord {
+  size_t next[ZOPFLI_SIMDB_BANDS];
+  size_t blocksize;
+  unsigned blockcrc;
+  unsigned mode;
+  unsigned signature[ZOPFLI_SIGNATURE_SIZE];
+} SimDBRecord;
+
+/* One memory mapped database file and the state of its use. */
+typedef struct DBFile {
+  const char* name;
+  char magic[8];
+  pthread_mutex_t mutex;
+  /* 0: not opened yet, 1: open, -1: can't be used. */
+  int state;
+  unsigned char* map;
+  size_t mapsize;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+} DBFile;
+
+#ifdef _WIN32
+static DBFile statsfile = {ZOPFLI_STATSDB_FILE, "ZopfliDB",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, INVALID_HANDLE_VALUE, 0};
+static DBFile parsefile = {ZOPFLI_PARSEDB_FILE, "ZopfliLZ",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, INVALID_HANDLE_VALUE, 0};
+static DBFile splitfile = {ZOPFLI_SPLITDB_FILE, "ZopfliSP",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, INVALID_HANDLE_VALUE, 0};
+static DBFile simfile = {ZOPFLI_SIMDB_FILE, "ZopfliSG",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, INVALID_HANDLE_VALUE, 0};
+#else
+static DBFile statsfile = {ZOPFLI_STATSDB_FILE, "ZopfliDB",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, -1};
+static DBFile parsefile = {ZOPFLI_PARSEDB_FILE, "ZopfliLZ",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, -1};
+static DBFile splitfile = {ZOPFLI_SPLITDB_FILE, "ZopfliSP",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, -1};
+static DBFile simfile = {ZOPFLI_SIMDB_FILE, "ZopfliSG",
+    PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, -1};
+#endif
+static pthread_mutex_t atexitmutex = PTHREAD_MUTEX_INITIALIZER;
+static int dbatexit = 0;
+
+static size_t RecordsStart(size_t nbuckets) {
+  size_t start = sizeof(StatsDBHeader) + nbuckets * sizeof(size_t);
+  return (start + 63) & ~(size_t)63;
+}
+
+static void UnmapDB(DBFile* db) {
+  if (!db->map) return;
+#ifdef _WIN32
+  UnmapViewOfFile(db->map);
+  CloseHandle(db->mapping);
+  db->mapping = 0;
+#else
+  munmap(db->map, db->mapsize);
+#endif
+  db->map = 0;
+  db->mapsize = 0;
+}
+
+/* Maps the first size bytes of the file, extending it when shorter. */
+static int MapDB(DBFile* db, size_t size) {
+  UnmapDB(db);
+#ifdef _WIN32
+  db->mapping = CreateFileMapping(db->file, NULL, PAGE_READWRITE,
+                                  (DWORD)(size >> 16 >> 16),
+                                  (DWORD)size, NULL);
+  if (!db->mapping) return 0;
+  db->map = (unsigned char*)MapViewOfFile(db->mapping, FILE_MAP_WRITE,
+                                          0, 0, size);
+  if (!db->map) {
+    CloseHandle(db->mapping);
+    db->mapping = 0;
+    return 0;
+  }
+#else
+  {
+    struct stat st;
+    void* map;
+    if (fstat(db->fd, &st) != 0) return 0;
+    if ((size_t)st.st_size < size && ftruncate(db->fd, size) != 0) return 0;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (map == MAP_FAILED) return 0;
+    db->map = (unsigned char*)map;
+  }
+#endif
+  db->mapsize = size;
+  return 1;
+}
+
+static int FileSize(DBFile* db, size_t* size) {
+#ifdef _WIN32
+  LARGE_INTEGER li;
+  if (!GetFileSizeEx(db->file, &li)) return 0;
+  *size = (size_t)li.QuadPart;
+#else
+  struct stat st;
+  if (fstat(db->fd, &st) != 0) return 0;
+  *size = (size_t)st.st_size;
+#endif
+  return 1;
+}
+
+/*
+Takes the advisory lock on the whole file, shared for lookups and exclusive
+for updates, waiting for other processes as long as needed. Within the
+process the mutex of the file is what keeps threads apart.
+*/
+static int LockDB(DBFile* db, int exclusive) {
+#ifdef _WIN32
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  return LockFileEx(db->file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0,
+                    MAXDWORD, MAXDWORD, &ov) != 0;
+#else
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(db->fd, F_SETLKW, &fl) == -1) {
+    if (errno != EINTR) return 0;
+  }
+  return 1;
+#endif
+}
+
+static void UnlockDB(DBFile* db) {
+#ifdef _WIN32
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  UnlockFileEx(db->file, 0, MAXDWORD, MAXDWORD, &ov);
+#else
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fcntl(db->fd, F_SETLK, &fl);
+#endif
+}
+
+static StatsDBHeader* Header(DBFile* db) {
+  return (StatsDBHeader*)db->map;
+}
+
+static size_t* Buckets(DBFile* db) {
+  return (size_t*)(db->map + sizeof(StatsDBHeader));
+}
+
+static void CloseDB(DBFile* db) {
+  pthread_mutex_lock(&db->mutex);
+  UnmapDB(db);
+#ifdef _WIN32
+  if (db->file != INVALID_HANDLE_VALUE) CloseHandle(db->file);
+  db->file = INVALID_HANDLE_VALUE;
+#else
+  if (db->fd != -1) close(db->fd);
+  db->fd = -1;
+#endif
+  db->state = 0;
+  pthread_mutex_unlock(&db->mutex);
+}
+
+void ZopfliStatsDBClose(void) {
+  CloseDB(&statsfile);
+  CloseDB(&parsefile);
+  CloseDB(&splitfile);
+  CloseDB(&simfile);
+}
+
+/* Opens or creates the database file, must be called with its mutex held. */
+static int OpenDB(DBFile* db) {
+  size_t filesize;
+  StatsDBHeader* h;
+  int ok;
+  if (db->state != 0) return db->state == 1;
+  db->state = -1;
+#ifdef _WIN32
+  db->file = CreateFile(db->name, GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+  if (db->file == INVALID_HANDLE_VALUE) return 0;
+#else
+  db->fd = open(db->name, O_RDWR | O_CREAT, 0666);
+  if (db->fd == -1) return 0;
+#endif
+
+  /* Another process may be creating the file at the same time. */
+  if (!LockDB(db, 1)) return 0;
+  ok = FileSize(db, &filesize);
+  if (ok && filesize == 0) {
+    ok = MapDB(db, RecordsStart(ZOPFLI_STATSDB_BUCKETS));
+    if (ok) {
+      h = Header(db);
+      memcpy(h->magic, db->magic, sizeof(h->magic));
+      h->format = ZOPFLI_STATSDB_FORMAT;
+      h->statsver = BESTSTATSDBVER;
+      h->zfloatsize = sizeof(zfloat);
+      h->sizetsize = sizeof(size_t);
+      h->nbuckets = ZOPFLI_STATSDB_BUCKETS;
+      h->end = RecordsStart(ZOPFLI_STATSDB_BUCKETS);
+      h->count = 0;
+    }
+  } else if (ok) {
+    ok = filesize >= sizeof(StatsDBHeader) && MapDB(db, filesize);
+    h = Header(db);
+    /* Stats of other float or size_t sizes need the import tool. */
+    if (ok && (memcmp(h->magic, db->magic, sizeof(h->magic)) != 0
+        || h->format != ZOPFLI_STATSDB_FORMAT
+        || h->statsver != BESTSTATSDBVER
+        || h->zfloatsize != sizeof(zfloat)
+        || h->sizetsize != sizeof(size_t)
+        || h->end > filesize
+        || RecordsStart(h->nbuckets) > h->end)) {
+      UnmapDB(db);
+      ok = 0;
+    }
+  }
+  UnlockDB(db);
+  if (!ok) return 0;
+
+  db->state = 1;
+  pthread_mutex_lock(&atexitmutex);
+  if (!dbatexit) atexit(ZopfliStatsDBClose);
+  dbatexit = 1;
+  pthread_mutex_unlock(&atexitmutex);
+  return 1;
+}
+
+/*
+Remaps the file if other processes added records past the end of the
+current mapping. Must be called with the lock held.
+*/
+static int SyncDB(DBFile* db) {
+  size_t filesize;
+  if (Header(db)->end <= db->mapsize) return 1;
+  return FileSize(db, &filesize) && MapDB(db, filesize);
+}
+
+/*
+Opens the database and takes the lock, or returns 0 with neither. Must be
+called with the mutex of the file held.
+*/
+static int BeginDB(DBFile* db, int exclusive) {
+  if (!OpenDB(db)) return 0;
+  if (!LockDB(db, exclusive)) return 0;
+  if (!SyncDB(db)) {
+    UnlockDB(db);
+    db->state = -1;
+    return 0;
+  }
+  return 1;
+}
+
+/*
+Makes room for a record of size bytes at the end of the file and returns its
+offset, 0 if the file can't grow. Must be called with the exclusive lock held.
+*/
+static size_t AppendRecord(DBFile* db, size_t size) {
+  size_t offset = Header(db)->end;
+  if (offset + size > db->mapsize) {
+    /* Grow by a quarter so remapping stays rare. */
+    if (!MapDB(db, offset + offset / 4 + size)) {
+      db->state = -1;
+      return 0;
+    }
+  }
+  return offset;
+}
+
+/*
+Puts the record just written at the end of the file in front of the chain of
+bucket, next is its link field. Linking it is what makes the record visible.
+Nobody sees it half written while the lock is held, and after a crash before
+this point it's lost.
+*/
+static void LinkRecord(DBFile* db, size_t size, size_t bucket, size_t* next) {
+  *next = Buckets(db)[bucket];
+  Buckets(db)[bucket] = Header(db)->end;
+  Header(db)->end += size;
+  ++Header(db)->count;
+}
+
+static size_t BucketOf(unsigned long blockcrc, size_t blocksize,
+                       unsigned mode, size_t nbuckets) {
+  size_t h = blockcrc & 0xFFFFFFFFUL;
+  h ^= blocksize * 2654435761U;
+  h ^= (size_t)mode << 24;
+  return (h ^ (h >> 20)) & (nbuckets - 1);
+}
+
+static StatsDBRecord* StatsAt(size_t offset) {
+  return (StatsDBRecord*)(statsfile.map + offset);
+}
+
+/* Returns the offset of the record of the given block, 0 if there's none. */
+static size_t FindRecord(const ZopfliBestStats* statsdb) {
+  unsigned mode = (unsigned char)statsdb->mode;
+  unsigned crc = (unsigned)(statsdb->blockcrc & 0xFFFFFFFFUL);
+  size_t offset = Buckets(&statsfile)[BucketOf(crc, statsdb->blocksize, mode,
+                                      Header(&statsfile)->nbuckets)];
+  while (offset != 0) {
+    StatsDBRecord* r = StatsAt(offset);
+    if (r->blockcrc == crc && r->blocksize == statsdb->blocksize
+        && r->mode == mode) {
+      return offset;
+    }
+    offset = r->next;
+  }
+  return 0;
+}
+
+int ZopfliStatsDBLoad(ZopfliBestStats* statsdb) {
+  size_t offset, i;
+  int found = 0;
+  pthread_mutex_lock(&statsfile.mutex);
+  if (BeginDB(&statsfile, 0)) {
+    offset = FindRecord(statsdb);
+    if (offset != 0) {
+      const StatsDBRecord* r = StatsAt(offset);
+      SymbolStats* stats = statsdb->beststats;
+      statsdb->startiteration = r->startiteration;
+      statsdb->cost = r->cost;
+      for (i = 0; i < ZOPFLI_NUM_LL; ++i) stats->litlens[i] = r->litlens[i];
+      for (i = 0; i < ZOPFLI_NUM_D; ++i) stats->dists[i] = r->dists[i];
+      memcpy(stats->ll_symbols, r->ll_symbols, sizeof(r->ll_symbols));
+      memcpy(stats->d_symbols, r->d_symbols, sizeof(r->d_symbols));
+      found = 1;
+    }
+    UnlockDB(&statsfile);
+  }
+  pthread_mutex_unlock(&statsfile.mutex);
+  return found;
+}
+
+/* Whether the stored record r is better than the new entry statsdb. */
+static int KeepStored(const StatsDBRecord* r, const ZopfliBestStats* statsdb) {
+  if (r->cost != statsdb->cost) return r->cost < statsdb->cost;
+  return r->startiteration >= statsdb->startiteration;
+}
+
+int ZopfliStatsDBSave(const ZopfliBestStats* statsdb) {
+  size_t offset, i;
+  StatsDBRecord* r;
+  const SymbolStats* stats = statsdb->beststats;
+  if (stats == NULL) return 0;
+  pthread_mutex_lock(&statsfile.mutex);
+  if (!BeginDB(&statsfile, 1)) {
+    pthread_mutex_unlock(&statsfile.mutex);
+    return 0;
+  }
+  offset = FindRecord(statsdb);
+  if (offset != 0 && KeepStored(StatsAt(offset), statsdb)) {
+    /* What's stored is better, maybe found by another process. */
+    UnlockDB(&statsfile);
+    pthread_mutex_unlock(&statsfile.mutex);
+    return 1;
+  }
+
+  offset = AppendRecord(&statsfile, sizeof(StatsDBRecord));
+  if (offset == 0) {
+    UnlockDB(&statsfile);
+    pthread_mutex_unlock(&statsfile.mutex);
+    return 0;
+  }
+  r = StatsAt(offset);
+  r->blocksize = statsdb->blocksize;
+  r->blockcrc = (unsigned)(statsdb->blockcrc & 0xFFFFFFFFUL);
+  r->mode = (unsigned char)statsdb->mode;
+  r->startiteration = statsdb->startiteration;
+  r->cost = statsdb->cost;
+  for (i = 0; i < ZOPFLI_NUM_LL; ++i) r->litlens[i] = (unsigned)stats->litlens[i];
+  for (i = 0; i < ZOPFLI_NUM_D; ++i) r->dists[i] = (unsigned)stats->dists[i];
+  memcpy(r->ll_symbols, stats->ll_symbols, sizeof(r->ll_symbols));
+  memcpy(r->d_symbols, stats->d_symbols, sizeof(r->d_symbols));
+  LinkRecord(&statsfile, sizeof(StatsDBRecord),
+             BucketOf(r->blockcrc, r->blocksize, r->mode,
+                      Header(&statsfile)->nbuckets), &r->next);
+
+  UnlockDB(&statsfile);
+  pthread_mutex_unlock(&statsfile.mutex);
+  return 1;
+}
+
+static ParseDBRecord* ParseAt(size_t offset) {
+  return (ParseDBRecord*)(parsefile.map + offset);
+}
+
+static size_t ParseBucketOf(const ZopfliBestParse* parse) {
+  unsigned long crc = parse->blockcrc ^ (parse->windowcrc * 31);
+  return BucketOf(crc, parse->blocksize, (unsigned char)parse->mode,
+                  Header(&parsefile)->nbuckets);
+}
+
+/* Returns the offset of the record of the given block, 0 if there's none. */
+static size_t FindParse(const ZopfliBestParse* parse) {
+  unsigned mode = (unsigned char)parse->mode;
+  unsigned crc = (unsigned)(parse->blockcrc & 0xFFFFFFFFUL);
+  unsigned windowcrc = (unsigned)(parse->windowcrc & 0xFFFFFFFFUL);
+  size_t offset = Buckets(&parsefile)[ParseBucketOf(parse)];
+  while (offset != 0) {
+    ParseDBRecord* r = ParseAt(offset);
+    if (r->blockcrc == crc && r->windowcrc == windowcrc
+        && r->blocksize == parse->blocksize && r->mode == mode) {
+      return offset;
+    }
+    offset = r->next;
+  }
+  return 0;
+}
+
+/* Reads a varint at *pos of data, 0 if it's broken. */
+static size_t ReadVarint(const unsigned char* data, size_t nbytes,
+                         size_t* pos) {
+  size_t value = 0;
+  unsigned shift = 0;
+  while (*pos < nbytes && shift < 28) {
+    unsigned char byte = data[(*pos)++];
+    value |= (size_t)(byte & 127) << shift;
+    if (!(byte & 128)) return value;
+    shift += 7;
+  }
+  return 0;
+}
+
+/*
+Decodes the symbols of a record into store, checking every match against the
+input so a CRC32 collision can't produce a wrong stream. Comparing with memcmp
+is fine for overlapping matches as both sides are input already. Returns 0 if
+any of them doesn't fit.
+*/
+static int DecodeParse(const ParseDBRecord* r, const unsigned char* in,
+                       size_t instart, size_t inend, ZopfliLZ77Store* store) {
+  const unsigned char* data = (const unsigned char*)(r + 1);
+  size_t pos = instart, i = 0;
+  while (i < r->nbytes) {
+    size_t length = ReadVarint(data, r->nbytes, &i);
+    if (length == 1) {
+      if (pos >= inend) return 0;
+      ZopfliStoreLitLenDist(in[pos], 0, pos, store);
+    } else {
+      size_t dist = ReadVarint(data, r->nbytes, &i);
+      if (length < ZOPFLI_MIN_MATCH || length > ZOPFLI_MAX_MATCH
+          || dist == 0 || dist > ZOPFLI_WINDOW_SIZE || dist > pos
+          || length > inend - pos
+          || memcmp(in + pos - dist, in + pos, length) != 0) {
+        return 0;
+      }
+      ZopfliStoreLitLenDist((unsigned short)length, (unsigned short)dist,
+                            pos, store);
+    }
+    pos += length;
+  }
+  return pos == inend;
+}
+
+int ZopfliParseDBLoad(ZopfliBestParse* parse, const unsigned char* in,
+                      size_t instart, size_t inend, ZopfliLZ77Store* store) {
+  size_t offset;
+  int found = 0;
+  pthread_mutex_lock(&parsefile.mutex);
+  if (BeginDB(&parsefile, 0)) {
+    offset = FindParse(parse);
+    if (offset != 0) {
+      const ParseDBRecord* r = ParseAt(offset);
+      if (r->iterations >= parse->iterations
+          && offset + sizeof(*r) + r->nbytes <= Header(&parsefile)->end) {
+        found = DecodeParse(r, in, instart, inend, store);
+        if (found) {
+          parse->iterations = r->iterations;
+          parse->cost = r->cost;
+        } else {
+          ZopfliCleanLZ77Store(store);
+          ZopfliInitLZ77Store(in, store);
+        }
+      }
+    }
+    UnlockDB(&parsefile);
+  }
+  pthread_mutex_unlock(&parsefile.mutex);
+  return found;
+}
+
+static size_t VarintSize(size_t value) {
+  size_t size = 1;
+  while (value >= 128) {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+static void WriteVarint(size_t value, unsigned char* data, size_t* pos) {
+  while (value >= 128) {
+    data[(*pos)++] = (unsigned char)(value | 128);
+    value >>= 7;
+  }
+  data[(*pos)++] = (unsigned char)value;
+}
+
+int ZopfliParseDBSave(const ZopfliBestParse* parse,
+                      const ZopfliLZ77Store* store) {
+  size_t offset, nbytes = 0, size, i, pos = 0;
+  ParseDBRecord* r;
+  unsigned char* data;
+  for (i = 0; i < store->size; ++i) {
+    if (store->dists[i] == 0) {
+      ++nbytes;
+    } else {
+      nbytes += VarintSize(store->litlens[i]) + VarintSize(store->dists[i]);
+    }
+  }
+  size = (sizeof(ParseDBRecord) * 2 + nbytes - 1)
+       / sizeof(ParseDBRecord) * sizeof(ParseDBRecord);
+
+  pthread_mutex_lock(&parsefile.mutex);
+  if (!BeginDB(&parsefile, 1)) {
+    pthread_mutex_unlock(&parsefile.mutex);
+    return 0;
+  }
+  offset = FindParse(parse);
+  if (offset != 0) {
+    const ParseDBRecord* stored = ParseAt(offset);
+    if (stored->cost < parse->cost || (stored->cost == parse->cost
+        && stored->iterations >= parse->iterations)) {
+      UnlockDB(&parsefile);
+      pthread_mutex_unlock(&parsefile.mutex);
+      return 1;
+    }
+  }
+
+  offset = AppendRecord(&parsefile, size);
+  if (offset == 0) {
+    UnlockDB(&parsefile);
+    pthread_mutex_unlock(&parsefile.mutex);
+    return 0;
+  }
+  r = ParseAt(offset);
+  r->blocksize = parse->blocksize;
+  r->nbytes = nbytes;
+  r->blockcrc = (unsigned)(parse->blockcrc & 0xFFFFFFFFUL);
+  r->windowcrc = (unsigned)(parse->windowcrc & 0xFFFFFFFFUL);
+  r->mode = (unsigned char)parse->mode;
+  r->iterations = parse->iterations;
+  r->cost = parse->cost;
+  data = (unsigned char*)(r + 1);
+  for (i = 0; i < store->size; ++i) {
+    if (store->dists[i] == 0) {
+      data[pos++] = 1;
+    } else {
+      WriteVarint(store->litlens[i], data, &pos);
+      WriteVarint(store->dists[i], data, &pos);
+    }
+  }
+  LinkRecord(&parsefile, size, ParseBucketOf(parse), &r->next);
+
+  UnlockDB(&parsefile);
+  pthread_mutex_unlock(&parsefile.mutex);
+  return 1;
+}
+
+static SplitDBRecord* SplitAt(size_t offset) {
+  return (SplitDBRecord*)(splitfile.map + offset);
+}
+
+static size_t SplitBucketOf(const ZopfliBestSplits* splits) {
+  return BucketOf(splits->blockcrc, splits->blocksize,
+                  (unsigned)(splits->optionscrc & 0xFF),
+                  Header(&splitfile)->nbuckets);
+}
+
+/* Returns the offset of the record of the given block, 0 if there's none. */
+static size_t FindSplits(const ZopfliBestSplits* splits) {
+  unsigned crc = (unsigned)(splits->blockcrc & 0xFFFFFFFFUL);
+  unsigned optionscrc = (unsigned)(splits->optionscrc & 0xFFFFFFFFUL);
+  size_t offset = Buckets(&splitfile)[SplitBucketOf(splits)];
+  while (offset != 0) {
+    SplitDBRecord* r = SplitAt(offset);
+    if (r->blockcrc == crc && r->optionscrc == optionscrc
+        && r->blocksize == splits->blocksize) {
+      return offset;
+    }
+    offset = r->next;
+  }
+  return 0;
+}
+
+int ZopfliSplitDBLoad(ZopfliBestSplits* splits) {
+  size_t offset, i;
+  int found = 0;
+  pthread_mutex_lock(&splitfile.mutex);
+  if (BeginDB(&splitfile, 0)) {
+    offset = FindSplits(splits);
+    if (offset != 0) {
+      const SplitDBRecord* r = SplitAt(offset);
+      const size_t* points = (const size_t*)(r + 1);
+      found = offset + sizeof(*r) + r->npoints * sizeof(size_t)
+              <= Header(&splitfile)->end;
+      /* Points must be increasing and inside the block. */
+      for (i = 0; found && i < r->npoints; ++i) {
+        if (points[i] == 0 || points[i] >= r->blocksize
+            || (i > 0 && points[i] <= points[i - 1])) {
+          found = 0;
+        }
+      }
+      if (found) {
+        splits->cost = r->cost;
+        splits->pass = r->pass;
+        splits->done = r->done;
+        splits->splitpoints = 0;
+        splits->npoints = 0;
+        for (i = 0; i < r->npoints; ++i) {
+          ZOPFLI_APPEND_DATA(points[i], &splits->splitpoints,
+                             &splits->npoints);
+        }
+      }
+    }
+    UnlockDB(&splitfile);
+  }
+  pthread_mutex_unlock(&splitfile.mutex);
+  return found;
+}
+
+/*
+Whether the stored record r is better than the new entry splits. Final split
+points beat checkpoints, checkpoints of later passes beat earlier ones.
+*/
+static int KeepStoredSplits(const SplitDBRecord* r,
+                            const ZopfliBestSplits* splits) {
+  if (r->done != (unsigned)(splits->done != 0)) return r->done;
+  if (!r->done && r->pass != splits->pass) return r->pass > splits->pass;
+  return r->cost <= splits->cost;
+}
+
+int ZopfliSplitDBSave(const ZopfliBestSplits* splits) {
+  size_t offset, size, i;
+  SplitDBRecord* r;
+  size_t* points;
+  size = (sizeof(SplitDBRecord) * 2 + splits->npoints * sizeof(size_t) - 1)
+       / sizeof(SplitDBRecord) * sizeof(SplitDBRecord);
+
+  pthread_mutex_lock(&splitfile.mutex);
+  if (!BeginDB(&splitfile, 1)) {
+    pthread_mutex_unlock(&splitfile.mutex);
+    return 0;
+  }
+  offset = FindSplits(splits);
+  if (offset != 0 && KeepStoredSplits(SplitAt(offset), splits)) {
+    UnlockDB(&splitfile);
+    pthread_mutex_unlock(&splitfile.mutex);
+    return 1;
+  }
+
+  offset = AppendRecord(&splitfile, size);
+  if (offset == 0) {
+    UnlockDB(&splitfile);
+    pthread_mutex_unlock(&splitfile.mutex);
+    return 0;
+  }
+  r = SplitAt(offset);
+  r->blocksize = splits->blocksize;
+  r->npoints = splits->npoints;
+  r->blockcrc = (unsigned)(splits->blockcrc & 0xFFFFFFFFUL);
+  r->optionscrc = (unsigned)(splits->optionscrc & 0xFFFFFFFFUL);
+  r->pass = splits->pass;
+  r->done = splits->done != 0;
+  r->cost = splits->cost;
+  points = (size_t*)(r + 1);
+  for (i = 0; i < splits->npoints; ++i) points[i] = splits->splitpoints[i];
+  LinkRecord(&splitfile, size, SplitBucketOf(splits), &r->next);
+
+  UnlockDB(&splitfile);
+  pthread_mutex_unlock(&splitfile.mutex);
+  return 1;
+}
+
+void ZopfliStatsDBSignature(const unsigned char* in, size_t size,
+                            unsigned* signature) {
+  static const unsigned long salt[ZOPFLI_SIGNATURE_SIZE] = {
+    0x00000000UL, 0x9E3779B9UL, 0x7F4A7C15UL, 0xF39CC060UL,
+    0x5CEDC834UL, 0x2FE12A6CUL, 0xB5AD4ECEUL, 0x1B873593UL,
+    0xCC9E2D51UL, 0x85EBCA6BUL, 0xC2B2AE35UL, 0x27D4EB2FUL,
+    0x165667B1UL, 0xD3A2646CUL, 0xFD7046C5UL, 0xB55A4F09UL
+  };
+  size_t i, j;
+  for (j = 0; j < ZOPFLI_SIGNATURE_SIZE; ++j) signature[j] = 0xFFFFFFFFU;
+  /* MinHash over all 4 byte sequences, one hash function per value. */
+  for (i = 0; i + 4 <= size; ++i) {
+    unsigned long x = in[i] | ((unsigned long)in[i + 1] << 8)
+                    | ((unsigned long)in[i + 2] << 16)
+                    | ((unsigned long)in[i + 3] << 24);
+    x = (x * 2654435761UL) & 0xFFFFFFFFUL;
+    for (j = 0; j < ZOPFLI_SIGNATURE_SIZE; ++j) {
+      unsigned long h = ((x ^ salt[j]) * 0x45D9F3BUL) & 0xFFFFFFFFUL;
+      h ^= h >> 16;
+      if (h < signature[j]) signature[j] = (unsigned)h;
+    }
+  }
+}
+
+static SimDBRecord* SimAt(size_t offset) {
+  return (SimDBRecord*)(simfile.map + offset);
+}
+
+static size_t SimBucketOf(const unsigned* signature, unsigned mode,
+                          size_t band) {
+  size_t perband = Header(&simfile)->nbuckets / ZOPFLI_SIMDB_BANDS;
+  size_t h = BucketOf(signature[band * 2] ^ (signature[band * 2 + 1] * 31U),
+                      band, mode, Header(&simfile)->nbuckets);
+  return band * perband + h % perband;
+}
+
+int ZopfliStatsDBLoadSimilar(ZopfliBestStats* statsdb,
+                             const unsigned* signature) {
+  unsigned mode = (unsigned char)statsdb->mode;
+  size_t band, i, bestsize = 0;
+  unsigned long bestcrc = 0;
+  int bestmatches = ZOPFLI_SIGNATURE_SIZE / 2 - 1;
+  if (signature[0] == 0xFFFFFFFFU) return 0;
+  pthread_mutex_lock(&simfile.mutex);
+  if (BeginDB(&simfile, 0)) {
+    for (band = 0; band < ZOPFLI_SIMDB_BANDS; ++band) {
+      size_t offset = Buckets(&simfile)[SimBucketOf(signature, mode, band)];
+      size_t walked = 0;
+      for (; offset != 0 && walked < ZOPFLI_SIMDB_MAXCHAIN; ++walked) {
+        const SimDBRecord* r = SimAt(offset);
+        int matches = 0;
+        if (r->mode == mode) {
+          for (i = 0; i < ZOPFLI_SIGNATURE_SIZE; ++i) {
+            matches += r->signature[i] == signature[i];
+          }
+          /* Of equally similar blocks the one closest in size wins. */
+          if (matches > bestmatches || (matches == bestmatches && bestsize != 0
+              && (r->blocksize > statsdb->blocksize
+                  ? r->blocksize - statsdb->blocksize
+                  : statsdb->blocksize - r->blocksize)
+               < (bestsize > statsdb->blocksize
+                  ? bestsize - statsdb->blocksize
+                  : statsdb->blocksize - bestsize))) {
+            bestmatches = matches;
+            bestsize = r->blocksize;
+            bestcrc = r->blockcrc;
+          }
+        }
+        offset = r->next[band];
+      }
+    }
+    UnlockDB(&simfile);
+  }
+  pthread_mutex_unlock(&simfile.mutex);
+  if (bestsize == 0) return 0;
+
+  {
+    ZopfliBestStats similar = *statsdb;
+    similar.blocksize = bestsize;
+    similar.blockcrc = bestcrc;
+    if (!ZopfliStatsDBLoad(&similar)) return 0;
+    /* Only the stats are taken, the iterations start over. */
+    statsdb->startiteration = 0;
+    statsdb->cost = ZOPFLI_LARGE_FLOAT;
+  }
+  return 1;
+}
+
+int ZopfliStatsDBSaveSignature(const ZopfliBestStats* statsdb,
+                               const unsigned* signature) {
+  unsigned mode = (unsigned char)statsdb->mode;
+  unsigned crc = (unsigned)(statsdb->blockcrc & 0xFFFFFFFFUL);
+  size_t offset, band;
+  SimDBRecord* r;
+  if (signature[0] == 0xFFFFFFFFU) return 0;
+  pthread_mutex_lock(&simfile.mutex);
+  if (!BeginDB(&simfile, 1)) {
+    pthread_mutex_unlock(&simfile.mutex);
+    return 0;
+  }
+  /* A block is in every chain of its bands, looking at the first is enough. */
+  offset = Buckets(&simfile)[SimBucketOf(signature, mode, 0)];
+  while (offset != 0) {
+    r = SimAt(offset);
+    if (r->blockcrc == crc && r->blocksize == statsdb->blocksize
+        && r->mode == mode) {
+      UnlockDB(&simfile);
+      pthread_mutex_unlock(&simfile.mutex);
+      return 1;
+    }
+    offset = r->next[0];
+  }
+
+  offset = AppendRecord(&simfile, sizeof(SimDBRecord));
+  if (offset == 0) {
+    UnlockDB(&simfile);
+    pthread_mutex_unlock(&simfile.mutex);
+    return 0;
+  }
+  r = SimAt(offset);
+  r->blocksize = statsdb->blocksize;
+  r->blockcrc = crc;
+  r->mode = mode;
+  memcpy(r->signature, signature, sizeof(r->signature));
+  for (band = 0; band < ZOPFLI_SIMDB_BANDS; ++band) {
+    size_t bucket = SimBucketOf(signature, mode, band);
+    r->next[band] = Buckets(&simfile)[bucket];
+    Buckets(&simfile)[bucket] = offset;
+  }
+  Header(&simfile)->end += sizeof(SimDBRecord);
+  ++Header(&simfile)->count;
+
+  UnlockDB(&simfile);
+  pthread_mutex_unlock(&simfile.mutex);
+  return 1;
+}
@@ -0,0 +1,187 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Best statistics database (--statsdb). Keeps the best stats found for a block,
+identified by its CRC32, size and the mode it was compressed with, in the
+single file ZopfliDB.dat. The file is memory mapped, records are only ever
+appended to it and found through a hash index stored in the same file.
+Any amount of processes can share the file: they take an advisory lock on it
+for every lookup and update, and see what the others have added.
+
+The parse database (--parsedb) is kept the same way in ZopfliLZ.dat. It holds
+the final LZ77 symbols of a block, found by the CRC32 of the block and of the
+window before it, so a block seen before is written without iterating.
+
+With --statsdb a MinHash signature of every stored block is kept in
+ZopfliSG.dat, so a block not stored yet can start from the stats of the most
+similar one instead of from a greedy run.
+
+With --statsdb the final split points of every master block are kept in
+ZopfliSP.dat as well, found by the CRC32 of the master block and of the
+options that lead to them, so an unchanged input skips block splitting.
+*/
+
+#ifndef ZOPFLI_STATSDB_H_
+#define ZOPFLI_STATSDB_H_
+
+#include "lz77.h"
+#include "squeeze.h"
+
+/* Name of the database file, in the current directory. */
+#define ZOPFLI_STATSDB_FILE "ZopfliDB.dat"
+#define ZOPFLI_PARSEDB_FILE "ZopfliLZ.dat"
+#define ZOPFLI_SPLITDB_FILE "ZopfliSP.dat"
+#define ZOPFLI_SIMDB_FILE "ZopfliSG.dat"
+
+/* Amount of values in a block signature. */
+#define ZOPFLI_SIGNATURE_SIZE 16
+
+typedef struct ZopfliBestStats {
+
+  char mode;
+
+  size_t blocksize;
+
+  unsigned long blockcrc;
+
+  unsigned int startiteration;
+
+  /* Block size in bits that beststats lead to, used to decide which of two
+  results for the same block to keep. */
+  zfloat cost;
+
+  SymbolStats* beststats;
+} ZopfliBestStats;
+
+/*
+Looks up the block given by mode, blocksize and blockcrc and fills
+startiteration, cost and the already allocated beststats with what is stored.
+Returns 1 if found, 0 if not or if the database can't be used.
+*/
+int ZopfliStatsDBLoad(ZopfliBestStats* statsdb);
+
+/*
+Stores startiteration, cost and beststats for the block given by mode,
+blocksize and blockcrc. What is stored already, maybe by another process, is
+only replaced by a lower cost, or by the same cost at a higher
+startiteration. The new entry is written in full before it becomes visible,
+so a crash or a reader never sees half of it. Returns 1 on success, also when
+the stored entry was kept.
+*/
+int ZopfliStatsDBSave(const ZopfliBestStats* statsdb);
+
+typedef struct ZopfliBestParse {
+
+  char mode;
+
+  size_t blocksize;
+
+  unsigned long blockcrc;
+
+  /* CRC32 of up to ZOPFLI_WINDOW_SIZE bytes before the block. */
+  unsigned long windowcrc;
+
+  /* Iterations the parse was found with. */
+  unsigned int iterations;
+
+  /* Block size in bits of the parse. */
+  zfloat cost;
+} ZopfliBestParse;
+
+/*
+Looks up the block given by mode, blocksize, blockcrc and windowcrc and, if
+it was stored from at least iterations, appends its LZ77 symbols for
+in[instart, inend) to the empty store and fills iterations and cost. Every
+match is checked against the input. Returns 1 if found, 0 otherwise with
+store left empty.
+*/
+int ZopfliParseDBLoad(ZopfliBestParse* parse, const unsigned char* in,
+                      size_t instart, size_t inend, ZopfliLZ77Store* store);
+
+/*
+Stores the LZ77 symbols of store, that must be exactly the block given by
+parse. Like ZopfliStatsDBSave, a stored parse with lower cost, or the same
+cost from as many iterations, is kept. Returns 1 on success.
+*/
+int ZopfliParseDBSave(const ZopfliBestParse* parse,
+                      const ZopfliLZ77Store* store);
+
+typedef struct ZopfliBestSplits {
+
+  size_t blocksize;
+
+  unsigned long blockcrc;
+
+  /* CRC32 of the options that have an effect on the split points. */
+  unsigned long optionscrc;
+
+  /* Size in bits of the master block compressed with these split points. */
+  zfloat cost;
+
+  /* Split-last rounds (--pass#) that lead to these split points. */
+  unsigned int pass;
+
+  /*
+  0 if this is a checkpoint of --resume, taken before the split-last rounds
+  were finished.
+  */
+  int done;
+
+  /* Split points relative to the start of the master block. */
+  size_t* splitpoints;
+
+  size_t npoints;
+} ZopfliBestSplits;
+
+/*
+Looks up the master block given by blocksize, blockcrc and optionscrc and
+fills cost, pass, done and splitpoints, allocated to be freed by the caller,
+and npoints. Returns 1 if found, 0 otherwise.
+*/
+int ZopfliSplitDBLoad(ZopfliBestSplits* splits);
+
+/*
+Stores the split points of the master block given by splits, unless the
+stored entry is better: done before not done, then the later pass of two
+checkpoints, then the same or lower cost. Returns 1 on success.
+*/
+int ZopfliSplitDBSave(const ZopfliBestSplits* splits);
+
+/* Calculates the signature of in[0, size) used to find similar blocks. */
+void ZopfliStatsDBSignature(const unsigned char* in, size_t size,
+                            unsigned* signature);
+
+/*
+Looks for the stored block with the same mode that is most similar to the
+one with the given signature, at least half of the signature values must be
+equal. Fills the already allocated beststats with its stats, startiteration
+with 0 and cost with ZOPFLI_LARGE_FLOAT. Returns 1 if found, 0 if not.
+*/
+int ZopfliStatsDBLoadSimilar(ZopfliBestStats* statsdb,
+                             const unsigned* signature);
+
+/*
+Adds the block given by mode, blocksize and blockcrc with its signature to
+the similarity index, unless it's there already. Returns 1 on success.
+*/
+int ZopfliStatsDBSaveSignature(const ZopfliBestStats* statsdb,
+                               const unsigned* signature);
+
+/* Unmaps and closes the database files, done at exit as well. */
+void ZopfliStatsDBClose(void);
+
+#endif  /* ZOPFLI_STATSDB_H_ */
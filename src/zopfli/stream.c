@@ -0,0 +1,257 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+Streaming compression: input is fed in pieces of any size and only one master
+block plus the window before it is kept in memory. Every master block is
+compressed as soon as it's full and more input follows, so its output is
+final and handed to the sink right away. The output is the same as that of
+ZopfliCompress for the whole input.
+*/
+
+#include "defines.h"
+#include "zopfli.h"
+#include "util.h"
+#include "crc32.h"
+#include "adler.h"
+#include "deflate.h"
+#include "stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct ZopfliStream {
+  ZopfliOptions options;
+  ZopfliFormat output_type;
+  ZopfliStreamSink* sink;
+  void* context;
+
+  /* Window of the last master block followed by the input of the next. */
+  unsigned char* in;
+  size_t instart;
+  size_t inend;
+  size_t allocated;
+
+  /* Output not handed to the sink yet, a partial last byte at most. */
+  unsigned char* out;
+  size_t outsize;
+  unsigned char bp;
+
+  unsigned long checksum;
+  size_t insize;
+
+  /* 1 once the final block is written by ZopfliStreamCompress. */
+  int ended;
+};
+
+/* Hands all full bytes of the output to the sink. */
+static void StreamFlush(ZopfliStream* stream, int all) {
+  size_t full = stream->outsize;
+  if(!all && stream->bp != 0 && full > 0) --full;
+  if(full == 0) return;
+  stream->sink(stream->context, stream->out, full);
+  if(full < stream->outsize) stream->out[0] = stream->out[full];
+  stream->outsize -= full;
+  if(stream->outsize == 0) {
+    ZopfliFree(stream->out);
+    stream->out = 0;
+  }
+}
+
+/* Compresses in[instart, inend) and hands its output to the sink. */
+static void StreamDeflate(ZopfliStream* stream, const unsigned char* in,
+                          size_t instart, size_t inend, int final) {
+  ZopfliDeflatePart(&stream->options, 2, final, in, instart, inend,
+                    &stream->bp, &stream->out, &stream->outsize,
+                    stream->options.verbose, NULL);
+  StreamFlush(stream, final);
+}
+
+static void StreamChecksum(ZopfliStream* stream,
+                           const unsigned char* in, size_t insize) {
+  if(stream->output_type == ZOPFLI_FORMAT_ZLIB) {
+    adler32u(in, insize, &stream->checksum);
+  } else if(stream->output_type != ZOPFLI_FORMAT_DEFLATE) {
+    CRCu(in, insize, &stream->checksum);
+  }
+  stream->insize += insize;
+}
+
+/* Compresses the master block in the buffer and keeps its end as window. */
+static void StreamBlock(ZopfliStream* stream, int final) {
+  size_t keep;
+  StreamDeflate(stream, stream->in, stream->instart, stream->inend, final);
+  keep = stream->inend > ZOPFLI_WINDOW_SIZE ? ZOPFLI_WINDOW_SIZE : stream->inend;
+  memmove(stream->in, stream->in + stream->inend - keep, keep);
+  stream->instart = stream->inend = keep;
+}
+
+DLL_PUBLIC ZopfliStream* ZopfliStreamInit(const ZopfliOptions* options,
+                                          const ZopfliFormat output_type,
+                                          const ZopfliAdditionalData* moredata,
+                                          ZopfliStreamSink* sink,
+                                          void* context) {
+  ZopfliStream* stream;
+  const ZopfliAllocator* previous;
+  size_t i;
+  if(sink == NULL || output_type == ZOPFLI_FORMAT_ZIP) return NULL;
+  previous = ZopfliBindAllocator(options);
+  stream = (ZopfliStream*)ZopfliMalloc(sizeof(*stream));
+  if(!stream) exit(-1); /* Allocation failed. */
+  if(options == NULL) {
+    ZopfliInitOptions(&stream->options);
+    stream->options.verbose = 0;
+  } else {
+    stream->options = *options;
+  }
+  /* Feed and Finish may come from other threads. */
+  stream->options.allocator = ZopfliGetAllocator();
+  stream->output_type = output_type;
+  stream->sink = sink;
+  stream->context = context;
+  stream->in = 0;
+  stream->instart = stream->inend = 0;
+  stream->allocated = 0;
+  stream->out = 0;
+  stream->outsize = 0;
+  stream->bp = 0;
+  stream->checksum = output_type == ZOPFLI_FORMAT_ZLIB ? 1L : 0L;
+  stream->insize = 0;
+  stream->ended = 0;
+
+  if(output_type == ZOPFLI_FORMAT_GZIP || output_type == ZOPFLI_FORMAT_GZIP_NAME) {
+    static const unsigned char headerstart[3]  = {  31, 139,   8 };
+    static const unsigned char headerend[2]    = {   2,   3 };
+    const char* infilename = moredata != NULL ? moredata->filename : NULL;
+    unsigned long timestamp = moredata != NULL ? moredata->timestamp : 0;
+    for(i=0;i<sizeof(headerstart);++i) ZOPFLI_APPEND_DATA(headerstart[i], &stream->out, &stream->outsize);
+    ZOPFLI_APPEND_DATA(infilename == NULL ? 0 : 8, &stream->out, &stream->outsize);  /* FLG */
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((timestamp >> (i*8)) % 256, &stream->out, &stream->outsize);
+    for(i=0;i<sizeof(headerend);++i) ZOPFLI_APPEND_DATA(headerend[i], &stream->out, &stream->outsize);
+    if(infilename != NULL) {
+      for(i=0;infilename[i] != '\0';i++) ZOPFLI_APPEND_DATA(infilename[i], &stream->out, &stream->outsize);
+      ZOPFLI_APPEND_DATA(0, &stream->out, &stream->outsize);
+    }
+  } else if(output_type == ZOPFLI_FORMAT_ZLIB) {
+    int fdict = stream->options.dictionary != NULL
+                && stream->options.dictionarysize > 0;
+    unsigned cmfflg = 256 * 120 + 192 + (fdict ? 32 : 0);
+    cmfflg += 31 - cmfflg % 31;
+    ZOPFLI_APPEND_DATA(cmfflg / 256, &stream->out, &stream->outsize);
+    ZOPFLI_APPEND_DATA(cmfflg % 256, &stream->out, &stream->outsize);
+    if(fdict) {
+      unsigned long dictid = 1L;
+      adler32u(stream->options.dictionary, stream->options.dictionarysize,
+               &dictid);
+      for(i=4;i!=0;--i) ZOPFLI_APPEND_DATA((dictid >> ((i-1)*8)) % 256, &stream->out, &stream->outsize);
+    }
+  }
+  StreamFlush(stream, 1);
+
+  /* The dictionary becomes the window of the first master block, gzip can't
+  name one. */
+  if(output_type != ZOPFLI_FORMAT_GZIP && output_type != ZOPFLI_FORMAT_GZIP_NAME
+     && stream->options.dictionary != NULL
+     && stream->options.dictionarysize > 0) {
+    size_t window = stream->options.dictionarysize < ZOPFLI_WINDOW_SIZE ?
+                    stream->options.dictionarysize : ZOPFLI_WINDOW_SIZE;
+    stream->in = (unsigned char*)ZopfliMalloc(window);
+    if(!stream->in) exit(-1); /* Allocation failed. */
+    memcpy(stream->in, stream->options.dictionary
+           + stream->options.dictionarysize - window, window);
+    stream->instart = stream->inend = stream->allocated = window;
+  }
+  stream->options.dictionary = NULL;
+  stream->options.dictionarysize = 0;
+  ZopfliSetAllocator(previous);
+  return stream;
+}
+
+DLL_PUBLIC void ZopfliStreamFeed(ZopfliStream* stream,
+                                 const unsigned char* in, size_t insize) {
+  const ZopfliAllocator* previous = ZopfliBindAllocator(&stream->options);
+  StreamChecksum(stream, in, insize);
+  while(insize > 0) {
+    size_t room;
+    /* A full master block is only known not to be the last one now. */
+    if(stream->inend - stream->instart == ZOPFLI_STREAM_BLOCK_SIZE) {
+      StreamBlock(stream, 0);
+    }
+    room = ZOPFLI_STREAM_BLOCK_SIZE - (stream->inend - stream->instart);
+    if(room > insize) room = insize;
+    if(stream->inend + room > stream->allocated) {
+      /* Grows up to a master block and its window only. */
+      size_t allocated = stream->allocated * 2;
+      if(allocated < stream->inend + room) allocated = stream->inend + room;
+      if(allocated > ZOPFLI_WINDOW_SIZE + ZOPFLI_STREAM_BLOCK_SIZE) {
+        allocated = ZOPFLI_WINDOW_SIZE + ZOPFLI_STREAM_BLOCK_SIZE;
+      }
+      stream->in = (unsigned char*)ZopfliRealloc(stream->in, allocated);
+      if(!stream->in) exit(-1); /* Allocation failed. */
+      stream->allocated = allocated;
+    }
+    memcpy(stream->in + stream->inend, in, room);
+    stream->inend += room;
+    in += room;
+    insize -= room;
+  }
+  ZopfliSetAllocator(previous);
+}
+
+void ZopfliStreamCompress(ZopfliStream* stream,
+                          const unsigned char* in, size_t insize) {
+  const ZopfliAllocator* previous;
+  size_t i;
+  if(stream->inend > 0) {
+    /* The window of a dictionary has to be in front of the input. */
+    ZopfliStreamFeed(stream, in, insize);
+    return;
+  }
+  previous = ZopfliBindAllocator(&stream->options);
+  StreamChecksum(stream, in, insize);
+  for(i = 0; i < insize; i += ZOPFLI_STREAM_BLOCK_SIZE) {
+    size_t end = insize - i > ZOPFLI_STREAM_BLOCK_SIZE ?
+                 i + ZOPFLI_STREAM_BLOCK_SIZE : insize;
+    StreamDeflate(stream, in, i, end, end == insize);
+  }
+  stream->ended = insize > 0;
+  ZopfliSetAllocator(previous);
+}
+
+DLL_PUBLIC void ZopfliStreamFinish(ZopfliStream* stream) {
+  const ZopfliAllocator* previous = ZopfliBindAllocator(&stream->options);
+  size_t i;
+  if(stream->ended) {
+    /* The final block is out already. */
+  } else if(stream->inend > stream->instart) {
+    StreamBlock(stream, 1);
+  } else {
+    /* Empty input, an empty final block with fixed tree. */
+    ZOPFLI_APPEND_DATA(3, &stream->out, &stream->outsize);
+    ZOPFLI_APPEND_DATA(0, &stream->out, &stream->outsize);
+  }
+  if(stream->output_type == ZOPFLI_FORMAT_GZIP || stream->output_type == ZOPFLI_FORMAT_GZIP_NAME) {
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((stream->checksum >> (i*8)) % 256, &stream->out, &stream->outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((stream->insize >> (i*8)) % 256, &stream->out, &stream->outsize);
+  } else if(stream->output_type == ZOPFLI_FORMAT_ZLIB) {
+    for(i=4;i!=0;--i) ZOPFLI_APPEND_DATA((stream->checksum >> ((i-1)*8)) % 256, &stream->out, &stream->outsize);
+  }
+  StreamFlush(stream, 1);
+  ZopfliFree(stream->out);
+  ZopfliFree(stream->in);
+  ZopfliFree(stream);
+  ZopfliSetAllocator(previous);
+}
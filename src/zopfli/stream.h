@@ -0,0 +1,50 @@
+/*
+Copyright 2016 Mr_KrzYch00. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef ZOPFLI_STREAM_H_
+#define ZOPFLI_STREAM_H_
+
+/*
+Parts of the streaming compression shared with the rest of the library, the
+public functions are in zopfli.h.
+*/
+
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Master block size of streams, the one of ZopfliDeflate if it has one. */
+#if ZOPFLI_MASTER_BLOCK_SIZE > 0
+#define ZOPFLI_STREAM_BLOCK_SIZE ZOPFLI_MASTER_BLOCK_SIZE
+#else
+#define ZOPFLI_STREAM_BLOCK_SIZE 104857600
+#endif
+
+/*
+Compresses all of the input of a new stream that nothing was fed to yet,
+straight from in instead of a copy, unless the window of a dictionary has
+to be in front of it. Only ZopfliStreamFinish may follow.
+*/
+void ZopfliStreamCompress(ZopfliStream* stream,
+                          const unsigned char* in, size_t insize);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  /* ZOPFLI_STREAM_H_ */
@@ -28,8 +28,8 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
                             unsigned* symbols) {
-  size_t* bl_count = (size_t*)malloc(sizeof(size_t) * (maxbits + 1));
-  size_t* next_code = (size_t*)malloc(sizeof(size_t) * (maxbits + 1));
+  size_t* bl_count = (size_t*)ZopfliMalloc(sizeof(size_t) * (maxbits + 1));
+  size_t* next_code = (size_t*)ZopfliMalloc(sizeof(size_t) * (maxbits + 1));
   unsigned bits, i;
   unsigned code;
 
@@ -59,8 +59,8 @@ void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned maxbits,
     }
   }
 
-  free(next_code);
-  free(bl_count);
+  ZopfliFree(next_code);
+  ZopfliFree(bl_count);
 }
 
 void ZopfliCalculateEntropy(const size_t* count, size_t n, zfloat* bitlengths) {
@@ -22,6 +22,10 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "util.h"
 #include "zopfli.h"
 
+#include <pthread.h>
+#include <string.h>
+#include <sys/time.h>
+
 void ZopfliInitOptions(ZopfliOptions* options) {
   options->verbose = 2;
   options->numiterations = 15;
@@ -38,4 +42,102 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->numthreads = 1;
   options->statimportance = 100;
   options->rui = 0;
+  options->budget = 0;
+  options->deadline = 0;
+  options->finish = NULL;
+  options->allocator = NULL;
+  options->progress = NULL;
+  options->progresscontext = NULL;
+  options->dictionary = NULL;
+  options->dictionarysize = 0;
+}
+
+unsigned int ZopfliMaxFailIterations(const ZopfliOptions* options) {
+  if(options->finish != NULL && *options->finish) return 1;
+  return options->maxfailiterations;
+}
+
+double ZopfliGetTime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+int ZopfliDeadlineReached(double deadline) {
+  return deadline > 0 && ZopfliGetTime() >= deadline;
+}
+
+void ZopfliReportProgress(const ZopfliOptions* options,
+                          ZopfliProgressEvent event, size_t start, size_t end,
+                          size_t block, size_t blocks, int pass,
+                          int iteration, double bits) {
+  ZopfliProgress progress;
+  if(options->progress == NULL) return;
+  progress.event = event;
+  progress.start = start;
+  progress.end = end;
+  progress.block = block;
+  progress.blocks = blocks;
+  progress.pass = pass;
+  progress.iteration = iteration;
+  progress.bits = bits;
+  (*options->progress)(options->progresscontext, &progress);
+}
+
+static pthread_key_t allocatorkey;
+static pthread_once_t allocatoronce = PTHREAD_ONCE_INIT;
+
+static void MakeAllocatorKey(void) {
+  pthread_key_create(&allocatorkey, NULL);
+}
+
+const ZopfliAllocator* ZopfliGetAllocator(void) {
+  pthread_once(&allocatoronce, MakeAllocatorKey);
+  return (const ZopfliAllocator*)pthread_getspecific(allocatorkey);
+}
+
+const ZopfliAllocator* ZopfliSetAllocator(const ZopfliAllocator* allocator) {
+  const ZopfliAllocator* previous = ZopfliGetAllocator();
+  pthread_setspecific(allocatorkey, (void*)allocator);
+  return previous;
+}
+
+const ZopfliAllocator* ZopfliBindAllocator(const ZopfliOptions* options) {
+  const ZopfliAllocator* previous = ZopfliGetAllocator();
+  if(options != NULL && options->allocator != NULL) {
+    pthread_setspecific(allocatorkey, (void*)options->allocator);
+  }
+  return previous;
+}
+
+void* ZopfliMalloc(size_t size) {
+  const ZopfliAllocator* a = ZopfliGetAllocator();
+  if(a == NULL) return malloc(size);
+  return a->alloc(a->context, size);
+}
+
+void* ZopfliCalloc(size_t num, size_t size) {
+  const ZopfliAllocator* a = ZopfliGetAllocator();
+  void* ptr;
+  if(a == NULL) return calloc(num, size);
+  if(size != 0 && num > (size_t)-1 / size) return NULL;
+  ptr = a->alloc(a->context, num * size);
+  if(ptr != NULL) memset(ptr, 0, num * size);
+  return ptr;
+}
+
+void* ZopfliRealloc(void* ptr, size_t size) {
+  const ZopfliAllocator* a = ZopfliGetAllocator();
+  if(a == NULL) return realloc(ptr, size);
+  if(ptr == NULL) return a->alloc(a->context, size);
+  return a->realloc(a->context, ptr, size);
+}
+
+void ZopfliFree(void* ptr) {
+  const ZopfliAllocator* a = ZopfliGetAllocator();
+  if(a == NULL) {
+    free(ptr);
+  } else if(ptr != NULL) {
+    a->free(a->context, ptr);
+  }
 }
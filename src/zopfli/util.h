@@ -28,6 +28,12 @@ basic deflate specification values and generic program options.
 
 #include <stdlib.h>
 
+#include "zopfli.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Minimum and maximum length that can be encoded in deflate. */
 #define ZOPFLI_MAX_MATCH 258
 #define ZOPFLI_MIN_MATCH 3
@@ -60,6 +66,103 @@ Set this to, for example, 20MB (20000000). Set it to 0 to disable master blocks.
 */
 #define ZOPFLI_MASTER_BLOCK_SIZE 104857600
 
+/*
+Smallest part of the input that the block splitter gives to a separate thread
+for its greedy LZ77 run when multi-threading is used. Smaller parts are not
+worth a thread and only make the splitting points differ more from a single
+run over the whole input.
+*/
+#define ZOPFLI_SPLIT_CHUNK_MIN 1048576
+
+/*
+Amount of evenly spaced candidate split points (--dpsplit), and the smallest
+distance between them in LZ77 symbols. Up to half as many points where the
+symbol statistics change the most are added to them. The splitter estimates
+the cost of every pair of candidates, so this is quadratic in time. The
+chosen points are then refined between their neighbouring candidates.
+*/
+#define ZOPFLI_DPSPLIT_GRID 64
+#define ZOPFLI_DPSPLIT_MINSTEP 64
+
+/*
+Seconds between two checkpoints of the best stats of a block being iterated
+(--resume). A killed run loses at most this much work per running block.
+*/
+#define ZOPFLI_CHECKPOINT_SECONDS 60
+
+/*
+Iterations a block is given at a time when blocks share an iteration budget
+(--budget#). Every slice after the first repeats the best iteration of the
+last one, so smaller slices waste more.
+*/
+#define ZOPFLI_BUDGET_SLICE 8
+
+/*
+Share of the stored size the pre-scan of --prescan has to leave as the most
+any compression could gain, 1/# of it, to store a block without iterating.
+*/
+#define ZOPFLI_PRESCAN_MARGIN 128
+
+/* Entries of the hash table the pre-scan finds matches with, a power of 2. */
+#define ZOPFLI_PRESCAN_HASH 32768
+
+/*
+Unsuccessful iterations after the last best one that end a block, 0 for no
+limit: maxfailiterations of options, or 1 once their finish flag is set.
+*/
+unsigned int ZopfliMaxFailIterations(const ZopfliOptions* options);
+
+/* Wall clock time in seconds since the Unix epoch. */
+double ZopfliGetTime(void);
+
+/* Returns 1 if deadline is set, not 0, and ZopfliGetTime() reached it. */
+int ZopfliDeadlineReached(double deadline);
+
+/*
+Hands an event about in[start, end) with the given fields to the progress
+callback of options, does nothing without one.
+*/
+void ZopfliReportProgress(const ZopfliOptions* options,
+                          ZopfliProgressEvent event, size_t start, size_t end,
+                          size_t block, size_t blocks, int pass,
+                          int iteration, double bits);
+
+/*
+Allocator the calling thread uses, NULL for the one of the C library. Every
+library entry point binds the allocator of its options with
+ZopfliBindAllocator and sets the previous one back on return, every thread it
+starts sets the one of its parent with ZopfliSetAllocator.
+*/
+const ZopfliAllocator* ZopfliGetAllocator(void);
+
+/* Sets the allocator of the calling thread, returns the previous one. */
+const ZopfliAllocator* ZopfliSetAllocator(const ZopfliAllocator* allocator);
+
+/*
+Sets the allocator of options, if any, for the calling thread and returns the
+previous one. Without one the thread keeps what it has, so a call made by
+another one, like the deflate of ZopfliPNG, uses the allocator of that.
+*/
+const ZopfliAllocator* ZopfliBindAllocator(const ZopfliOptions* options);
+
+/*
+malloc, calloc, realloc and free through the allocator of the calling thread.
+Everything the library allocates goes through these.
+*/
+void* ZopfliMalloc(size_t size);
+void* ZopfliCalloc(size_t num, size_t size);
+void* ZopfliRealloc(void* ptr, size_t size);
+void ZopfliFree(void* ptr);
+
+/*
+Spacing in LZ77 symbols of the two levels of full histograms built by
+ZopfliLZ77IndexHistograms. The second level counts from the last first level
+histogram, so ZOPFLI_HISTOGRAM_INDEX_STEP1 must fit in an unsigned short and
+be a multiple of ZOPFLI_HISTOGRAM_INDEX_STEP2.
+*/
+#define ZOPFLI_HISTOGRAM_INDEX_STEP1 32768
+#define ZOPFLI_HISTOGRAM_INDEX_STEP2 32
+
 /*
 Used to initialize costs for example
 */
@@ -142,8 +245,8 @@ equal than *size.
   if (!((*size) & ((*size) - 1))) {\
     /*zfloat alloc size if it's a power of two*/\
     void** data_void = reinterpret_cast<void**>(data);\
-    *data_void = (*size) == 0 ? malloc(sizeof(**data))\
-                              : realloc((*data), (*size) * 2 * sizeof(**data));\
+    *data_void = (*size) == 0 ? ZopfliMalloc(sizeof(**data))\
+                              : ZopfliRealloc((*data), (*size) * 2 * sizeof(**data));\
   }\
   (*data)[(*size)] = (value);\
   (*size)++;\
@@ -152,13 +255,16 @@ equal than *size.
 #define ZOPFLI_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size) {\
   if (!((*size) & ((*size) - 1))) {\
     /*zfloat alloc size if it's a power of two*/\
-    (*data) = (*size) == 0 ? malloc(sizeof(**data))\
-                           : realloc((*data), (*size) * 2 * sizeof(**data));\
+    (*data) = (*size) == 0 ? ZopfliMalloc(sizeof(**data))\
+                           : ZopfliRealloc((*data), (*size) * 2 * sizeof(**data));\
   }\
   (*data)[(*size)] = (value);\
   (*size)++;\
 }
 #endif
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif  /* ZOPFLI_UTIL_H_ */
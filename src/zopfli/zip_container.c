@@ -49,11 +49,12 @@ void ZopfliZipCompress(const ZopfliOptions* options,
   unsigned long fullsize = insize & 0xFFFFFFFFUL;
   unsigned long rawdeflsize = 0;
   unsigned char bp = 0;
+  ZopfliOptions nodictionary;
   size_t max = 0;
   unsigned long cdirsize = 0;
   unsigned long cdiroffset;
   if(moredata==NULL) {
-    tempfilename = (char*)malloc(9 * sizeof(char*));
+    tempfilename = (char*)ZopfliMalloc(9 * sizeof(char*));
     sprintf(tempfilename,"%08lx",crcvalue & 0xFFFFFFFFUL);
     infilename = tempfilename;
   } else {
@@ -66,7 +67,7 @@ void ZopfliZipCompress(const ZopfliOptions* options,
 
  /* MS-DOS TIME */
   if(moredata == NULL) {
-    for(i=0;i<sizeof(defTimestamp);++i) ZOPFLI_APPEND_DATA(defTimestamp >> (i*8) % 256, out, outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(defTimestamp >> (i*8) % 256, out, outsize);
   } else {
     for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((moredata->timestamp >> (i*8)) % 256, out, outsize);
   }
@@ -93,7 +94,10 @@ void ZopfliZipCompress(const ZopfliOptions* options,
   rawdeflsize = *outsize;
 
   if(fullsize<insize) fullsize=insize;
-  ZopfliDeflate(options, 2 /* Dynamic block */, 1,
+  /* Zip can't name a preset dictionary for the decoder. */
+  nodictionary = *options;
+  nodictionary.dictionary = NULL;
+  ZopfliDeflate(&nodictionary, 2 /* Dynamic block */, 1,
                 in, insize, &bp, out, outsize, sp);
 
   rawdeflsize = *outsize - rawdeflsize;
@@ -105,7 +109,7 @@ void ZopfliZipCompress(const ZopfliOptions* options,
  /* MS-DOS TIME, CRC, OSIZE, ISIZE FROM */
 
   if(moredata == NULL) {
-    for(i=0;i<sizeof(defTimestamp);++i) ZOPFLI_APPEND_DATA(defTimestamp >> (i*8) % 256, out, outsize);
+    for(i=0;i<4;++i) ZOPFLI_APPEND_DATA(defTimestamp >> (i*8) % 256, out, outsize);
   } else {
     for(i=0;i<4;++i) ZOPFLI_APPEND_DATA((moredata->timestamp >> (i*8)) % 256,out,outsize);
   }
@@ -132,7 +136,7 @@ void ZopfliZipCompress(const ZopfliOptions* options,
 
  /* FILENAME */
   for(i=0; i<max;++i) ZOPFLI_APPEND_DATA(infilename[i],out,outsize);
-  free(tempfilename);
+  ZopfliFree(tempfilename);
   cdirsize = *outsize - cdirsize;
 
  /* END C-DIR PK STATIC DATA + TOTAL FILES (ALWAYS 1) */
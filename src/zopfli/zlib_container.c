@@ -35,15 +35,23 @@ void ZopfliZlibCompress(const ZopfliOptions* options,
   unsigned cmfflg;
   unsigned fcheck;
   unsigned char bp=0;
+  int fdict = options->dictionary != NULL && options->dictionarysize > 0;
 
   adler32u(in, insize,&checksum);
 
-  cmfflg = 256 * cmf + 192;
+  cmfflg = 256 * cmf + 192 + (fdict ? 32 : 0);
   fcheck = 31 - cmfflg % 31;
   cmfflg += fcheck;
   ZOPFLI_APPEND_DATA(cmfflg / 256, out, outsize);
   ZOPFLI_APPEND_DATA(cmfflg % 256, out, outsize);
 
+  if(fdict) {
+    /* DICTID, Adler-32 of the whole dictionary. */
+    unsigned long dictid = 1L;
+    adler32u(options->dictionary, options->dictionarysize, &dictid);
+    for(bp=4;bp!=0;--bp) ZOPFLI_APPEND_DATA((dictid >> ((bp-1)*8)) % 256, out, outsize);
+  }
+
   ZopfliDeflate(options, 2 /* dynamic block */, 1,
                 in, insize, &bp, out, outsize, sp);
 
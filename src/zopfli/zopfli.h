@@ -22,11 +22,84 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #define ZOPFLI_ZOPFLI_H_
 
 #include <stddef.h>
+#include <signal.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+Memory functions of the caller, used instead of malloc, realloc and free for
+everything the library allocates during a call: its work memory, the output
+buffers and the split points in ZopfliPredefinedSplits. What the library
+returns must then be freed with free of the same allocator. realloc and free
+are never given a NULL pointer. Calls that fail to allocate end the process
+like a failed malloc does, a memory cap is only enforced that way.
+*/
+typedef struct ZopfliAllocator {
+  void* (*alloc)(void* context, size_t size);
+  void* (*realloc)(void* context, void* ptr, size_t size);
+  void (*free)(void* context, void* ptr);
+  void* context;
+} ZopfliAllocator;
+
+/* What a ZopfliProgress reports. */
+typedef enum ZopfliProgressEvent {
+  /* A master block in[start, end) is started. */
+  ZOPFLI_PROGRESS_MASTER_BLOCK,
+
+  /*
+  Its blocks, blocks of them, are compressed once more. pass is 0 for the
+  first time, then counts the recompression passes (--pass#).
+  */
+  ZOPFLI_PROGRESS_PASS,
+
+  /* Block number block of blocks, in[start, end), is started. */
+  ZOPFLI_PROGRESS_BLOCK_START,
+
+  /*
+  Iteration iteration of block number block, in[start, end), is the best so
+  far of the current try, bits in size. With --all every try starts over and
+  with a budget every slice of iterations does.
+  */
+  ZOPFLI_PROGRESS_ITERATION,
+
+  /* Block number block of blocks, in[start, end), is done, bits in size. */
+  ZOPFLI_PROGRESS_BLOCK_END,
+
+  /*
+  Block number block, in[start, end), is found incompressible by the
+  pre-scan (0x2000 of mode) and isn't iterated, bits in size. blocks is 1 if
+  it's a whole master block, stored as it is without splitting, 0 otherwise.
+  */
+  ZOPFLI_PROGRESS_STORED
+} ZopfliProgressEvent;
+
+/*
+One event of the progress of a call. Fields an event doesn't mention are 0.
+Offsets are those of the input given to the call, or of ZopfliDeflatePart.
+*/
+typedef struct ZopfliProgress {
+  ZopfliProgressEvent event;
+  size_t start;
+  size_t end;
+  size_t block;
+  size_t blocks;
+  int pass;
+  int iteration;
+  double bits;
+} ZopfliProgress;
+
+/*
+Called with every event while a call works. Events of blocks come from the
+threads that compress them, up to numthreads at once, without any lock held
+by the library, so the callback must be thread-safe and should return fast,
+e.g. by storing the event for another thread to pick up. progress is only
+valid during the call.
+*/
+typedef void ZopfliProgressCallback(void* context,
+                                    const ZopfliProgress* progress);
+
 /*
 Options shared by both BIN and LIB.
 */
@@ -107,7 +180,13 @@ typedef struct ZopfliOptions {
   0x0020 - Use Complementary-Multiply-With-Carry,
   0x0040 - Disable splitting after compression,
   0x0080 - Use expensive fixed block calculations in splitter,
-  0x0100 - Use File-based best stats DB.
+  0x0100 - Use File-based best stats DB,
+  0x0200 - Use dynamic programming block splitter,
+  0x0400 - Use File-based final LZ77 parse DB,
+  0x0800 - Save checkpoints to the DBs of 0x0100 and 0x0400 while working,
+  0x1000 - Start blocks of --pass# rounds from stats of the last round,
+  0x2000 - Store blocks a quick pre-scan finds incompressible, no iterations,
+  0x4000 - Start blocks missing from the DB of 0x0100 from similar ones.
   */
   unsigned long mode;
 
@@ -131,6 +210,59 @@ typedef struct ZopfliOptions {
   */
   int statimportance;
 
+  /*
+  Iterations per block on average that all blocks of a master block share.
+  Instead of numiterations for every block, blocks get more iterations while
+  they gain the most bits per iteration and byte, until the budget is spent
+  or none of them improves anymore. 0 (default) disables it, it's not used
+  with 0x0010.
+  */
+  unsigned int budget;
+
+  /*
+  Wall clock time in seconds since the Unix epoch at which to stop working
+  and write out the best found so far, 0 (default) for none. Block splitting
+  stops, blocks still iterating finish the current iteration and keep their
+  best one, blocks not started yet get a greedy LZ77 run only. The output is
+  a valid stream either way, finished shortly after the deadline.
+  */
+  double deadline;
+
+  /*
+  Flag of the caller, NULL (default) for none. Once set to non-zero, e.g. by
+  a SIGINT handler or another thread, the call finishes its work as soon as
+  possible, as if maxfailiterations were 1. Everything else a call needs is
+  kept per call, so any number of calls may run at once.
+  */
+  const volatile sig_atomic_t* finish;
+
+  /*
+  Memory functions to use, NULL (default) for those of the C library or the
+  ones of the call this one is made from, e.g. by a ZopfliPNG deflate.
+  Threads started by the call use them as well.
+  */
+  const ZopfliAllocator* allocator;
+
+  /*
+  Function to report the progress to, NULL (default) for none, and the
+  context it's given. Independent of verbose.
+  */
+  ZopfliProgressCallback* progress;
+
+  void* progresscontext;
+
+  /*
+  Preset dictionary of dictionarysize bytes, NULL (default) for none. Its
+  last 32KB are the window before the input, so matches can reach into it.
+  ZopfliDeflate and the deflate and zlib formats use it, zlib output names
+  it by its Adler-32 in the header (FDICT). The decoder must be given the
+  same dictionary. Gzip and zip can't name one and don't use it, neither
+  does ZopfliDeflatePart that has the window of its input.
+  */
+  const unsigned char* dictionary;
+
+  size_t dictionarysize;
+
 } ZopfliOptions;
 
 /*
@@ -156,7 +288,10 @@ typedef struct ZopfliAdditionalData {
 This struct is used for custom block splits to be passed to LIB.
 Can be safely passed as NULL pointer, otherwise must be in
 read/write mode for ZopfliDeflatePart to update it with
-best split point positions Zopfli considered the best.
+best split point positions Zopfli considered the best. A master block
+stored as a whole, by the pre-scan (0x2000 of mode) or because its blocks
+came out bigger, adds no split points. Given split points are always used
+instead of that pre-scan.
 */
 typedef struct ZopfliPredefinedSplits {
   /*
@@ -204,6 +339,110 @@ void ZopfliCompress(ZopfliOptions* options, const ZopfliFormat output_type,
                     unsigned char** out, size_t* outsize, ZopfliPredefinedSplits* sp,
                     const ZopfliAdditionalData* moredata);
 
+/*
+Same as ZopfliCompress, but stops working seconds after the call and writes
+out the best found so far (see deadline in ZopfliOptions), so it returns about
+on time no matter how many iterations options ask for. options may be NULL
+and isn't changed.
+*/
+void ZopfliCompressDeadline(const ZopfliOptions* options,
+                            const ZopfliFormat output_type,
+                            const unsigned char* in, size_t insize,
+                            unsigned char** out, size_t* outsize,
+                            ZopfliPredefinedSplits* sp,
+                            const ZopfliAdditionalData* moredata,
+                            double seconds);
+
+/* One input of ZopfliCompressBatch, moredata may be NULL. */
+typedef struct ZopfliBatchItem {
+  const unsigned char* in;
+  size_t insize;
+  const ZopfliAdditionalData* moredata;
+} ZopfliBatchItem;
+
+/*
+Receives the output of item number item of a batch. Called from the worker
+that compressed it, so calls for different items may come at the same time
+and in any order. out is freed once it returns.
+*/
+typedef void ZopfliBatchCallback(void* context, size_t item,
+                                 const unsigned char* out, size_t outsize);
+
+/*
+Compresses numitems independent inputs like ZopfliCompress does, with up to
+options->numthreads of them at once, the largest first. While there are
+fewer items left than threads, the spare threads work on the blocks of the
+items. Meant for many small inputs, whose few blocks can't keep the threads
+busy on their own. options may be NULL and isn't changed. Returns once all
+items were passed to callback.
+*/
+void ZopfliCompressBatch(const ZopfliOptions* options,
+                         const ZopfliFormat output_type,
+                         const ZopfliBatchItem* items, size_t numitems,
+                         ZopfliBatchCallback* callback, void* context);
+
+/* Streaming compression state, see ZopfliStreamInit. */
+typedef struct ZopfliStream ZopfliStream;
+
+/* Receives the next size bytes of the output of a stream. */
+typedef void ZopfliStreamSink(void* context,
+                              const unsigned char* data, size_t size);
+
+/*
+Starts compressing input that is fed in pieces with ZopfliStreamFeed, for
+input that doesn't fit in memory or isn't all there yet. Only one master
+block and the window before it is kept, every master block is compressed once
+it's full and more input follows, and its output goes to sink right away.
+The output is the same as ZopfliCompress gives for the whole input.
+options is copied and moredata only read here, both may be NULL. Returns
+NULL for ZOPFLI_FORMAT_ZIP, whose header needs the sizes first.
+*/
+ZopfliStream* ZopfliStreamInit(const ZopfliOptions* options,
+                               const ZopfliFormat output_type,
+                               const ZopfliAdditionalData* moredata,
+                               ZopfliStreamSink* sink, void* context);
+
+/* Adds the next insize bytes of input. */
+void ZopfliStreamFeed(ZopfliStream* stream,
+                      const unsigned char* in, size_t insize);
+
+/* Compresses the rest of the input, ends the output and frees stream. */
+void ZopfliStreamFinish(ZopfliStream* stream);
+
+/*
+Most bytes ZopfliCompress, ZopfliCompressToSink or ZopfliCompressToBuffer
+give for insize bytes of input in the given format, with the file name of
+moredata, which may be NULL. Any master block that compresses worse is
+written as stored blocks instead, so this is only a little over insize.
+*/
+size_t ZopfliCompressBound(size_t insize, const ZopfliFormat output_type,
+                           const ZopfliAdditionalData* moredata);
+
+/*
+Compresses like ZopfliCompress, but hands the output to sink as it's made
+instead of growing an output array: every master block straight after it's
+compressed, and only the output of one master block is kept at a time.
+ZOPFLI_FORMAT_ZIP output comes in one piece at the end, its local header
+needs the compressed size. options may be NULL and isn't changed.
+*/
+void ZopfliCompressToSink(const ZopfliOptions* options,
+                          const ZopfliFormat output_type,
+                          const unsigned char* in, size_t insize,
+                          const ZopfliAdditionalData* moredata,
+                          ZopfliStreamSink* sink, void* context);
+
+/*
+Compresses like ZopfliCompressToSink into the caller's buffer out of outsize
+bytes, e.g. a file mapped at the size of ZopfliCompressBound. Returns the
+size of the output, or 0 if it didn't fit, which never happens with at least
+ZopfliCompressBound bytes.
+*/
+size_t ZopfliCompressToBuffer(const ZopfliOptions* options,
+                              const ZopfliFormat output_type,
+                              const unsigned char* in, size_t insize,
+                              const ZopfliAdditionalData* moredata,
+                              unsigned char* out, size_t outsize);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
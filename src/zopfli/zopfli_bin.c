@@ -62,10 +62,10 @@ static void IdlePriority() {
 #include "adler.h"
 #include "crc32.h"
 #include "blocksplitter.h"
+#include "serve.h"
 
 static const char tempfileext[8] = { '.' , 'z' , 'o' , 'p' , 'f' , 'l' , 'i', 0 };
 
-void intHandler(int exit_code);
 
 static void InitCDIR(ZipCDIR *zipcdir) {
   zipcdir->data = NULL;
@@ -76,7 +76,7 @@ static void InitCDIR(ZipCDIR *zipcdir) {
 }
 
 static void CleanCDIR(ZipCDIR *zipcdir) {
-  free(zipcdir->data);
+  ZopfliFree(zipcdir->data);
   zipcdir->data = 0;
 }
 
@@ -87,6 +87,7 @@ static void ZopfliInitBinOptions(ZopfliBinOptions* options) {
   options->custblocksplit = NULL;
   options->dumpsplitsfile = NULL;
   options->additionalautosplits = 0;
+  options->deadline = 0;
 }
 
 static size_t ceilz(zfloat num) {
@@ -351,6 +352,9 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
   int final = 1;
   ZopfliPredefinedSplits sp;
 
+  options->deadline = binoptions->deadline > 0 ?
+                      ZopfliGetTime() + binoptions->deadline : 0;
+
   LoadFile(infilename, &in, &insize, &loffset, &fullsize, 1, 1);
   free(in);
   if (fullsize == 0 || insize == 0) {
@@ -389,11 +393,16 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
       ZOPFLI_APPEND_DATA(0, &out, &outsize);
     }
   } else if(output_type == ZOPFLI_FORMAT_ZLIB) {
-    unsigned cmfflg = 30912;
+    unsigned cmfflg = options->dictionary != NULL ? 30944 : 30912;
     unsigned fcheck = 31 - cmfflg % 31;
     cmfflg += fcheck;
     ZOPFLI_APPEND_DATA(cmfflg / 256, &out, &outsize);
     ZOPFLI_APPEND_DATA(cmfflg % 256, &out, &outsize);
+    if(options->dictionary != NULL) {
+      unsigned long dictid = 1L;
+      adler32u(options->dictionary, options->dictionarysize, &dictid);
+      for(j=4;j!=0;--j) ZOPFLI_APPEND_DATA((dictid >> ((j-1)*8)) % 256, &out, &outsize);
+    }
   } else if(output_type == ZOPFLI_FORMAT_ZIP) {
     unsigned int l;
     static const unsigned char filePKh[10]     = { 80, 75,  3,  4, 20,  0,  2,  0,  8,  0};
@@ -457,11 +466,8 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
   }
   ZopfliDeflate(options, 2, final, in, insize, &bp, &out, &outsize, &sp);
   free(in);
-  if (!outfilename) {
-    ConsoleOutput(out,outsize-1);
-  } else {
-    SaveFile(outfilename, out, outsize,soffset);
-  }
+  /* stdout gets everything at once below. */
+  if (outfilename) SaveFile(outfilename, out, outsize,soffset);
   if(binoptions->dumpsplitsfile != NULL) {
     FILE* file = NULL;
     char* tempfilename = NULL;
@@ -478,7 +484,7 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
     fprintf(stderr,"Hex split points successfully saved to file: %s\n",binoptions->dumpsplitsfile);
     free(tempfilename);
   }
-  free(sp.splitpoints);
+  ZopfliFree(sp.splitpoints);
 
   compsize = outsize+soffset-offset-initsoffset;
 
@@ -551,7 +557,7 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
       free(buff);
     }
   }
-  free(out);
+  ZopfliFree(out);
   free(splitpoints);
 
   outsize+=soffset;
@@ -567,6 +573,58 @@ static int Compress(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
 
 }
 
+/*
+Sink of CompressStdin.
+*/
+static void StdoutSink(void* context, const unsigned char* data, size_t size) {
+  (void)context;
+  if(fwrite(data, 1, size, stdout) != size) {
+    fprintf(stderr,"Error: Can't write to stdout, terminating.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+Compresses stdin to stdout with the streaming API, so only one master block
+of the input is in memory at once and output is written while reading.
+*/
+static int CompressStdin(ZopfliOptions* options, const ZopfliBinOptions* binoptions,
+                         ZopfliFormat output_type) {
+  size_t size = 1048576, n;
+  unsigned char* buffer;
+  ZopfliStream* stream;
+
+  if(output_type == ZOPFLI_FORMAT_ZIP) {
+    fprintf(stderr, "Error: ZIP container can't be streamed from stdin.\n");
+    return 0;
+  }
+  if(output_type == ZOPFLI_FORMAT_GZIP_NAME) output_type = ZOPFLI_FORMAT_GZIP;
+
+  options->deadline = binoptions->deadline > 0 ?
+                      ZopfliGetTime() + binoptions->deadline : 0;
+
+#if _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  buffer = (unsigned char*)malloc(size);
+  if(!buffer) exit(-1); /* Allocation failed. */
+  stream = ZopfliStreamInit(options, output_type, NULL, StdoutSink, NULL);
+  while((n = fread(buffer, 1, size, stdin)) > 0) {
+    ZopfliStreamFeed(stream, buffer, n);
+  }
+  ZopfliStreamFinish(stream);
+  fflush(stdout);
+  free(buffer);
+#if _WIN32
+  _setmode(_fileno(stdout), _O_TEXT);
+#endif
+
+  if(options->verbose>0) fprintf(stderr,"Progress: 100.0%%                                                  \n");
+
+  return 1;
+}
+
 /*
 Wrapper for Compress for single-file mode.
 */
@@ -577,8 +635,6 @@ static void CompressFile(ZopfliOptions* options, const ZopfliBinOptions* binopti
 
   char* tempfilename = NULL;
 
-  mui = options->maxfailiterations;
-
   if(outfilename) tempfilename = AddStrings(outfilename,tempfileext);
 
   if(Compress(options,binoptions,output_type,infilename,tempfilename,0,0)==1)
@@ -612,8 +668,6 @@ static void CompressMultiFile(ZopfliOptions* options, const ZopfliBinOptions* bi
     return;
   }
 
-  mui = options->maxfailiterations;
-
   if(outfilename) tempfilename = AddStrings(outfilename,tempfileext);
 
   InitCDIR(&zipcdir);
@@ -669,6 +723,40 @@ static void ParseCustomBlockBoundaries(size_t** bs, const char* data) {
   }
 }
 
+/*
+Reads the preset dictionary of --dict#. Only its last ZOPFLI_WINDOW_SIZE bytes
+are used, but zlib names it by the Adler-32 of all of it.
+*/
+static int LoadDictionary(const char* filename, ZopfliOptions* options) {
+  FILE* file = fopen(filename, "rb");
+  unsigned char* dictionary;
+  size_t size;
+  if(file == NULL) {
+    fprintf(stderr,"Error: Dictionary file %s doesn't exist.\n",filename);
+    return 0;
+  }
+  fseeko(file,0,SEEK_END);
+  size = ftello(file);
+  if(size == 0) {
+    fprintf(stderr,"Error: Dictionary file %s seems empty.\n",filename);
+    fclose(file);
+    return 0;
+  }
+  dictionary = (unsigned char*)malloc(size);
+  if(!dictionary) exit(-1); /* Allocation failed. */
+  rewind(file);
+  if(fread(dictionary,1,size,file) != size) {
+    fprintf(stderr,"Error: Can't read dictionary file %s.\n",filename);
+    free(dictionary);
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+  options->dictionary = dictionary;
+  options->dictionarysize = size;
+  return 1;
+}
+
 static void VersionInfo(void) {
   fprintf(stderr,
   "Zopfli, a Compression Algorithm to produce Deflate streams.\n"
@@ -676,133 +764,309 @@ static void VersionInfo(void) {
   VERYEAR, VERMONTH, VERCOMMIT);
 }
 
+/*
+Applies one of the switches that set how to compress, those a --serve# job may
+give as well. Returns 1 if arg is one of them, 0 if not and -1 if it's wrong.
+*/
+static int ParseOption(const char* arg, ZopfliOptions* options,
+                       ZopfliBinOptions* binoptions, ZopfliFormat* output_type) {
+  if (StringsEqual(arg, "--deflate")) *output_type = ZOPFLI_FORMAT_DEFLATE;
+  else if (StringsEqual(arg, "--zlib")) *output_type = ZOPFLI_FORMAT_ZLIB;
+  else if (StringsEqual(arg, "--gzip")) *output_type = ZOPFLI_FORMAT_GZIP;
+  else if (StringsEqual(arg, "--gzipname")) *output_type = ZOPFLI_FORMAT_GZIP_NAME;
+  else if (StringsEqual(arg, "--zip")) *output_type = ZOPFLI_FORMAT_ZIP;
+  else if (StringsEqual(arg, "--lazy")) options->mode |= 0x0001;
+  else if (StringsEqual(arg, "--ohh")) options->mode |= 0x0002;
+  else if (StringsEqual(arg, "--rc")) options->mode |= 0x0004;
+  else if (StringsEqual(arg, "--brotli")) options->mode |= 0x0008;
+  else if (StringsEqual(arg, "--all")) options->mode |= 0x0010;
+  else if (StringsEqual(arg, "--cmwc")) options->mode |= 0x0020;
+  else if (StringsEqual(arg, "--nosplitlast")) options->mode |= 0x0040;
+  else if (StringsEqual(arg, "--slowsplit")) options->mode |= 0x0080;
+  else if (StringsEqual(arg, "--statsdb")) options->mode |= 0x0100;
+  else if (StringsEqual(arg, "--dpsplit")) options->mode |= 0x0200;
+  else if (StringsEqual(arg, "--parsedb")) options->mode |= 0x0400;
+  else if (StringsEqual(arg, "--resume")) options->mode |= 0x0D00;
+  else if (StringsEqual(arg, "--warmstart")) options->mode |= 0x1000;
+  else if (StringsEqual(arg, "--prescan")) options->mode |= 0x2000;
+  else if (StringsEqual(arg, "--similar")) options->mode |= 0x4100;
+  else if (StringsEqual(arg, "--aas")) binoptions->additionalautosplits = 1;
+  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r'
+        && arg[3] == 'u' && arg[4] == 'i'
+        && arg[5] >= '0' && arg[5] <= '9') {
+    options->rui = atoi(arg + 5);
+  } else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 's' && arg[3] == 'i'
+           && arg[4] >= '0' && arg[4] <= '9') {
+    options->statimportance = atoi(arg + 4);
+    if (options->statimportance > 149) options->statimportance = 149;
+    else if (options->statimportance < 1) options->statimportance = 1;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'i'
+           && arg[3] >= '0' && arg[3] <= '9') {
+    options->numiterations = atoi(arg + 3);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 't'
+           && arg[3] >= '0' && arg[3] <= '9') {
+    options->numthreads = atoi(arg + 3);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'b'
+           && arg[4] >= '0' && arg[4] <= '9') {
+    options->blocksplittingmax = atoi(arg + 4);
+    if (options->blocksplittingmax < 0) options->blocksplittingmax = 0;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'p' && arg[3] == 'a'
+           && arg[4] == 's' && arg[5] == 's' && arg[6] >= '0' && arg[6] <= '9') {
+    options->pass = atoi(arg + 6);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'l'
+           && arg[4] == 's' && arg[5] >= '0' && arg[5] <= '9') {
+    options->lengthscoremax = atoi(arg + 5);
+    if (options->lengthscoremax < 1) options->lengthscoremax = 1;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'b' && arg[3] == 's'
+           && arg[4] == 'r' && arg[5] >= '0' && arg[5] <= '9') {
+    options->findminimumrec = atoi(arg + 5);
+    if (options->findminimumrec < 2) options->findminimumrec = 2;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'w'
+           && arg[4] >= '0' && arg[4] <= '9') {
+    unsigned short num = atoi(arg + 4);
+    if(num < 1) num = 1;
+    options->ranstatewz = (num << 16) + (options->ranstatewz & 0xFFFF);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'z'
+           && arg[4] >= '0' && arg[4] <= '9') {
+    unsigned short num = atoi(arg + 4);
+    if(num < 1) num = 1;
+    options->ranstatewz = num + (options->ranstatewz & 0xFFFF0000);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'm'
+           && arg[4] >= '0' && arg[4] <= '9') {
+    options->ranstatemod = atoi(arg + 4);
+    if (options->ranstatemod < 1) options->ranstatemod = 1;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'u'
+           && arg[4] == 'i' && arg[5] >= '0' && arg[5] <= '9') {
+    options->maxfailiterations = atoi(arg + 5);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'b' && arg[3] == 'u'
+           && arg[4] == 'd' && arg[5] == 'g' && arg[6] == 'e' && arg[7] == 't'
+           && arg[8] >= '0' && arg[8] <= '9') {
+    options->budget = atoi(arg + 8);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'd' && arg[3] == 'e'
+           && arg[4] == 'a' && arg[5] == 'd' && arg[6] == 'l' && arg[7] == 'i'
+           && arg[8] == 'n' && arg[9] == 'e' && arg[10] >= '0' && arg[10] <= '9') {
+    binoptions->deadline = atoi(arg + 10);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'c' && arg[3] == 'b'
+           && arg[4] == 's' && arg[5] != '\0') {
+    if(arg[5] == 'f' && arg[6] == 'i' && arg[7] == 'l' && arg[8] == 'e'
+    && arg[9] != '\0') {
+      const char *cbsfile = arg+9;
+      FILE* file = fopen(cbsfile, "rb");
+      char* filedata = NULL;
+      size_t size;
+      if(file==NULL) {
+        fprintf(stderr,"Error: CBS file %s doesn't exist.\n",cbsfile);
+        return -1;
+      }
+      fseeko(file,0,SEEK_END);
+      size=ftello(file);
+      if(size>0) {
+        filedata = (char *) malloc((size+1) * sizeof(char*));
+        rewind(file);
+        if(fread(filedata,1,size,file)) {}
+        filedata[size]='\0';
+        ParseCustomBlockBoundaries(&binoptions->custblocksplit,filedata);
+        free(filedata);
+      } else {
+        fprintf(stderr,"Error: CBS file %s seems empty.\n",cbsfile);
+        return -1;
+      }
+      fclose(file);
+    } else {
+      ParseCustomBlockBoundaries(&binoptions->custblocksplit,arg+5);
+    }
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'c' && arg[3] == 'b'
+           && arg[4] == 'd' && arg[5] != '\0') {
+     binoptions->dumpsplitsfile = arg+5;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'd' && arg[3] == 'i'
+           && arg[4] == 'c' && arg[5] == 't' && arg[6] != '\0') {
+    if(!LoadDictionary(arg + 6, options)) return -1;
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'v' && arg[3] >= '0'
+           && arg[3] <= '9') {
+    options->verbose = atoi(arg + 3);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'b' && arg[3] >= '0'
+           && arg[3] <= '9') {
+    binoptions->blocksize = atoi(arg + 3);
+  }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'n' && arg[3] >= '0'
+           && arg[3] <= '9') {
+    binoptions->numblocks = atoi(arg + 3);
+  }
+  else return 0;
+  return 1;
+}
+
+/* What a --serve# job starts from: the switches the daemon was started with. */
+typedef struct ZopfliServeDefaults {
+  ZopfliOptions options;
+  ZopfliBinOptions binoptions;
+  ZopfliFormat output_type;
+} ZopfliServeDefaults;
+
+/*
+Copies text, followed by name unless it's NULL, to the reply of a --serve#
+job, cut to fit.
+*/
+static void ServeMessage(char* reply, size_t replysize,
+                         const char* text, const char* name) {
+  reply[0] = '\0';
+  strncat(reply, text, replysize - 1);
+  if(name) strncat(reply, name, replysize - 1 - strlen(reply));
+}
+
+/*
+Whether a switch would have a --serve# job open a file other than its input
+and output: --cbsfile#, --cbd# and --dict#. Jobs refuse them, so a client
+can't have the daemon read or write other files through them. --dict# may be
+given to the daemon itself instead.
+*/
+static int ServeOpensFile(const char* arg) {
+  return strncmp(arg, "--cbsfile", 9) == 0 || strncmp(arg, "--cbd", 5) == 0
+         || strncmp(arg, "--dict", 6) == 0;
+}
+
+/*
+Runs one job of --serve#: its switches on top of those the daemon was started
+with, then the input file and, optionally, the output file. An existing
+output file is replaced without asking.
+*/
+static int ServeJob(void* context, int argc, char** argv,
+                    char* reply, size_t replysize) {
+  const ZopfliServeDefaults* defaults = (const ZopfliServeDefaults*)context;
+  ZopfliOptions options = defaults->options;
+  ZopfliBinOptions binoptions = defaults->binoptions;
+  ZopfliFormat output_type = defaults->output_type;
+  const char* infilename = NULL;
+  const char* outfilename = NULL;
+  char* defaultname = NULL;
+  char* tempfilename = NULL;
+  const char* error = NULL;
+  const char* errorname = NULL;
+  FILE* file;
+  int ok = 0;
+  int i;
+
+  for(i = 0; i < argc && !error; ++i) {
+    const char* arg = argv[i];
+    if(arg[0] == '-') {
+      if(arg[1] != '-' || ServeOpensFile(arg)
+         || ParseOption(arg, &options, &binoptions, &output_type) <= 0) {
+        error = "ERROR wrong switch ";
+        errorname = arg;
+      }
+    } else if(infilename == NULL) {
+      infilename = arg;
+    } else if(outfilename == NULL) {
+      outfilename = arg;
+    } else {
+      error = "ERROR more than 2 files: ";
+      errorname = arg;
+    }
+  }
+  if(!error && infilename == NULL) error = "ERROR no input file";
+  if(!error && options.dictionary != NULL && (output_type == ZOPFLI_FORMAT_GZIP
+     || output_type == ZOPFLI_FORMAT_GZIP_NAME || output_type == ZOPFLI_FORMAT_ZIP)) {
+    error = "ERROR --dict# works only with --zlib or --deflate";
+  }
+  if(!error && outfilename == NULL) {
+    if (output_type == ZOPFLI_FORMAT_GZIP || output_type == ZOPFLI_FORMAT_GZIP_NAME) {
+      defaultname = AddStrings(infilename, ".gz");
+    } else if (output_type == ZOPFLI_FORMAT_ZLIB) {
+      defaultname = AddStrings(infilename, ".zlib");
+    } else if (output_type == ZOPFLI_FORMAT_ZIP) {
+      defaultname = AddStrings(infilename, ".zip");
+    } else {
+      defaultname = AddStrings(infilename, ".deflate");
+    }
+    outfilename = defaultname;
+  }
+  if(!error) {
+    file = fopen(infilename, "rb");
+    if(file == NULL) {
+      error = "ERROR can't read ";
+      errorname = infilename;
+    } else {
+      fclose(file);
+    }
+  }
+  if(!error) {
+    /* SaveFile ends the process if it can't write, that must not happen here. */
+    tempfilename = AddStrings(outfilename, tempfileext);
+    file = fopen(tempfilename, "wb");
+    if(file == NULL) {
+      error = "ERROR can't write ";
+      errorname = tempfilename;
+    } else {
+      fclose(file);
+      if(Compress(&options, &binoptions, output_type, infilename, tempfilename, 0, 0) != 1) {
+        error = "ERROR couldn't compress ";
+        errorname = infilename;
+      } else {
+        binoptions.custblocksplit = NULL;  /* Freed by Compress. */
+        if(rename(tempfilename, outfilename) != 0) {
+          error = "ERROR can't rename to ";
+          errorname = outfilename;
+        } else {
+          ok = 1;
+        }
+      }
+      if(!ok) remove(tempfilename);
+    }
+  }
+
+  if(ok) {
+    ServeMessage(reply, replysize, "OK ", outfilename);
+  } else {
+    ServeMessage(reply, replysize, error, errorname);
+  }
+  if(binoptions.custblocksplit != defaults->binoptions.custblocksplit) {
+    free(binoptions.custblocksplit);
+  }
+  if(options.dictionary != defaults->options.dictionary) {
+    free((unsigned char*)options.dictionary);
+  }
+  free(tempfilename);
+  free(defaultname);
+  return ok;
+}
+
 int main(int argc, char* argv[]) {
   ZopfliOptions options;
   ZopfliBinOptions binoptions;
   ZopfliFormat output_type = ZOPFLI_FORMAT_GZIP;
   const char* filename = 0;
   int output_to_stdout = 0;
+  const char* servepath = NULL;
+  unsigned numjobs = 1;
   int i;
 
   signal(SIGINT, intHandler);
 
   ZopfliInitOptions(&options);
   ZopfliInitBinOptions(&binoptions);
+  options.finish = &finishwork;
 
   for (i = 1; i < argc; i++) {
     const char* arg = argv[i];
+    int parsed = ParseOption(arg, &options, &binoptions, &output_type);
+    if (parsed < 0) return EXIT_FAILURE;
+    if (parsed > 0) continue;
     if (StringsEqual(arg, "--c")) output_to_stdout = 1;
-    else if (StringsEqual(arg, "--deflate")) output_type = ZOPFLI_FORMAT_DEFLATE;
-    else if (StringsEqual(arg, "--zlib")) output_type = ZOPFLI_FORMAT_ZLIB;
-    else if (StringsEqual(arg, "--gzip")) output_type = ZOPFLI_FORMAT_GZIP;
-    else if (StringsEqual(arg, "--gzipname")) output_type = ZOPFLI_FORMAT_GZIP_NAME;
-    else if (StringsEqual(arg, "--zip")) output_type = ZOPFLI_FORMAT_ZIP;
     else if (StringsEqual(arg, "--idle")) IdlePriority();
-    else if (StringsEqual(arg, "--lazy")) options.mode |= 0x0001;
-    else if (StringsEqual(arg, "--ohh")) options.mode |= 0x0002;
-    else if (StringsEqual(arg, "--rc")) options.mode |= 0x0004;
-    else if (StringsEqual(arg, "--brotli")) options.mode |= 0x0008;
-    else if (StringsEqual(arg, "--all")) options.mode |= 0x0010;
-    else if (StringsEqual(arg, "--cmwc")) options.mode |= 0x0020;
-    else if (StringsEqual(arg, "--nosplitlast")) options.mode |= 0x0040;
-    else if (StringsEqual(arg, "--slowsplit")) options.mode |= 0x0080;
-    else if (StringsEqual(arg, "--statsdb")) options.mode |= 0x0100;
     else if (StringsEqual(arg, "--dir")) binoptions.usescandir = 1;
-    else if (StringsEqual(arg, "--aas")) binoptions.additionalautosplits = 1;
-    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r'
-          && arg[3] == 'u' && arg[4] == 'i'
-          && arg[5] >= '0' && arg[5] <= '9') {
-      options.rui = atoi(arg + 5);
-    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 's' && arg[3] == 'i'
-             && arg[4] >= '0' && arg[4] <= '9') {
-      options.statimportance = atoi(arg + 4);
-      if (options.statimportance > 149) options.statimportance = 149;
-      else if (options.statimportance < 1) options.statimportance = 1;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'i'
-             && arg[3] >= '0' && arg[3] <= '9') {
-      options.numiterations = atoi(arg + 3);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 't'
-             && arg[3] >= '0' && arg[3] <= '9') {
-      options.numthreads = atoi(arg + 3);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'b'
-             && arg[4] >= '0' && arg[4] <= '9') {
-      options.blocksplittingmax = atoi(arg + 4);
-      if (options.blocksplittingmax < 0) options.blocksplittingmax = 0;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'p' && arg[3] == 'a'
-             && arg[4] == 's' && arg[5] == 's' && arg[6] >= '0' && arg[6] <= '9') {
-      options.pass = atoi(arg + 6);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'l'
-             && arg[4] == 's' && arg[5] >= '0' && arg[5] <= '9') {
-      options.lengthscoremax = atoi(arg + 5);
-      if (options.lengthscoremax < 1) options.lengthscoremax = 1;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'b' && arg[3] == 's'
-             && arg[4] == 'r' && arg[5] >= '0' && arg[5] <= '9') {
-      options.findminimumrec = atoi(arg + 5);
-      if (options.findminimumrec < 2) options.findminimumrec = 2;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'w'
-             && arg[4] >= '0' && arg[4] <= '9') {
-      unsigned short num = atoi(arg + 4);
-      if(num < 1) num = 1;
-      options.ranstatewz = (num << 16) + (options.ranstatewz & 0xFFFF);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'z'
-             && arg[4] >= '0' && arg[4] <= '9') {
-      unsigned short num = atoi(arg + 4);
-      if(num < 1) num = 1;
-      options.ranstatewz = num + (options.ranstatewz & 0xFFFF0000);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'r' && arg[3] == 'm'
-             && arg[4] >= '0' && arg[4] <= '9') {
-      options.ranstatemod = atoi(arg + 4);
-      if (options.ranstatemod < 1) options.ranstatemod = 1;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'm' && arg[3] == 'u'
-             && arg[4] == 'i' && arg[5] >= '0' && arg[5] <= '9') {
-      options.maxfailiterations = atoi(arg + 5);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'c' && arg[3] == 'b'
-             && arg[4] == 's' && arg[5] != '\0') {
-      if(arg[5] == 'f' && arg[6] == 'i' && arg[7] == 'l' && arg[8] == 'e'
-      && arg[9] != '\0') {
-        const char *cbsfile = arg+9;
-        FILE* file = fopen(cbsfile, "rb");
-        char* filedata = NULL;
-        size_t size;
-        if(file==NULL) {
-          fprintf(stderr,"Error: CBS file %s doesn't exist.\n",cbsfile);
-          return EXIT_FAILURE;
-        }
-        fseeko(file,0,SEEK_END);
-        size=ftello(file);
-        if(size>0) {
-          filedata = (char *) malloc((size+1) * sizeof(char*));
-          rewind(file);
-          if(fread(filedata,1,size,file)) {}
-          filedata[size]='\0';
-          ParseCustomBlockBoundaries(&binoptions.custblocksplit,filedata);
-          free(filedata);
-        } else {
-          fprintf(stderr,"Error: CBS file %s seems empty.\n",cbsfile);
-          return EXIT_FAILURE;
-        }
-        fclose(file);
-      } else {
-        ParseCustomBlockBoundaries(&binoptions.custblocksplit,arg+5);
-      }
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'c' && arg[3] == 'b'
-             && arg[4] == 'd' && arg[5] != '\0') {
-       binoptions.dumpsplitsfile = arg+5;
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'v' && arg[3] >= '0'
-             && arg[3] <= '9') {
-      options.verbose = atoi(arg + 3);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'b' && arg[3] >= '0'
-             && arg[3] <= '9') {
-      binoptions.blocksize = atoi(arg + 3);
-    }  else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'n' && arg[3] >= '0'
-             && arg[3] <= '9') {
-      binoptions.numblocks = atoi(arg + 3);
+    else if (StringsEqual(arg, "--serve")) servepath = ZOPFLI_SERVE_SOCKET;
+    else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 's' && arg[3] == 'e'
+          && arg[4] == 'r' && arg[5] == 'v' && arg[6] == 'e' && arg[7] != '\0') {
+      servepath = arg + 7;
+    } else if (arg[0] == '-' && arg[1] == '-' && arg[2] == 'j' && arg[3] == 'o'
+            && arg[4] == 'b' && arg[5] == 's' && arg[6] >= '0' && arg[6] <= '9') {
+      numjobs = atoi(arg + 6);
+      if (numjobs < 1) numjobs = 1;
     }
     else if (arg[0] == '-' && (arg[1] == 'h' || arg[1] == '?' || (arg[1] == '-'
          && (arg[2] == 'h' || arg[2] == '?')))) {
       VersionInfo();
       fprintf(stderr,
-          "Usage: zopfli [OPTIONS] FILE\n\n"
+          "Usage: zopfli [OPTIONS] FILE (- streams stdin to stdout)\n\n"
           "      GENERAL OPTIONS:\n"
           "  --dir         accept directory as input, requires: --zip\n"
           "  --h           shows this help (--?, -h, -?)\n"
@@ -810,14 +1074,17 @@ int main(int argc, char* argv[]) {
       fprintf(stderr,
           "      TIME SPENT CONTROL:\n"
           "  --i#          perform # iterations (d: 15; 0 => 4.2 billion)\n"
-          "  --mui#        maximum unsucessful iterations after last best (d: 0)\n\n");
+          "  --mui#        maximum unsucessful iterations after last best (d: 0)\n"
+          "  --budget#     share # iterations per block between all blocks (d: 0)\n"
+          "  --deadline#   write best so far after # seconds per file (d: 0)\n\n");
       fprintf(stderr,
           "      AUTOMATIC BLOCK SPLITTER CONTROL:\n"
           "  --bsr#        block splitting recursion (min: 2, d: 9)\n"
           "  --mb#         maximum blocks, 0 = unlimited (d: 15)\n"
           "  --mls#        maximum length score (d: 1024)\n"
           "  --nosplitlast don't use last splitting after compression\n"
-          "  --slowsplit   always use expensive fixed block calculations\n\n");
+          "  --slowsplit   always use expensive fixed block calculations\n"
+          "  --dpsplit     find best split points among candidates at once\n\n");
       fprintf(stderr,
           "      MANUAL BLOCK SPLITTER CONTROL:\n"
           "  --b#          block size in bytes\n"
@@ -834,7 +1101,8 @@ int main(int argc, char* argv[]) {
           "  --brotli      use Brotli Huffman optimization\n"
           "  --lazy        lazy matching in Greedy LZ77\n"
           "  --ohh         optymize huffman header\n"
-          "  --rc          reverse counts ordering in bit length calculations\n\n");
+          "  --rc          reverse counts ordering in bit length calculations\n"
+          "  --prescan     store blocks a quick scan finds incompressible\n\n");
       fprintf(stderr,
           "      OUTPUT CONTROL:\n"
           "  --c           output to stdout\n"
@@ -842,14 +1110,21 @@ int main(int argc, char* argv[]) {
           "  --gzip        output to gzip format (default)\n"
           "  --gzipname    output to gzip format with filename\n"
           "  --zip         output to zip format\n"
-          "  --zlib        output to zlib format\n\n");
+          "  --zlib        output to zlib format\n"
+          "  --dict#       use file # as preset dictionary, --zlib or --deflate\n\n");
       fprintf(stderr,
           "      MISCELLANEOUS:\n"
           "  --t#          compress using # threads, 0 = compat. (d:1)\n"
           "  --idle        use idle process priority\n"
-          "  --pass#       recompress last split points max # times (d: 0)\n");
+          "  --serve#      take jobs on socket # (d: " ZOPFLI_SERVE_SOCKET ")\n"
+          "  --jobs#       jobs --serve# runs at once (d: 1)\n"
+          "  --pass#       recompress last split points max # times (d: 0)\n"
+          "  --warmstart   start --pass# blocks from stats of the last round\n");
       fprintf(stderr,
           "  --statsdb     use file-based best stats / block database\n"
+          "  --similar     start new blocks from stats of similar --statsdb blocks\n"
+          "  --parsedb     use file-based final LZ77 parse / block database\n"
+          "  --resume      checkpoint to databases, resume where killed run stopped\n"
           "  --rui         run weighted stats after this many unsuccessful randoms (d:0)\n"
           "  --si#         stats to laststats in weight calculations (d: 100, max: 149)\n"
           "  --cmwc        use Complementary-Multiply-With-Carry rand. gen.\n"
@@ -866,12 +1141,53 @@ int main(int argc, char* argv[]) {
 
   if(options.verbose) VersionInfo();
 
+  if(options.dictionary != NULL && (output_type == ZOPFLI_FORMAT_GZIP
+     || output_type == ZOPFLI_FORMAT_GZIP_NAME || output_type == ZOPFLI_FORMAT_ZIP)) {
+    fprintf(stderr, "Error: --dict# works only with --zlib or --deflate.\n");
+    return EXIT_FAILURE;
+  }
+
   if((options.mode & 0x0100) && options.verbose) {
-    fprintf(stderr, "Info: Using Best Stats database (ZopfliDB directory)\n");
+    fprintf(stderr, "Info: Using Best Stats database (ZopfliDB.dat file)\n");
+  }
+  if((options.mode & 0x0400) && options.verbose) {
+    fprintf(stderr, "Info: Using LZ77 parse database (ZopfliLZ.dat file)\n");
+  }
+
+  if (servepath) {
+    ZopfliServeDefaults defaults;
+    int served;
+    for (i = 1; i < argc; i++) {
+      if (argv[i][0] != '-' || StringsEqual(argv[i], "-")) {
+        fprintf(stderr, "Error: --serve# takes no files, jobs name them.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    if (binoptions.custblocksplit != NULL || binoptions.dumpsplitsfile != NULL
+        || binoptions.usescandir || output_to_stdout) {
+      fprintf(stderr, "Error: --cbs#, --cbd#, --dir and --c don't work with --serve#.\n");
+      return EXIT_FAILURE;
+    }
+    defaults.options = options;
+    defaults.binoptions = binoptions;
+    defaults.output_type = output_type;
+    /* Jobs of several clients share stderr, they ask for --v# if needed. */
+    defaults.options.verbose = 0;
+    served = ZopfliServe(servepath, numjobs, &finishwork, ServeJob, &defaults,
+                         options.verbose);
+    free((unsigned char*)options.dictionary);
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
   for (i = 1; i < argc; i++) {
-    if (argv[i][0] != '-') {
+    if (StringsEqual(argv[i], "-")) {
+      filename = argv[i];
+      if(binoptions.usescandir) {
+        fprintf(stderr, "Error: --dir can't read from stdin (-).\n");
+        return EXIT_FAILURE;
+      }
+      if(!CompressStdin(&options, &binoptions, output_type)) return EXIT_FAILURE;
+    } else if (argv[i][0] != '-') {
       char* outfilename;
       filename = argv[i];
       if (output_to_stdout) {
@@ -917,5 +1233,7 @@ int main(int argc, char* argv[]) {
      return EXIT_FAILURE;
   }
 
+  free((unsigned char*)options.dictionary);
+
   return EXIT_SUCCESS;
 }
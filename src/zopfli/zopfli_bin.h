@@ -62,6 +62,12 @@ typedef struct ZopfliBinOptions {
   */
   int additionalautosplits;
 
+  /*
+  Seconds every file may take at most, 0 for no limit. When they're up, the
+  best found so far is written.
+  */
+  unsigned int deadline;
+
 } ZopfliBinOptions;
 
 typedef struct ZipCDIR {
@@ -26,10 +26,11 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "gzip_container.h"
 #include "zip_container.h"
 #include "zlib_container.h"
-#include "inthandler.h"
+#include "stream.h"
+#include "util.h"
 #include <stdio.h>
-
-void intHandler(int exit_code);
+#include <string.h>
+#include <pthread.h>
 
 /* You can use this function in Your own lib calls/applications.
    ZopfliFormat is required but can be passed as simple number.
@@ -55,13 +56,13 @@ DLL_PUBLIC void ZopfliCompress(ZopfliOptions* options, const ZopfliFormat output
     fprintf(stderr,"Critical Error: one or more required pointers are NULL\n");
     exit(EXIT_FAILURE);
   } else {
-    ZopfliOptions* optionslib = (ZopfliOptions*)malloc(sizeof(*optionslib));
+    ZopfliOptions defaults;
+    ZopfliOptions* optionslib = options;
+    const ZopfliAllocator* previous = ZopfliBindAllocator(options);
     if(options == NULL) {
-      ZopfliInitOptions(optionslib);
-      optionslib->verbose = 0;
-    } else {
-      optionslib = options;
-      mui = options->maxfailiterations;
+      ZopfliInitOptions(&defaults);
+      defaults.verbose = 0;
+      optionslib = &defaults;
     }
     if (output_type == ZOPFLI_FORMAT_GZIP || output_type == ZOPFLI_FORMAT_GZIP_NAME) {
       ZopfliGzipCompress(optionslib, in, insize, out, outsize, sp, moredata);
@@ -77,8 +78,241 @@ DLL_PUBLIC void ZopfliCompress(ZopfliOptions* options, const ZopfliFormat output
       fprintf(stderr,"Error: No output format specified.\n");
       exit (EXIT_FAILURE);
     }
-    free(optionslib);
+    ZopfliSetAllocator(previous);
+  }
+}
+
+/* Same as ZopfliCompress, but gives up iterating seconds after the call. */
+DLL_PUBLIC void ZopfliCompressDeadline(const ZopfliOptions* options,
+                    const ZopfliFormat output_type,
+                    const unsigned char* in, size_t insize,
+                    unsigned char** out, size_t* outsize, ZopfliPredefinedSplits* sp,
+                    const ZopfliAdditionalData* moredata, double seconds) {
+  ZopfliOptions optionslib;
+  if(options == NULL) {
+    ZopfliInitOptions(&optionslib);
+    optionslib.verbose = 0;
+  } else {
+    optionslib = *options;
+  }
+  optionslib.deadline = ZopfliGetTime() + seconds;
+  ZopfliCompress(&optionslib, output_type, in, insize, out, outsize, sp, moredata);
+}
+
+/*
+Every master block is at most as big as its stored blocks (see DeflatePart),
+which add 5 bytes per 65535 bytes of input and per master block.
+*/
+DLL_PUBLIC size_t ZopfliCompressBound(size_t insize,
+                    const ZopfliFormat output_type,
+                    const ZopfliAdditionalData* moredata) {
+  size_t chunks = insize / 65535 + insize / ZOPFLI_STREAM_BLOCK_SIZE + 1;
+  size_t bound = insize + 5 * chunks;
+  size_t namesize = 0;
+  if(moredata != NULL && moredata->filename != NULL) {
+    namesize = strlen(moredata->filename);
+  }
+  if(output_type == ZOPFLI_FORMAT_GZIP || output_type == ZOPFLI_FORMAT_GZIP_NAME) {
+    bound += 18 + (namesize > 0 ? namesize + 1 : 0);
+  } else if(output_type == ZOPFLI_FORMAT_ZLIB) {
+    /* Header, DICTID of a dictionary and Adler-32. */
+    bound += 10;
+  } else if(output_type == ZOPFLI_FORMAT_ZIP) {
+    /* Local header, central directory and its end, 8 hex digits of name. */
+    bound += 98 + 2 * (moredata == NULL ? 8 : namesize);
+  }
+  return bound;
+}
+
+DLL_PUBLIC void ZopfliCompressToSink(const ZopfliOptions* options,
+                    const ZopfliFormat output_type,
+                    const unsigned char* in, size_t insize,
+                    const ZopfliAdditionalData* moredata,
+                    ZopfliStreamSink* sink, void* context) {
+  if(output_type == ZOPFLI_FORMAT_ZIP) {
+    /* The local header needs the compressed size, so it all goes at once. */
+    ZopfliOptions optionslib;
+    const ZopfliAllocator* previous = ZopfliBindAllocator(options);
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    if(options == NULL) {
+      ZopfliInitOptions(&optionslib);
+      optionslib.verbose = 0;
+    } else {
+      optionslib = *options;
+    }
+    ZopfliCompress(&optionslib, output_type, in, insize, &out, &outsize,
+                   NULL, moredata);
+    sink(context, out, outsize);
+    ZopfliFree(out);
+    ZopfliSetAllocator(previous);
+  } else {
+    ZopfliStream* stream = ZopfliStreamInit(options, output_type, moredata,
+                                            sink, context);
+    ZopfliStreamCompress(stream, in, insize);
+    ZopfliStreamFinish(stream);
+  }
+}
+
+typedef struct ZopfliBufferSink {
+  unsigned char* out;
+  size_t outsize;
+  size_t size;
+} ZopfliBufferSink;
+
+/* Copies into the buffer while it fits, counts the size either way. */
+static void BufferSink(void* context, const unsigned char* data, size_t size) {
+  ZopfliBufferSink* b = (ZopfliBufferSink*)context;
+  if(b->size <= b->outsize && size <= b->outsize - b->size) {
+    memcpy(b->out + b->size, data, size);
+  }
+  b->size += size;
+}
+
+DLL_PUBLIC size_t ZopfliCompressToBuffer(const ZopfliOptions* options,
+                    const ZopfliFormat output_type,
+                    const unsigned char* in, size_t insize,
+                    const ZopfliAdditionalData* moredata,
+                    unsigned char* out, size_t outsize) {
+  ZopfliBufferSink b;
+  b.out = out;
+  b.outsize = outsize;
+  b.size = 0;
+  ZopfliCompressToSink(options, output_type, in, insize, moredata,
+                       BufferSink, &b);
+  return b.size <= outsize ? b.size : 0;
+}
+
+typedef struct ZopfliBatch {
+  ZopfliOptions options;
+  ZopfliFormat output_type;
+  const ZopfliBatchItem* items;
+  ZopfliBatchCallback* callback;
+  void* context;
+
+  /* Item numbers, largest input first. */
+  size_t* order;
+  size_t numitems;
+  size_t next;
+  unsigned workers;
+  /* Threads the items being compressed use, out of options.numthreads. */
+  unsigned busy;
+  pthread_mutex_t mutex;
+  const ZopfliAllocator* allocator;
+} ZopfliBatch;
+
+typedef struct ZopfliBatchOrder {
+  size_t insize;
+  size_t item;
+} ZopfliBatchOrder;
+
+static int BatchOrderCompare(const void* a, const void* b) {
+  size_t sa = ((const ZopfliBatchOrder*)a)->insize;
+  size_t sb = ((const ZopfliBatchOrder*)b)->insize;
+  return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/* Takes the next item until none is left. */
+static void *BatchThread(void *a) {
+  ZopfliBatch* batch = (ZopfliBatch*)a;
+  ZopfliSetAllocator(batch->allocator);
+  for(;;) {
+    ZopfliOptions o = batch->options;
+    const ZopfliBatchItem* item;
+    size_t i, left;
+    unsigned share, spare;
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    pthread_mutex_lock(&batch->mutex);
+    if(batch->next >= batch->numitems) {
+      pthread_mutex_unlock(&batch->mutex);
+      break;
+    }
+    i = batch->order[batch->next++];
+    left = batch->numitems - batch->next + 1;
+
+    /* The last items also get the threads that have no item left, but never
+    more than the items still running leave free. */
+    share = left < batch->options.numthreads ?
+            (unsigned)(batch->options.numthreads / left) : 1;
+    spare = batch->options.numthreads - batch->busy;
+    if(share > spare) share = spare;
+    if(share < 1) share = 1;
+    batch->busy += share;
+    pthread_mutex_unlock(&batch->mutex);
+
+    /* With a single thread the item compresses inline, so no dispatcher
+    thread runs next to its block thread. */
+    o.numthreads = share > 1 ? share : 0;
+    item = &batch->items[i];
+    ZopfliCompress(&o, batch->output_type, item->in, item->insize,
+                   &out, &outsize, NULL, item->moredata);
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->busy -= share;
+    pthread_mutex_unlock(&batch->mutex);
+    batch->callback(batch->context, i, out, outsize);
+    ZopfliFree(out);
+  }
+  return 0;
+}
+
+DLL_PUBLIC void ZopfliCompressBatch(const ZopfliOptions* options,
+                    const ZopfliFormat output_type,
+                    const ZopfliBatchItem* items, size_t numitems,
+                    ZopfliBatchCallback* callback, void* context) {
+  ZopfliBatch batch;
+  ZopfliBatchOrder* order;
+  pthread_t* thr;
+  const ZopfliAllocator* previous;
+  size_t i;
+  if(numitems == 0) return;
+  if(items == NULL || callback == NULL) {
+    fprintf(stderr,"Critical Error: one or more required pointers are NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  if(options == NULL) {
+    ZopfliInitOptions(&batch.options);
+    batch.options.verbose = 0;
+  } else {
+    batch.options = *options;
+  }
+  if(batch.options.numthreads == 0) batch.options.numthreads = 1;
+  previous = ZopfliBindAllocator(options);
+  batch.allocator = ZopfliGetAllocator();
+  batch.output_type = output_type;
+  batch.items = items;
+  batch.callback = callback;
+  batch.context = context;
+  batch.numitems = numitems;
+  batch.next = 0;
+  batch.busy = 0;
+  batch.workers = batch.options.numthreads > numitems ?
+                  (unsigned)numitems : batch.options.numthreads;
+
+  order = ZopfliMalloc(sizeof(*order) * numitems);
+  batch.order = ZopfliMalloc(sizeof(*batch.order) * numitems);
+  thr = ZopfliMalloc(sizeof(*thr) * batch.workers);
+  if(!order || !batch.order || !thr) exit(-1); /* Allocation failed. */
+  for(i = 0; i < numitems; ++i) {
+    order[i].insize = items[i].insize;
+    order[i].item = i;
+  }
+  qsort(order, numitems, sizeof(*order), BatchOrderCompare);
+  for(i = 0; i < numitems; ++i) batch.order[i] = order[i].item;
+  ZopfliFree(order);
+
+  pthread_mutex_init(&batch.mutex, NULL);
+  for(i = 0; i < batch.workers; ++i) {
+    pthread_create(&thr[i], NULL, BatchThread, &batch);
+  }
+  for(i = 0; i < batch.workers; ++i) {
+    pthread_join(thr[i], NULL);
   }
+  pthread_mutex_destroy(&batch.mutex);
+  ZopfliFree(thr);
+  ZopfliFree(batch.order);
+  ZopfliSetAllocator(previous);
 }
 #else
   typedef int dummy;
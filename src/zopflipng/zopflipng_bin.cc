@@ -49,14 +49,15 @@ static void IdlePriority() {
 #include "lodepng/lodepng.h"
 #include "zopflipng_lib.h"
 #include "lodepng/lodepng_util.h"
-#include "../zopfli/inthandler.h"
+
+static volatile sig_atomic_t finishwork = 0;
 
 void intHandlerpng(int exit_code) {
   if(exit_code==2) {
     fprintf(stderr,"                                                              \n"
                    " (!!) CTRL+C detected! Setting --mui to 1 to finish work ASAP!\n"
                    " (!!) Press it again to abort work.\n");
-    mui=1;
+    finishwork=1;
   }
 }
 
@@ -218,10 +219,12 @@ void ShowHelp() {
          "     CUSTOM ZOPFLIPNG OPTIONS:\n"
          "--v=[number]:    verbose level for zopfli (0-5, d:2)\n"
          "--mui=[number]:  maximum unsuccessful iterations after last best (d: 0)\n"
+         "--budget=[number]: share # iterations per block between all blocks (d: 0)\n"
          "--mb=[number]:   maximum blocks, 0 = unlimited (d: 15)\n"
          "--bsr=[number]:  block splitting recursion (min: 2, d: 9)\n"
          "--mls=[number]:  maximum length score (d: 1024)\n"
          "--slowsplit:     use expensive fixed block calculations\n"
+         "--dpsplit:       find best split points among candidates at once\n"
          "--nosplitlast:   don't use last splitting after compression\n"
          "--all:           use 16 combinations per block and take smallest size\n"
          "--brotli:        use Brotli Huffman optimization\n"
@@ -229,7 +232,10 @@ void ShowHelp() {
          "--ohh:           optymize huffman header\n"
          "--rc:            reverse counts ordering in bit length calculations\n"
          "--pass=[number]: recompress last split points max # times (d: 0)\n"
+         "--warmstart:     start --pass blocks from stats of the last round\n"
          "--statsdb:       use file-based best stats / block database\n"
+         "--parsedb:       use file-based final LZ77 parse / block database\n"
+         "--resume:        checkpoint to databases, resume where killed run stopped\n"
          "--rui=[number]   run weighted stats only after this many unsuccessful randoms (d:0)\n"
          "--si=[number]:   stats to laststats in weight calculations (d: 100, max: 149)\n"
          "--cmwc:          use Complementary-Multiply-With-Carry rand. gen.\n"
@@ -270,6 +276,7 @@ int main(int argc, char *argv[]) {
   }
 
   ZopfliPNGOptions png_options;
+  png_options.finish = &finishwork;
 
   // cmd line options
   bool always_zopflify = false;  // overwrite file even if we have bigger result
@@ -353,6 +360,14 @@ int main(int argc, char *argv[]) {
         png_options.mode |= 0x0080;
       } else if (name == "--statsdb") {
         png_options.mode |= 0x0100;
+      } else if (name == "--dpsplit") {
+        png_options.mode |= 0x0200;
+      } else if (name == "--parsedb") {
+        png_options.mode |= 0x0400;
+      } else if (name == "--resume") {
+        png_options.mode |= 0x0D00;
+      } else if (name == "--warmstart") {
+        png_options.mode |= 0x1000;
       } else if (name == "--iterations") {
         png_options.num_iterations = num;
         png_options.num_iterations_large = num;
@@ -371,6 +386,9 @@ int main(int argc, char *argv[]) {
       } else if (name == "--mui") {
         if (num < 0) num = 0;
         png_options.maxfailiterations = num;
+      } else if (name == "--budget") {
+        if (num < 0) num = 0;
+        png_options.budget = num;
       } else if (name == "--v") {
         if (num < 0) num = 1;
         png_options.verbose = num;
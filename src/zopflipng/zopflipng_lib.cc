@@ -34,12 +34,9 @@ See zopflipng_lib.h
 
 #include "lodepng/lodepng.h"
 #include "lodepng/lodepng_util.h"
-#include "../zopfli/inthandler.h"
 #include "../zopfli/deflate.h"
 #include "../zopfli/util.h"
 
-unsigned int mui;
-
 ZopfliPNGOptions::ZopfliPNGOptions()
   : lossy_transparent(0)
   , lossy_8bit(false)
@@ -60,6 +57,9 @@ ZopfliPNGOptions::ZopfliPNGOptions()
   , numthreads(1)
   , rui(0)
   , statimportance(100)
+  , budget(0)
+  , finish(NULL)
+  , allocator(NULL)
   , try_paletteless_size(2048)
   , ga_population_size(19)
   , ga_max_evaluations(0)
@@ -69,6 +69,34 @@ ZopfliPNGOptions::ZopfliPNGOptions()
   , ga_number_of_offspring(2) {
 }
 
+// LodePNG is built with LODEPNG_NO_COMPILE_ALLOCATORS, so it allocates through
+// Zopfli as well and frees the deflate output of CustomPNGDeflate with the
+// allocator that made it.
+void* lodepng_malloc(size_t size) {
+  return ZopfliMalloc(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+  return ZopfliRealloc(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+  ZopfliFree(ptr);
+}
+
+// Binds an allocator, if not NULL, to the calling thread while in scope.
+class AllocatorScope {
+ public:
+  explicit AllocatorScope(const ZopfliAllocator* allocator)
+      : previous_(ZopfliGetAllocator()) {
+    if (allocator) ZopfliSetAllocator(allocator);
+  }
+  ~AllocatorScope() { ZopfliSetAllocator(previous_); }
+
+ private:
+  const ZopfliAllocator* previous_;
+};
+
 // Deflate compressor passed as fuction pointer to LodePNG to have it use Zopfli
 // as its compression backend.
 unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
@@ -86,7 +114,7 @@ unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
   options.blocksplittingmax = png_options->blocksplittingmax;
   options.lengthscoremax    = png_options->lengthscoremax;
   options.verbose           = png_options->verbose;
-  mui                       = png_options->maxfailiterations;
+  options.maxfailiterations = png_options->maxfailiterations;
   options.findminimumrec    = png_options->findminimumrec;
   options.ranstatewz        = png_options->ranstatewz;
   options.ranstatemod       = png_options->ranstatemod;
@@ -95,6 +123,9 @@ unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
   options.numthreads        = png_options->numthreads;
   options.rui               = png_options->rui;
   options.statimportance    = png_options->statimportance;
+  options.budget            = png_options->budget;
+  options.finish            = png_options->finish;
+  options.allocator         = png_options->allocator;
 
   ZopfliDeflate(&options, 2 /* Dynamic */, 1, in, insize, &bp, out, outsize, 0);
 
@@ -640,6 +671,9 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
     const ZopfliPNGOptions& png_options,
     int verbose,
     std::vector<unsigned char>* resultpng) {
+  // Declared first, so the LodePNG states below are freed while it's bound
+  AllocatorScope scope(png_options.allocator);
+
   // Use the largest possible deflate window size
   int windowsize = 32768;
 
@@ -1007,6 +1041,9 @@ extern "C" void CZopfliPNGSetDefaults(CZopfliPNGOptions* png_options) {
   png_options->numthreads               = opts.numthreads;
   png_options->rui                      = opts.rui;
   png_options->statimportance           = opts.statimportance;
+  png_options->budget                   = opts.budget;
+  png_options->finish                   = opts.finish;
+  png_options->allocator                = opts.allocator;
   png_options->try_paletteless_size     = opts.try_paletteless_size;
   png_options->ga_population_size       = opts.ga_population_size;
   png_options->ga_max_evaluations       = opts.ga_max_evaluations;
@@ -1042,7 +1079,11 @@ extern "C" int CZopfliPNGOptimize(const unsigned char* origpng,
   opts.pass                     = png_options->pass;
   opts.mode                     = png_options->mode;
   opts.numthreads               = png_options->numthreads;
+  opts.rui                      = png_options->rui;
   opts.statimportance           = png_options->statimportance;
+  opts.budget                   = png_options->budget;
+  opts.finish                   = png_options->finish;
+  opts.allocator                = png_options->allocator;
   opts.try_paletteless_size     = png_options->try_paletteless_size;
   opts.ga_population_size       = png_options->ga_population_size;
   opts.ga_max_evaluations       = png_options->ga_max_evaluations;
@@ -1080,8 +1121,9 @@ extern "C" int CZopfliPNGOptimize(const unsigned char* origpng,
     return ret;
   }
 
+  AllocatorScope scope(opts.allocator);
   *resultpng_size = resultpng_cc.size();
-  *resultpng      = (unsigned char*) malloc(resultpng_cc.size());
+  *resultpng      = (unsigned char*) ZopfliMalloc(resultpng_cc.size());
   if (!(*resultpng)) {
     return ENOMEM;
   }
@@ -39,6 +39,9 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <signal.h>
+
+#include "../zopfli/zopfli.h"
 
 enum ZopfliPNGFilterStrategy {
   kStrategyZero = 0,
@@ -150,6 +153,12 @@ typedef struct CZopfliPNGOptions {
     
   int statimportance;
 
+  unsigned int budget;
+
+  const volatile sig_atomic_t* finish;
+
+  const ZopfliAllocator* allocator;
+
   int try_paletteless_size;
 
   int ga_population_size;
@@ -171,7 +180,7 @@ typedef struct CZopfliPNGOptions {
 void CZopfliPNGSetDefaults(CZopfliPNGOptions *png_options);
 
 // Returns 0 on success, error code otherwise
-// The caller must free resultpng after use
+// The caller must free resultpng after use, with the free of allocator if set
 int CZopfliPNGOptimize(const unsigned char* origpng,
     const size_t origpng_size,
     const CZopfliPNGOptions* png_options,
@@ -308,6 +317,20 @@ struct ZopfliPNGOptions {
   */
   int statimportance;
 
+  /*
+  Iterations per block on average that all blocks share, handed out to the
+  blocks that gain the most from them. 0 disables it.
+  */
+  unsigned int budget;
+
+  // Flag of the caller that makes the optimization finish as soon as possible
+  // once set to non-zero, e.g. by a SIGINT handler. NULL for none.
+  const volatile sig_atomic_t* finish;
+
+  // Memory functions for Zopfli and LodePNG during the optimization, NULL for
+  // malloc, realloc and free. Memory of the std containers isn't covered.
+  const ZopfliAllocator* allocator;
+
   // Maximum size after which to try full color image compression on paletted image
   int try_paletteless_size;
 